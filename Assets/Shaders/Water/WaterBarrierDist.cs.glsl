@@ -1,9 +1,7 @@
 layout(local_size_x=64, local_size_y=1, local_size_z=1) in;
 
-layout(binding=0, std430) readonly buffer ParticlePosBuf
-{
-	vec4 particlePositions[];
-};
+#define PARTICLE_DATA_BINDING 0
+#include "WaterParticleData.glh"
 
 layout(binding=1, std430) readonly buffer ParticleGravityBuf
 {
@@ -15,7 +13,9 @@ layout(binding=2, r32ui) uniform uimage2D distancesImage;
 layout(push_constant) uniform PC
 {
 	mat4 barrierTransform;
+	vec3 compactPositionMin;
 	uint barrierBlockedGravity;
+	vec3 compactPositionRange;
 };
 
 const float UINT_MAX = 4294967296.0;
@@ -27,7 +27,8 @@ void main()
 	if (particleDown == barrierBlockedGravity)
 	{
 		vec3 barrierWP = (barrierTransform * vec4(gl_GlobalInvocationID.yz, 0, 1)).xyz;
-		float dst = distance(barrierWP, particlePositions[gl_GlobalInvocationID.x].xyz);
+		vec3 particlePos = loadParticle(gl_GlobalInvocationID.x, compactPositionMin, compactPositionRange, 0).xyz;
+		float dst = distance(barrierWP, particlePos);
 		uint dstI = uint(min(dst, 1) * (UINT_MAX - 1));
 		imageAtomicMin(distancesImage, ivec2(gl_GlobalInvocationID.yz), dstI);
 	}
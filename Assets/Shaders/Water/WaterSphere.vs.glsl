@@ -12,13 +12,16 @@ layout(location=0) in vec2 position_in;
 layout(location=0) out vec2 spritePos_out;
 layout(location=1) out vec3 eyePos_out;
 
-#ifdef VDepthMax
-const float Z_SHIFT_ES = -PARTICLE_RADIUS;
-
 layout(push_constant) uniform PC
 {
-	uint lastParticleIndex;	
+	vec3 compactPositionMin;
+	float compactGlowTimeBase;
+	vec3 compactPositionRange;
+	uint lastParticleIndex;
 };
+
+#ifdef VDepthMax
+const float Z_SHIFT_ES = -PARTICLE_RADIUS;
 #endif
 
 #ifdef VDepthMin
@@ -27,10 +30,8 @@ const float GLOW_DURATION = 0.5;
 const float Z_SHIFT_ES = PARTICLE_RADIUS;
 #endif
 
-layout(binding=1, std430) readonly buffer ParticlesBuffer
-{
-	vec4 particleData[];
-};
+#define PARTICLE_DATA_BINDING 1
+#include "WaterParticleData.glh"
 
 void main()
 {
@@ -40,14 +41,16 @@ void main()
 	uint dataIndex = lastParticleIndex - gl_InstanceIndex;
 #endif
 	
+	vec4 particle = loadParticle(dataIndex, compactPositionMin, compactPositionRange, compactGlowTimeBase);
+	
 	spritePos_out = position_in;
 	
-	vec3 eyePosCenter = (renderSettings.viewMatrix * vec4(particleData[dataIndex].xyz, 1.0)).xyz;
+	vec3 eyePosCenter = (renderSettings.viewMatrix * vec4(particle.xyz, 1.0)).xyz;
 	
 	eyePos_out = eyePosCenter + vec3(position_in * PARTICLE_RADIUS, 0);
 	
 #ifdef VDepthMin
-	glowIntensity_out = 1 - clamp(((renderSettings.gameTime + 100) - particleData[dataIndex].w) / GLOW_DURATION, 0, 1);
+	glowIntensity_out = 1 - clamp(((renderSettings.gameTime + 100) - particle.w) / GLOW_DURATION, 0, 1);
 #endif
 	
 	gl_Position = renderSettings.projectionMatrix * vec4(eyePos_out.xyz, 1.0);
@@ -1,10 +1,12 @@
 #include "Game.hpp"
 
 #include <fstream>
+#include <iomanip>
 
 #include "Editor/Editor.hpp"
 #include "GameState.hpp"
 #include "Graphics/GraphicsCommon.hpp"
+#include "Graphics/Water/WaterBenchmark.hpp"
 #include "Graphics/WallShader.hpp"
 #include "ImGui.hpp"
 #include "Levels.hpp"
@@ -144,6 +146,65 @@ Game::Game()
 				list.Add(level.name);
 		});
 
+#ifdef IOMOMI_ENABLE_WATER
+	RegisterWaterBenchmarkCommands();
+
+	eg::console::AddCommand(
+		"waterStats", 0,
+		[](std::span<const std::string_view> args, eg::console::Writer& writer)
+		{
+			const IWaterSimulator* waterSim = GameRenderer::instance->m_waterSimulator.get();
+			if (waterSim == nullptr)
+			{
+				writer.WriteLine(eg::console::ErrorColor, "There is no water in the current level");
+				return;
+			}
+
+			const WaterSimStatsSummary stats = waterSim->GetStats();
+
+			auto RangeString = [](const WaterSimStatRange& range)
+			{
+				std::ostringstream stream;
+				stream << std::fixed << std::setprecision(3) << range.min << "/" << range.avg << "/" << range.max;
+				return stream.str();
+			};
+
+			writer.WriteLine(
+				eg::console::InfoColor,
+				"Water stats over the last " + std::to_string(stats.numSteps) + " steps (min/avg/max):");
+			writer.WriteLine(eg::console::InfoColor, "  Step: " + RangeString(stats.stepTime) + "ms");
+			for (size_t s = 0; s < NUM_WATER_SIM_STAGES; s++)
+			{
+				writer.WriteLine(
+					eg::console::InfoColor,
+					"  " + std::string(WATER_SIM_STAGE_NAMES[s]) + ": " + RangeString(stats.stageTimes[s]) + "ms");
+			}
+			writer.WriteLine(eg::console::InfoColor, "  Query: " + RangeString(stats.queryTime) + "ms");
+			writer.WriteLine(eg::console::InfoColor, "  Substeps: " + RangeString(stats.numSubsteps));
+			writer.WriteLine(
+				eg::console::InfoColor, "  Neighbours per sphere: " + RangeString(stats.neighboursPerParticle));
+			writer.WriteLine(
+				eg::console::InfoColor, "  Spheres outside partition grid: " + RangeString(stats.particlesOutsideGrid));
+
+			// Busy times only include stages that the thread worked on
+			for (size_t t = 0; t < stats.threadBarrierWaitTimes.size(); t++)
+			{
+				std::string message = "  Thread " + std::to_string(t) +
+				                      ": barrier wait " + RangeString(stats.threadBarrierWaitTimes[t]) + "ms";
+				for (size_t s = 0; s < NUM_WATER_SIM_STAGES; s++)
+				{
+					if (stats.threadStageBusyTimes[t][s].max > 0)
+					{
+						message += ", ";
+						message += WATER_SIM_STAGE_NAMES[s];
+						message += " " + RangeString(stats.threadStageBusyTimes[t][s]) + "ms";
+					}
+				}
+				writer.WriteLine(eg::console::InfoColor, message);
+			}
+		});
+#endif
+
 	InitializeWallShader();
 }
 
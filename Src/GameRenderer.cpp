@@ -272,7 +272,8 @@ void GameRenderer::Render(
 		auto cpuTimerWater = eg::StartCPUTimer("Water (early)");
 		eg::DC.DebugLabelBegin("Water (early)");
 		m_renderCtx->waterRenderer.RenderEarly(
-			m_waterSimulator->GetPositionsGPUBuffer(), numWaterParticles, m_rtManager);
+			m_waterSimulator->GetPositionsGPUBuffer(), numWaterParticles, m_waterSimulator->GetParticleDataLayout(),
+			m_rtManager);
 		eg::DC.DebugLabelEnd();
 	}
 
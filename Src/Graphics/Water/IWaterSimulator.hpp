@@ -1,7 +1,9 @@
 #pragma once
 
 #include "../../World/Dir.hpp"
+#include "WaterCompactParticle.hpp"
 #include "WaterQueryResults.hpp"
+#include "WaterSimStats.hpp"
 
 class IWaterSimulator
 {
@@ -29,6 +31,9 @@ public:
 	virtual eg::BufferRef GetGravitiesGPUBuffer() const = 0;
 	virtual void EnableGravitiesGPUBuffer() = 0;
 
+	// Returns how particles are stored in the positions buffer for the current frame
+	virtual WaterParticleDataLayout GetParticleDataLayout() const = 0;
+
 	virtual uint32_t NumParticles() const = 0;
 	virtual uint32_t NumParticlesToDraw() const = 0;
 
@@ -37,11 +42,28 @@ public:
 	// Returns the number of nanoseconds for the last update
 	virtual uint64_t LastUpdateTime() const = 0;
 
+	// Returns the number of particles that were asleep in the last step
+	virtual uint32_t NumSleepingParticles() const = 0;
+
+#ifdef IOMOMI_ENABLE_WATER
+	// Returns timings and counters over the most recent steps
+	virtual WaterSimStatsSummary GetStats() const = 0;
+#endif
+
 	virtual bool IsPresimComplete() = 0;
 };
 
 std::unique_ptr<IWaterSimulator> CreateWaterSimulator(class World& world);
 
+#ifdef IOMOMI_ENABLE_WATER
+// Generates the initial water particles for all water planes in the world
+std::vector<glm::vec3> GenerateWater(class World& world);
+
+// Appends the water blockers and the running pumps in the world, in the form used by the simulator
+void CollectWaterBlockers(const class World& world, std::vector<struct WaterBlocker>& blockersOut);
+void CollectWaterPumps(const class World& world, std::vector<struct WaterPumpDescription>& pumpsOut);
+#endif
+
 inline std::pair<float, glm::vec3> WaterRayIntersect(const IWaterSimulator* simulator, const eg::Ray& ray)
 {
 	if (simulator == nullptr)
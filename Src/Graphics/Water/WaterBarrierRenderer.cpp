@@ -16,12 +16,23 @@ static constexpr uint32_t LOCAL_SIZE_FADE = 8;
 
 WaterBarrierRenderer::WaterBarrierRenderer()
 {
+	// Sets COMPACT_PARTICLES in WaterParticleData.glh
+	eg::SpecializationConstantEntry compactSpecConstants[] = { { 152, 0, sizeof(uint32_t) } };
+	const uint32_t compactSpecConstantValues[] = { 0, 1 };
+
 	eg::ComputePipelineCreateInfo pipelineCI;
 	pipelineCI.computeShader.shaderModule =
 		eg::GetAsset<eg::ShaderModuleAsset>("Shaders/Water/WaterBarrierDist.cs.glsl").DefaultVariant();
+	pipelineCI.computeShader.specConstants = compactSpecConstants;
+	pipelineCI.computeShader.specConstantsDataSize = sizeof(uint32_t);
 	pipelineCI.setBindModes[0] = eg::BindMode::DescriptorSet;
-	m_calcPipeline = eg::Pipeline::Create(pipelineCI);
+	for (uint32_t compact = 0; compact < 2; compact++)
+	{
+		pipelineCI.computeShader.specConstantsData = &compactSpecConstantValues[compact];
+		m_calcPipelines[compact] = eg::Pipeline::Create(pipelineCI);
+	}
 
+	pipelineCI.computeShader = {};
 	pipelineCI.computeShader.shaderModule =
 		eg::GetAsset<eg::ShaderModuleAsset>("Shaders/Water/WaterBarrierFade.cs.glsl").DefaultVariant();
 	pipelineCI.setBindModes[0] = eg::BindMode::DescriptorSet;
@@ -43,6 +54,11 @@ void WaterBarrierRenderer::Init(IWaterSimulator* waterSimulator, World& world)
 {
 	m_barriers.clear();
 
+	// The layout only changes between frames in the glow time base, which is not used here
+	m_particleDataLayout =
+		waterSimulator != nullptr ? waterSimulator->GetParticleDataLayout() : WaterParticleDataLayout();
+	const eg::Pipeline& calcPipeline = m_calcPipelines[m_particleDataLayout.compact ? 1 : 0];
+
 	world.entManager.ForEachOfType<GravityBarrierEnt>(
 		[&](GravityBarrierEnt& entity)
 		{
@@ -76,9 +92,10 @@ void WaterBarrierRenderer::Init(IWaterSimulator* waterSimulator, World& world)
 			barrier.fadeTexture = eg::Texture::Create2D(textureCI);
 			entity.waterDistanceTexture = barrier.fadeTexture;
 
-			barrier.descriptorSetCalc = eg::DescriptorSet(m_calcPipeline, 0);
+			barrier.descriptorSetCalc = eg::DescriptorSet(calcPipeline, 0);
 			barrier.descriptorSetCalc.BindStorageBuffer(
-				waterSimulator->GetPositionsGPUBuffer(), 0, 0, waterSimulator->NumParticles() * sizeof(float) * 4);
+				waterSimulator->GetPositionsGPUBuffer(), 0, 0,
+				static_cast<uint64_t>(waterSimulator->NumParticles()) * m_particleDataLayout.BytesPerParticle());
 			barrier.descriptorSetCalc.BindStorageBuffer(
 				waterSimulator->GetGravitiesGPUBuffer(), 1, 0, waterSimulator->NumParticles());
 			barrier.descriptorSetCalc.BindStorageImage(barrier.tmpTexture, 2);
@@ -114,12 +131,15 @@ void WaterBarrierRenderer::Update(float dt)
 
 	eg::GPUTimer timer = eg::StartGPUTimer("Water Barrier Render");
 
-	eg::DC.BindPipeline(m_calcPipeline);
+	eg::DC.BindPipeline(m_calcPipelines[m_particleDataLayout.compact ? 1 : 0]);
 
+	// Should match the push constants in WaterBarrierDist.cs.glsl
 	struct PushConstants
 	{
 		glm::mat4 inverseBarrierTransform;
+		glm::vec3 compactPositionMin;
 		uint32_t blockedGravity;
+		glm::vec3 compactPositionRange;
 	};
 
 	for (Barrier& barrier : m_barriers)
@@ -139,7 +159,9 @@ void WaterBarrierRenderer::Update(float dt)
 
 		PushConstants pc;
 		pc.inverseBarrierTransform = barrier.transform;
+		pc.compactPositionMin = m_particleDataLayout.positionMin;
 		pc.blockedGravity = barrier.entity->BlockedAxis();
+		pc.compactPositionRange = m_particleDataLayout.positionRange;
 		eg::DC.PushConstants(0, pc);
 
 		eg::DC.BindDescriptorSet(barrier.descriptorSetCalc, 0);
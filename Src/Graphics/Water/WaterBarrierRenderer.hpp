@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../../World/Entities/EntTypes/GravityBarrierEnt.hpp"
+#include "WaterCompactParticle.hpp"
 
 class WaterBarrierRenderer
 {
@@ -13,7 +14,8 @@ public:
 
 private:
 #ifdef IOMOMI_ENABLE_WATER
-	eg::Pipeline m_calcPipeline;
+	// Indexed by whether particles are stored in the compact format
+	eg::Pipeline m_calcPipelines[2];
 	eg::Pipeline m_fadePipeline;
 
 	eg::Texture m_defaultTexture;
@@ -32,5 +34,6 @@ private:
 
 	uint32_t m_numParticles;
 	uint32_t m_dispatchCount;
+	WaterParticleDataLayout m_particleDataLayout;
 #endif
 };
@@ -0,0 +1,896 @@
+#ifdef IOMOMI_ENABLE_WATER
+
+#include "WaterBenchmark.hpp"
+#include "../../HashFNV1a64.hpp"
+#include "../../World/World.hpp"
+#include "IWaterSimulator.hpp"
+
+#include <charconv>
+#include <iomanip>
+#include <pcg_random.hpp>
+#include <sstream>
+
+WaterBenchmarkScene WaterBenchmarkScene::CreateFloodedRoom(uint32_t numParticles)
+{
+	const glm::ivec3 particlesPerVoxel = GENERATE_PARTICLES_PER_VOXEL;
+	const int particlesPerVoxelTotal = particlesPerVoxel.x * particlesPerVoxel.y * particlesPerVoxel.z;
+
+	// Selects a square floor and a water depth so that the room fits all particles while being half full
+	const int waterVoxels = (static_cast<int>(numParticles) + particlesPerVoxelTotal - 1) / particlesPerVoxelTotal;
+	const int floorSize = std::max(static_cast<int>(std::ceil(std::cbrt(2.0 * waterVoxels))), 1);
+	const int waterDepth = (waterVoxels + floorSize * floorSize - 1) / (floorSize * floorSize);
+	const glm::ivec3 roomSize(floorSize, waterDepth * 2 + 2, floorSize);
+
+	WaterBenchmarkScene scene;
+	scene.minBounds = glm::ivec3(-1);
+	scene.maxBounds = roomSize + 1;
+	scene.cameraPos = glm::vec3(scene.maxBounds) / 2.0f;
+
+	const glm::ivec3 worldSize = scene.maxBounds - scene.minBounds;
+	scene.isAirBuffer.resize((worldSize.x * worldSize.y * worldSize.z + 7) / 8);
+	for (int z = 0; z < roomSize.z; z++)
+	{
+		for (int y = 0; y < roomSize.y; y++)
+		{
+			for (int x = 0; x < roomSize.x; x++)
+			{
+				glm::ivec3 rel = glm::ivec3(x, y, z) - scene.minBounds;
+				size_t index = rel.x + rel.y * worldSize.x + rel.z * worldSize.x * worldSize.y;
+				scene.isAirBuffer[index / 8] |= static_cast<uint8_t>(1 << (index % 8));
+			}
+		}
+	}
+
+	// Generates particles layer by layer from the floor up, the same way as GenerateWater does for each voxel
+	std::uniform_real_distribution<float> offsetDist(0.3f, 0.7f);
+	pcg32_fast rng(0);
+	scene.particlePositions.reserve(numParticles);
+	const glm::ivec3 gridSize = glm::ivec3(roomSize.x, waterDepth, roomSize.z) * particlesPerVoxel;
+	for (int y = 0; y < gridSize.y; y++)
+	{
+		for (int z = 0; z < gridSize.z; z++)
+		{
+			for (int x = 0; x < gridSize.x; x++)
+			{
+				if (scene.particlePositions.size() == numParticles)
+					return scene;
+
+				glm::vec3 pos = glm::vec3(
+									static_cast<float>(x) + offsetDist(rng), static_cast<float>(y) + offsetDist(rng),
+									static_cast<float>(z) + offsetDist(rng)) /
+				                glm::vec3(particlesPerVoxel);
+				scene.particlePositions.push_back(pos);
+			}
+		}
+	}
+
+	return scene;
+}
+
+WaterBenchmarkScene WaterBenchmarkScene::CreateFromWorld(World& world)
+{
+	WaterBenchmarkScene scene;
+	const std::shared_ptr<const VoxelAirBitset> voxelAir = world.voxels.GetAirBitset();
+	scene.minBounds = voxelAir->MinBounds();
+	scene.maxBounds = voxelAir->MaxBounds();
+	scene.isAirBuffer.assign(voxelAir->Bytes().begin(), voxelAir->Bytes().end());
+	scene.particlePositions = GenerateWater(world);
+	scene.cameraPos = world.thumbnailCameraPos;
+	CollectWaterBlockers(world, scene.waterBlockers);
+	CollectWaterPumps(world, scene.waterPumps);
+	return scene;
+}
+
+void WaterBenchmarkScene::AddBarriers(uint32_t numBarriers)
+{
+	const glm::vec3 roomSize = glm::vec3(maxBounds - 1);
+
+	pcg32_fast rng(1);
+	std::uniform_real_distribution<float> xDist(0.5f, roomSize.x - 0.5f);
+	std::uniform_real_distribution<float> yDist(0.5f, std::max(roomSize.y / 2.0f, 1.0f));
+	std::uniform_real_distribution<float> zDist(0.5f, roomSize.z - 0.5f);
+
+	for (uint32_t i = 0; i < numBarriers; i++)
+	{
+		const glm::vec3 center(xDist(rng), yDist(rng), zDist(rng));
+		const glm::vec3 normal = i % 2 == 0 ? glm::vec3(1, 0, 0) : glm::vec3(0, 0, 1);
+
+		WaterBlocker blocker;
+		blocker.tangent = i % 2 == 0 ? glm::vec3(0, 0, 1) : glm::vec3(1, 0, 0);
+		blocker.biTangent = glm::vec3(0, 1, 0);
+		blocker.tangentLen = 0.5f;
+		blocker.biTangentLen = 0.5f;
+		blocker.blockedGravities = 0b111111;
+
+		for (int dir = -1; dir <= 1; dir += 2)
+		{
+			blocker.center = center + normal * (static_cast<float>(dir) * 0.1f);
+			blocker.normal = normal * static_cast<float>(dir);
+			waterBlockers.push_back(blocker);
+		}
+	}
+}
+
+void WaterBenchmarkScene::AddPumps(uint32_t numPumps)
+{
+	const glm::vec3 roomSize = glm::vec3(maxBounds - 1);
+
+	pcg32_fast rng(3);
+	std::uniform_real_distribution<float> xDist(0.5f, roomSize.x - 0.5f);
+	std::uniform_real_distribution<float> yDist(0.5f, std::max(roomSize.y / 2.0f, 1.0f));
+	std::uniform_real_distribution<float> zDist(0.5f, roomSize.z - 0.5f);
+
+	for (uint32_t i = 0; i < numPumps; i++)
+	{
+		WaterPumpDescription& pump = waterPumps.emplace_back();
+		pump.source = glm::vec3(xDist(rng), yDist(rng), zDist(rng));
+		pump.dest = glm::vec3(xDist(rng), yDist(rng), zDist(rng));
+		pump.particlesPerSecond = 100;
+		pump.maxInputDistSquared = 0.5f * 0.5f;
+		pump.maxOutputDist = 0.5f;
+	}
+}
+
+void WaterBenchmarkScene::SplitIntoPools(int poolsPerSide)
+{
+	const glm::ivec3 roomSize = maxBounds - 1;
+	const glm::ivec3 worldSize = maxBounds - minBounds;
+
+	auto IsWall = [&](int x, int z)
+	{
+		for (int i = 1; i < poolsPerSide; i++)
+		{
+			if (x == roomSize.x * i / poolsPerSide || z == roomSize.z * i / poolsPerSide)
+				return true;
+		}
+		return false;
+	};
+
+	for (int z = 0; z < roomSize.z; z++)
+	{
+		for (int x = 0; x < roomSize.x; x++)
+		{
+			if (!IsWall(x, z))
+				continue;
+			for (int y = 0; y < roomSize.y; y++)
+			{
+				glm::ivec3 rel = glm::ivec3(x, y, z) - minBounds;
+				size_t index = rel.x + rel.y * worldSize.x + rel.z * worldSize.x * worldSize.y;
+				isAirBuffer[index / 8] &= static_cast<uint8_t>(~(1 << (index % 8)));
+			}
+		}
+	}
+
+	std::erase_if(
+		particlePositions,
+		[&](const glm::vec3& pos)
+		{ return IsWall(static_cast<int>(std::floor(pos.x)), static_cast<int>(std::floor(pos.z))); });
+}
+
+WaterSimulatorImpl::ConstructorArgs WaterBenchmarkScene::MakeConstructorArgs()
+{
+	WaterSimulatorImpl::ConstructorArgs args;
+	args.minBounds = minBounds;
+	args.maxBounds = maxBounds;
+	args.isAirBuffer = isAirBuffer.data();
+	args.extraParticles = 0;
+	args.particlePositions = particlePositions;
+	args.compactOutput = compactOutput;
+	args.useIslands = useIslands;
+	args.reproducible = reproducible;
+	args.numThreads = numThreads;
+	return args;
+}
+
+// Creates a simulator for the scene, using the instruction set in scene.isa if it is set, and simulates numSteps
+//  steps of 1/60 seconds. The simulator is left after Simulate and before SwapBuffers, which is when the game answers
+//  queries. simulateArgsOut is set up with the settings of the scene, for simulating further steps.
+static std::unique_ptr<WaterSimulatorImpl> CreateAndWarmUp(
+	WaterBenchmarkScene& scene, uint32_t numSteps, WaterSimulatorImpl::SimulateArgs& simulateArgsOut)
+{
+	std::unique_ptr<WaterSimulatorImpl> impl;
+	if (scene.isa.has_value())
+		impl = WaterSimulatorImpl::CreateInstance(scene.MakeConstructorArgs(), *scene.isa);
+	else
+		impl = WaterSimulatorImpl::CreateInstance(scene.MakeConstructorArgs());
+
+	simulateArgsOut = {};
+	simulateArgsOut.dt = 1.0f / 60.0f;
+	simulateArgsOut.baseDt = simulateArgsOut.dt;
+	simulateArgsOut.cameraPos = scene.cameraPos;
+	simulateArgsOut.waterBlockers = scene.waterBlockers;
+	simulateArgsOut.waterPumps = scene.waterPumps;
+	simulateArgsOut.lodDistance = scene.lodDistance;
+	simulateArgsOut.lodInterval = scene.lodInterval;
+
+	for (uint32_t i = 0; i < numSteps; i++)
+	{
+		if (i != 0)
+			impl->SwapBuffers();
+		impl->Simulate(simulateArgsOut);
+	}
+	return impl;
+}
+
+WaterBenchmarkResult RunWaterBenchmark(WaterBenchmarkScene& scene, uint32_t numSteps)
+{
+	using Clock = std::chrono::high_resolution_clock;
+
+	constexpr uint32_t WARMUP_STEPS = 3;
+
+	WaterSimulatorImpl::SimulateArgs simulateArgs;
+	std::unique_ptr<WaterSimulatorImpl> impl = CreateAndWarmUp(scene, WARMUP_STEPS, simulateArgs);
+
+	WaterBenchmarkResult result;
+	result.stageMilliseconds.fill(0);
+
+	const Clock::time_point startTime = Clock::now();
+	const uint64_t rebuildsBeforeStart = impl->NumCloseParticleRebuilds();
+	uint64_t lodFrozenParticles = 0;
+	uint64_t numIslands = 0;
+	for (uint32_t i = 0; i < numSteps; i++)
+	{
+		impl->SwapBuffers();
+		impl->Simulate(simulateArgs);
+
+		for (size_t s = 0; s < NUM_WATER_SIM_STAGES; s++)
+			result.stageMilliseconds[s] += static_cast<double>(impl->LastStepStageTimes()[s]) / 1E6;
+		lodFrozenParticles += impl->NumLodFrozenParticles();
+		numIslands += impl->NumIslands();
+	}
+	const double elapsedSeconds = std::chrono::duration<double>(Clock::now() - startTime).count();
+
+	impl->SwapBuffers();
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> velocities;
+	std::vector<uint8_t> gravities;
+	impl->GetParticleState(positions, velocities, gravities);
+
+	// The state is returned in the order of the initial particles, so the hash doesn't depend on reordering
+	result.stateHash = HashFNV1a64(FNV1A_64_OFFSET_BASIS, std::as_bytes(std::span(positions)));
+	result.stateHash = HashFNV1a64(result.stateHash, std::as_bytes(std::span(velocities)));
+	result.stateHash = HashFNV1a64(result.stateHash, std::as_bytes(std::span(gravities)));
+
+	result.finalMaxSpeed = 0;
+	for (const glm::vec3& velocity : velocities)
+	{
+		const float speed = glm::length(velocity);
+		result.finalMaxSpeed = std::isnan(speed) ? INFINITY : std::max(result.finalMaxSpeed, speed);
+	}
+
+	for (double& stageMilliseconds : result.stageMilliseconds)
+		stageMilliseconds /= static_cast<double>(numSteps);
+
+	result.implName = eg::DemangeTypeName(typeid(*impl).name());
+	result.numParticles = eg::UnsignedNarrow<uint32_t>(scene.particlePositions.size());
+	result.numSteps = numSteps;
+	result.wideParticleIndices = impl->HasWideParticleIndices();
+	result.stepsPerSecond = static_cast<double>(numSteps) / elapsedSeconds;
+	result.closeParticlesMemoryBytes = impl->CloseParticlesMemoryUsage();
+	result.closeParticleRebuilds = impl->NumCloseParticleRebuilds() - rebuildsBeforeStart;
+	result.numWaterBlockers = eg::UnsignedNarrow<uint32_t>(scene.waterBlockers.size());
+	result.numWaterPumps = eg::UnsignedNarrow<uint32_t>(scene.waterPumps.size());
+	result.lodFrozenFraction =
+		static_cast<double>(lodFrozenParticles) / (static_cast<double>(numSteps) * result.numParticles);
+	result.averageIslands = static_cast<double>(numIslands) / static_cast<double>(numSteps);
+	return result;
+}
+
+WaterPresimBenchmarkResult RunWaterPresimBenchmark(
+	WaterBenchmarkScene& scene, uint32_t numPresimSteps,
+	std::optional<WaterAdaptiveTimeStepSettings> adaptiveTimeStep)
+{
+	using Clock = std::chrono::high_resolution_clock;
+
+	// LOD and sleeping are not used during presimulation
+	WaterSimulatorImpl::SimulateArgs simulateArgs;
+	std::unique_ptr<WaterSimulatorImpl> impl = CreateAndWarmUp(scene, 0, simulateArgs);
+	simulateArgs.lodDistance = 0;
+
+	WaterPresimBenchmarkResult result = {};
+	result.numPresimSteps = numPresimSteps;
+
+	constexpr float BASE_DT = 1.0f / 60.0f;
+	simulateArgs.baseDt = BASE_DT;
+	const Clock::time_point startTime = Clock::now();
+	for (uint32_t stepsDone = 0; stepsDone < numPresimSteps;)
+	{
+		WaterSimulatorImpl::TimeStep timeStep = { .numBaseSteps = 1, .numSubsteps = 1, .dt = BASE_DT };
+		if (adaptiveTimeStep.has_value())
+		{
+			timeStep = WaterSimulatorImpl::ChooseTimeStep(
+				BASE_DT, impl->LastStepMaxSpeed(), adaptiveTimeStep->cflNumber,
+				std::min(adaptiveTimeStep->maxMergedSteps, numPresimSteps - stepsDone), adaptiveTimeStep->maxSubsteps);
+		}
+
+		simulateArgs.dt = timeStep.dt;
+		for (uint32_t substep = 0; substep < timeStep.numSubsteps; substep++)
+		{
+			if (result.numSimulatedSteps != 0)
+				impl->SwapBuffers();
+			simulateArgs.continuesBaseStep = substep != 0;
+			impl->Simulate(simulateArgs);
+			result.numSimulatedSteps++;
+		}
+
+		result.maxSubsteps = std::max(result.maxSubsteps, timeStep.numSubsteps);
+		stepsDone += timeStep.numBaseSteps;
+	}
+	result.milliseconds = std::chrono::duration<double, std::milli>(Clock::now() - startTime).count();
+
+	impl->SwapBuffers();
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> velocities;
+	std::vector<uint8_t> gravities;
+	impl->GetParticleState(positions, velocities, gravities);
+
+	double speedSum = 0;
+	for (const glm::vec3& velocity : velocities)
+	{
+		const float speed = glm::length(velocity);
+		result.finalMaxSpeed = std::isnan(speed) ? INFINITY : std::max(result.finalMaxSpeed, speed);
+		speedSum += speed;
+	}
+	const double numParticles = static_cast<double>(std::max<size_t>(velocities.size(), 1));
+	result.finalAverageSpeed = static_cast<float>(speedSum / numParticles);
+
+	return result;
+}
+
+// Runs stage 1 and stage 4 with both the scalar implementation and the implementation selected for the simulator,
+//  single threaded on the calling thread, and compares their results. Must be called after Simulate. This overwrites
+//  the close particle lists and the second buffers, so the simulator should not be stepped afterwards.
+struct WaterSimdAgreementCheck
+{
+	static WaterSimdAgreementResult Run(WaterSimulatorImpl& impl, float dt, uint32_t numRepetitions)
+	{
+		WaterSimdAgreementResult result = {};
+
+		const uint32_t numParticles = impl.m_numParticles;
+		const WaterSimulatorImpl::SimulateStageArgs args = {
+			.threadIndex = 0, .rangeIndex = 0, .loIdx = 0, .hiIdx = numParticles, .dt = dt
+		};
+
+		// All close particles are placed in the first scratch list, so the others must be empty when compacting
+		for (WaterSimulatorImpl::CloseParticlesScratch& scratch : impl.m_closeParticlesScratch)
+		{
+			scratch.indices.clear();
+			scratch.distances.clear();
+		}
+		WaterSimulatorImpl::CloseParticlesScratch& scratch = impl.m_closeParticlesScratch[0];
+
+		auto RunTimed = [&](auto stageFn)
+		{
+			auto startTime = std::chrono::steady_clock::now();
+			for (uint32_t i = 0; i < numRepetitions; i++)
+				stageFn();
+			auto elapsed = std::chrono::steady_clock::now() - startTime;
+			return std::chrono::duration<double, std::milli>(elapsed).count() / numRepetitions;
+		};
+
+		auto DetectClose = [&](bool scalar)
+		{
+			scratch.indices.clear();
+			scratch.distances.clear();
+			if (scalar)
+				impl.WaterSimulatorImpl::Stage1_DetectClose(args);
+			else
+				impl.Stage1_DetectClose(args);
+		};
+
+		result.scalarDetectCloseMs = RunTimed([&] { DetectClose(true); });
+		const std::vector<uint32_t> scalarIndices = scratch.indices;
+		const std::vector<float> scalarDistances = scratch.distances;
+		const std::vector<uint32_t> scalarNumClose(impl.m_numCloseParticles, impl.m_numCloseParticles + numParticles);
+		const std::vector<uint32_t> scalarStart(impl.m_closeParticlesStart, impl.m_closeParticlesStart + numParticles);
+
+		result.simdDetectCloseMs = RunTimed([&] { DetectClose(false); });
+		for (uint32_t p = 0; p < numParticles; p++)
+		{
+			const uint32_t numClose = impl.m_numCloseParticles[p];
+			const uint32_t start = impl.m_closeParticlesStart[p];
+			if (numClose != scalarNumClose[p] ||
+			    !std::equal(
+					scratch.indices.begin() + start, scratch.indices.begin() + start + numClose,
+					scalarIndices.begin() + scalarStart[p]))
+			{
+				result.closeParticleListMismatches++;
+				continue;
+			}
+			for (uint32_t i = 0; i < numClose; i++)
+			{
+				const float distError = std::abs(scratch.distances[start + i] - scalarDistances[scalarStart[p] + i]);
+				result.maxCloseParticleDistError = std::max(result.maxCloseParticleDistError, distError);
+			}
+		}
+
+		impl.AllocateCloseParticlesStorage();
+		impl.CompactCloseParticles(args);
+
+		// Blockers are left out since collision handling is the same for all implementations
+		impl.BinWaterBlockers({});
+		result.scalarDiffusionAndCollisionMs =
+			RunTimed([&] { impl.WaterSimulatorImpl::Stage4_DiffusionAndCollision(args, {}); });
+		auto CopyVec3SOA = [&](const WaterSimulatorImpl::Vec3SOA& v)
+		{
+			std::vector<glm::vec3> copy(numParticles);
+			for (uint32_t i = 0; i < numParticles; i++)
+				copy[i] = v[i];
+			return copy;
+		};
+		const std::vector<glm::vec3> scalarPositions = CopyVec3SOA(impl.m_particlesPos2);
+		const std::vector<glm::vec3> scalarVelocities = CopyVec3SOA(impl.m_particlesVel2);
+
+		result.simdDiffusionAndCollisionMs = RunTimed([&] { impl.Stage4_DiffusionAndCollision(args, {}); });
+		for (uint32_t i = 0; i < numParticles; i++)
+		{
+			const glm::vec3 posError = glm::abs(impl.m_particlesPos2[i] - scalarPositions[i]);
+			const glm::vec3 velError = glm::abs(impl.m_particlesVel2[i] - scalarVelocities[i]);
+			result.maxPositionError = std::max({ result.maxPositionError, posError.x, posError.y, posError.z });
+			result.maxVelocityError = std::max({ result.maxVelocityError, velError.x, velError.y, velError.z });
+		}
+
+		// The close particle lists no longer match the layout used by the worker threads
+		impl.m_closeParticlesOutdated = true;
+
+		return result;
+	}
+};
+
+std::vector<WaterSimdCheckResult> RunWaterSimdCheck(
+	WaterBenchmarkScene& scene, uint32_t numSteps, uint32_t numRepetitions)
+{
+	const std::optional<WaterSimIsa> sceneIsa = scene.isa;
+
+	std::vector<WaterSimdCheckResult> results;
+	for (size_t i = 0; i < NUM_WATER_SIM_ISAS; i++)
+	{
+		const WaterSimIsa isa = static_cast<WaterSimIsa>(i);
+		if (isa == WaterSimIsa::Scalar || !WaterSimulatorImpl::IsIsaSupported(isa) ||
+		    (sceneIsa.has_value() && *sceneIsa != isa))
+		{
+			continue;
+		}
+
+		// Lets the water start moving so that velocity diffusion has an effect
+		scene.isa = isa;
+		WaterSimulatorImpl::SimulateArgs simulateArgs;
+		std::unique_ptr<WaterSimulatorImpl> impl = CreateAndWarmUp(scene, numSteps, simulateArgs);
+
+		WaterSimdCheckResult& result = results.emplace_back();
+		result.isa = isa;
+		result.implName = eg::DemangeTypeName(typeid(*impl).name());
+		result.numParticles = eg::UnsignedNarrow<uint32_t>(scene.particlePositions.size());
+		result.agreement = WaterSimdAgreementCheck::Run(*impl, simulateArgs.dt, std::max(numRepetitions, 1u));
+	}
+
+	scene.isa = sceneIsa;
+	return results;
+}
+
+WaterCompactOutputCheckResult RunWaterCompactOutputCheck(WaterBenchmarkScene& scene, uint32_t numSteps)
+{
+	numSteps = std::max(numSteps, 2u);
+
+	// Compact output is only enabled for the simulator created here, the scene is left as it was
+	const bool sceneCompactOutput = std::exchange(scene.compactOutput, true);
+	WaterSimulatorImpl::SimulateArgs simulateArgs;
+	std::unique_ptr<WaterSimulatorImpl> impl = CreateAndWarmUp(scene, numSteps / 2, simulateArgs);
+	scene.compactOutput = sceneCompactOutput;
+
+	// Game time starts at the same offset as in the game, so that glow times have the same precision
+	simulateArgs.gameTime = 100;
+
+	// Changes gravity for the water at the bottom of the room close to the end, so that glow ages are in range
+	for (uint32_t i = numSteps / 2; i < numSteps; i++)
+	{
+		impl->SwapBuffers();
+		simulateArgs.shouldChangeParticleGravity = i == numSteps / 2;
+		simulateArgs.changeGravityParticlePos = glm::vec3(scene.maxBounds.x / 2.0f, 0.5f, scene.maxBounds.z / 2.0f);
+		simulateArgs.newGravity = Dir::NegX;
+
+		impl->Simulate(simulateArgs);
+		impl->PublishOutputFrame();
+		simulateArgs.gameTime += simulateArgs.dt;
+	}
+
+	const WaterSimulatorImpl::OutputFrame& frame = impl->AcquireOutputFrame();
+
+	WaterCompactOutputCheckResult result;
+	result.numParticles = frame.numParticles;
+	result.positionRange = frame.layout.positionRange;
+	result.maxPositionError = 0;
+	result.maxGlowTimeError = 0;
+	result.numGlowingParticles = 0;
+	for (uint32_t i = 0; i < frame.numParticles; i++)
+	{
+		const glm::vec4 decoded = DecodeCompactWaterParticle(frame.compactParticles[i], frame.layout);
+		result.maxPositionError =
+			std::max(result.maxPositionError, glm::distance(glm::vec3(decoded), glm::vec3(frame.positions[i])));
+
+		if (frame.layout.glowTimeBase - frame.positions[i].w < COMPACT_GLOW_MAX_AGE)
+		{
+			result.maxGlowTimeError = std::max(result.maxGlowTimeError, std::abs(decoded.w - frame.positions[i].w));
+			result.numGlowingParticles++;
+		}
+	}
+	return result;
+}
+
+std::vector<WaterQueryBenchmarkResult> RunWaterQueryBenchmark(
+	WaterBenchmarkScene& scene, uint32_t numSteps, std::span<const uint32_t> queryCounts, uint32_t numRepetitions)
+{
+	using Clock = std::chrono::high_resolution_clock;
+
+	// Same as the size of cubes, which are the most common objects to query water for
+	constexpr float BOX_RADIUS = 0.4f;
+
+	WaterSimulatorImpl::SimulateArgs simulateArgs;
+	std::unique_ptr<WaterSimulatorImpl> impl = CreateAndWarmUp(scene, std::max(numSteps, 1u), simulateArgs);
+
+	// Boxes are placed in the bottom half of the room, where the water is
+	const glm::vec3 roomSize = glm::vec3(scene.maxBounds - 1);
+	pcg32_fast rng(2);
+	std::uniform_real_distribution<float> xDist(0.0f, roomSize.x);
+	std::uniform_real_distribution<float> yDist(0.0f, roomSize.y / 2.0f);
+	std::uniform_real_distribution<float> zDist(0.0f, roomSize.z);
+
+	numRepetitions = std::max(numRepetitions, 1u);
+
+	std::vector<WaterQueryBenchmarkResult> results;
+	for (uint32_t numQueries : queryCounts)
+	{
+		std::vector<eg::AABB> aabbs;
+		for (uint32_t i = 0; i < numQueries; i++)
+		{
+			const glm::vec3 center(xDist(rng), yDist(rng), zDist(rng));
+			aabbs.emplace_back(center - BOX_RADIUS, center + BOX_RADIUS);
+		}
+
+		std::vector<WaterQueryResults> linearResults(numQueries);
+		const Clock::time_point linearStartTime = Clock::now();
+		for (uint32_t r = 0; r < numRepetitions; r++)
+		{
+			for (uint32_t i = 0; i < numQueries; i++)
+				linearResults[i] = impl->Query(aabbs[i]);
+		}
+		const Clock::time_point linearEndTime = Clock::now();
+
+		std::vector<WaterQueryResults> batchedResults(numQueries);
+		for (uint32_t r = 0; r < numRepetitions; r++)
+		{
+			impl->QueryBatch(aabbs, batchedResults);
+		}
+		const Clock::time_point batchedEndTime = Clock::now();
+
+		WaterQueryBenchmarkResult& result = results.emplace_back();
+		result.numQueries = numQueries;
+		result.linearMilliseconds =
+			std::chrono::duration<double, std::milli>(linearEndTime - linearStartTime).count() / numRepetitions;
+		result.batchedMilliseconds =
+			std::chrono::duration<double, std::milli>(batchedEndTime - linearEndTime).count() / numRepetitions;
+		result.mismatchedQueries = 0;
+		for (uint32_t i = 0; i < numQueries; i++)
+		{
+			if (linearResults[i].numIntersecting != batchedResults[i].numIntersecting)
+				result.mismatchedQueries++;
+		}
+	}
+
+	return results;
+}
+
+// Particle counts used by the waterBench console command
+static constexpr uint32_t BENCHMARK_PARTICLE_COUNTS[] = { 64 * 1024, 256 * 1024, 1024 * 1024 };
+
+// Numbers of queried boxes used by the waterQueryBench console command
+static constexpr uint32_t QUERY_BENCHMARK_COUNTS[] = { 1, 10, 40, 100, 400 };
+
+// Numbers of pumps used by the waterPumpBench console command
+static constexpr uint32_t PUMP_BENCHMARK_COUNTS[] = { 1, 2, 4, 8, 16, 32 };
+
+// LOD distances used by the waterLodBench console command, where 0 disables LOD
+static constexpr float LOD_BENCHMARK_DISTANCES[] = { 0, 24, 16, 8 };
+
+// Numbers of pools along each side of the room used by the waterIslandBench console command
+static constexpr int ISLAND_BENCHMARK_POOLS_PER_SIDE[] = { 1, 2, 4 };
+
+// Numbers of pumps used by the waterPresimBench console command
+static constexpr uint32_t PRESIM_BENCHMARK_PUMP_COUNTS[] = { 0, 4, 16 };
+
+// Thread counts that the waterReproCheck console command compares the particle state for
+static constexpr uint32_t REPRODUCIBILITY_THREAD_COUNTS[] = { 1, 2, 3, 4, 8 };
+
+// Number of particles in the flooded room used by the console commands that don't vary it
+static constexpr uint32_t COMMAND_NUM_PARTICLES = 64 * 1024;
+
+// Returns the console command argument at index parsed as a count, or defaultValue if it is missing or invalid
+static uint32_t CountArgument(std::span<const std::string_view> args, size_t index, uint32_t defaultValue)
+{
+	uint32_t value = defaultValue;
+	if (index < args.size())
+		std::from_chars(args[index].data(), args[index].data() + args[index].size(), value);
+	return value;
+}
+
+// Benchmarks a flooded room with numParticles particles, after setupScene has made changes to it
+template <typename SetupFn>
+static WaterBenchmarkResult BenchmarkFloodedRoom(uint32_t numParticles, uint32_t numSteps, SetupFn setupScene)
+{
+	WaterBenchmarkScene scene = WaterBenchmarkScene::CreateFloodedRoom(numParticles);
+	setupScene(scene);
+	return RunWaterBenchmark(scene, numSteps);
+}
+
+void RegisterWaterBenchmarkCommands()
+{
+	eg::console::AddCommand(
+		"waterBench", 0,
+		[](std::span<const std::string_view> args, eg::console::Writer& writer)
+		{
+			const uint32_t numSteps = CountArgument(args, 0, 20);
+
+			// The second argument adds barriers to the scene, to benchmark collision with water blockers
+			const uint32_t numBarriers = CountArgument(args, 1, 0);
+
+			for (uint32_t numParticles : BENCHMARK_PARTICLE_COUNTS)
+			{
+				const WaterBenchmarkResult result = BenchmarkFloodedRoom(
+					numParticles, numSteps, [&](WaterBenchmarkScene& scene) { scene.AddBarriers(numBarriers); });
+
+				std::ostringstream message;
+				message << std::fixed << std::setprecision(2) << result.numParticles << " particles ("
+						<< result.implName << (result.wideParticleIndices ? ", 32-bit indices" : ", 16-bit indices")
+						<< "): " << result.stepsPerSecond << " steps/s, neighbour lists "
+						<< eg::ReadableBytesSize(result.closeParticlesMemoryBytes) << ", rebuilt in "
+						<< result.closeParticleRebuilds << "/" << result.numSteps << " steps, "
+						<< result.numWaterBlockers << " water blockers";
+				writer.WriteLine(eg::console::InfoColor, message.str());
+
+				const double stepMilliseconds = 1000.0 / result.stepsPerSecond;
+				std::ostringstream stagesMessage;
+				stagesMessage << std::fixed << std::setprecision(2) << " ";
+				for (size_t s = 0; s < NUM_WATER_SIM_STAGES; s++)
+				{
+					stagesMessage << " " << WATER_SIM_STAGE_NAMES[s] << ": " << result.stageMilliseconds[s] << "ms ("
+								  << result.stageMilliseconds[s] / stepMilliseconds * 100 << "%)";
+				}
+				writer.WriteLine(eg::console::InfoColor, stagesMessage.str());
+			}
+		});
+
+	eg::console::AddCommand(
+		"waterPumpBench", 0,
+		[](std::span<const std::string_view> args, eg::console::Writer& writer)
+		{
+			const uint32_t numSteps = CountArgument(args, 0, 20);
+
+			for (uint32_t numPumps : PUMP_BENCHMARK_COUNTS)
+			{
+				const WaterBenchmarkResult result = BenchmarkFloodedRoom(
+					COMMAND_NUM_PARTICLES, numSteps, [&](WaterBenchmarkScene& scene) { scene.AddPumps(numPumps); });
+
+				const double pumpsMilliseconds =
+					result.stageMilliseconds[static_cast<size_t>(WaterSimStage::MoveAcrossPumps)];
+				std::ostringstream message;
+				message << std::fixed << std::setprecision(3) << result.numWaterPumps << " pumps: " << pumpsMilliseconds
+						<< "ms per step (" << pumpsMilliseconds / result.numWaterPumps << "ms per pump), "
+						<< std::setprecision(2) << result.stepsPerSecond << " steps/s";
+				writer.WriteLine(eg::console::InfoColor, message.str());
+			}
+		});
+
+	eg::console::AddCommand(
+		"waterLodBench", 0,
+		[](std::span<const std::string_view> args, eg::console::Writer& writer)
+		{
+			const uint32_t numSteps = CountArgument(args, 0, 40);
+			const uint32_t lodInterval = CountArgument(args, 1, 4);
+
+			double baseStepMilliseconds = 0;
+			for (float lodDistance : LOD_BENCHMARK_DISTANCES)
+			{
+				// The camera is placed in a corner of the room, so that most of the water is far away
+				const WaterBenchmarkResult result = BenchmarkFloodedRoom(
+					256 * 1024, numSteps,
+					[&](WaterBenchmarkScene& scene)
+					{
+						scene.cameraPos = glm::vec3(1.0f);
+						scene.lodDistance = lodDistance;
+						scene.lodInterval = lodInterval;
+					});
+
+				const double stepMilliseconds = 1000.0 / result.stepsPerSecond;
+				if (lodDistance == 0)
+					baseStepMilliseconds = stepMilliseconds;
+
+				std::ostringstream message;
+				message << std::fixed << std::setprecision(2);
+				if (lodDistance == 0)
+					message << "LOD off: ";
+				else
+					message << "LOD distance " << lodDistance << ": ";
+				message << stepMilliseconds << "ms per step (" << (1 - stepMilliseconds / baseStepMilliseconds) * 100
+						<< "% saved), " << result.lodFrozenFraction * 100 << "% frozen per step, max speed "
+						<< result.finalMaxSpeed;
+				writer.WriteLine(
+					std::isfinite(result.finalMaxSpeed) ? eg::console::InfoColor : eg::console::ErrorColor,
+					message.str());
+			}
+		});
+
+	eg::console::AddCommand(
+		"waterIslandBench", 0,
+		[](std::span<const std::string_view> args, eg::console::Writer& writer)
+		{
+			const uint32_t numSteps = CountArgument(args, 0, 40);
+
+			for (int poolsPerSide : ISLAND_BENCHMARK_POOLS_PER_SIDE)
+			{
+				double stepMilliseconds[2];
+				double averageIslands = 0;
+				float maxSpeed = 0;
+				for (int useIslands = 0; useIslands < 2; useIslands++)
+				{
+					const WaterBenchmarkResult result = BenchmarkFloodedRoom(
+						256 * 1024, numSteps,
+						[&](WaterBenchmarkScene& scene)
+						{
+							scene.SplitIntoPools(poolsPerSide);
+							scene.useIslands = useIslands != 0;
+						});
+
+					stepMilliseconds[useIslands] = 1000.0 / result.stepsPerSecond;
+					averageIslands = std::max(averageIslands, result.averageIslands);
+					maxSpeed = std::max(maxSpeed, result.finalMaxSpeed);
+				}
+
+				std::ostringstream message;
+				message << std::fixed << std::setprecision(2) << poolsPerSide * poolsPerSide
+						<< " pools: " << stepMilliseconds[0] << "ms per step without islands, " << stepMilliseconds[1]
+						<< "ms with " << averageIslands << " islands per step, max speed " << maxSpeed;
+				writer.WriteLine(
+					std::isfinite(maxSpeed) ? eg::console::InfoColor : eg::console::ErrorColor, message.str());
+			}
+		});
+
+	eg::console::AddCommand(
+		"waterPresimBench", 0,
+		[](std::span<const std::string_view> args, eg::console::Writer& writer)
+		{
+			const uint32_t numPresimSteps = CountArgument(args, 0, 100);
+
+			for (uint32_t numPumps : PRESIM_BENCHMARK_PUMP_COUNTS)
+			{
+				WaterBenchmarkScene scene = WaterBenchmarkScene::CreateFloodedRoom(COMMAND_NUM_PARTICLES);
+				scene.AddPumps(numPumps);
+				const WaterPresimBenchmarkResult fixed = RunWaterPresimBenchmark(scene, numPresimSteps, std::nullopt);
+				const WaterPresimBenchmarkResult adaptive =
+					RunWaterPresimBenchmark(scene, numPresimSteps, WaterAdaptiveTimeStepSettings());
+
+				const int stepsSaved = static_cast<int>(fixed.numSimulatedSteps) -
+				                       static_cast<int>(adaptive.numSimulatedSteps);
+				std::ostringstream message;
+				message << std::fixed << std::setprecision(2) << numPumps << " pumps: " << fixed.milliseconds
+						<< "ms fixed, " << adaptive.milliseconds << "ms adaptive with " << adaptive.numSimulatedSteps
+						<< " steps (" << stepsSaved << " saved, up to " << adaptive.maxSubsteps
+						<< " substeps), final speed " << fixed.finalAverageSpeed << "/" << adaptive.finalAverageSpeed
+						<< " avg, " << fixed.finalMaxSpeed << "/" << adaptive.finalMaxSpeed << " max";
+				writer.WriteLine(
+					std::isfinite(adaptive.finalMaxSpeed) ? eg::console::InfoColor : eg::console::ErrorColor,
+					message.str());
+			}
+		});
+
+	eg::console::AddCommand(
+		"waterQueryBench", 0,
+		[](std::span<const std::string_view> args, eg::console::Writer& writer)
+		{
+			const uint32_t numRepetitions = CountArgument(args, 0, 5);
+
+			constexpr uint32_t NUM_STEPS = 10;
+			WaterBenchmarkScene scene = WaterBenchmarkScene::CreateFloodedRoom(COMMAND_NUM_PARTICLES);
+			const std::vector<WaterQueryBenchmarkResult> results =
+				RunWaterQueryBenchmark(scene, NUM_STEPS, QUERY_BENCHMARK_COUNTS, numRepetitions);
+
+			for (const WaterQueryBenchmarkResult& result : results)
+			{
+				std::ostringstream message;
+				message << std::fixed << std::setprecision(3) << result.numQueries << " queries: "
+						<< result.linearMilliseconds << "ms one at a time, " << result.batchedMilliseconds
+						<< "ms batched";
+				if (result.mismatchedQueries != 0)
+					message << ", " << result.mismatchedQueries << " mismatched results";
+				writer.WriteLine(
+					result.mismatchedQueries == 0 ? eg::console::InfoColor : eg::console::ErrorColor, message.str());
+			}
+		});
+
+	eg::console::AddCommand(
+		"waterSimdCheck", 0,
+		[](std::span<const std::string_view> args, eg::console::Writer& writer)
+		{
+			const uint32_t numRepetitions = CountArgument(args, 0, 5);
+
+			constexpr uint32_t NUM_STEPS = 30;
+			WaterBenchmarkScene scene = WaterBenchmarkScene::CreateFloodedRoom(COMMAND_NUM_PARTICLES);
+			const std::vector<WaterSimdCheckResult> results = RunWaterSimdCheck(scene, NUM_STEPS, numRepetitions);
+			if (results.empty())
+				writer.WriteLine(eg::console::InfoColor, "No simd instruction sets are supported");
+
+			for (const WaterSimdCheckResult& result : results)
+			{
+				const WaterSimdAgreementResult& agreement = result.agreement;
+
+				std::ostringstream message;
+				message << WATER_SIM_ISA_NAMES[static_cast<size_t>(result.isa)] << ", " << result.numParticles
+						<< " particles (" << result.implName << "): " << agreement.closeParticleListMismatches
+						<< " close particle list mismatches, max errors: dist " << agreement.maxCloseParticleDistError
+						<< ", position " << agreement.maxPositionError << ", velocity " << agreement.maxVelocityError;
+				writer.WriteLine(
+					agreement.Agrees() ? eg::console::InfoColor : eg::console::ErrorColor, message.str());
+
+				std::ostringstream timesMessage;
+				timesMessage << std::fixed << std::setprecision(2)
+							 << "  Detect Close: " << agreement.scalarDetectCloseMs << "ms scalar, "
+							 << agreement.simdDetectCloseMs << "ms simd. Diffusion & Collision: "
+							 << agreement.scalarDiffusionAndCollisionMs << "ms scalar, "
+							 << agreement.simdDiffusionAndCollisionMs << "ms simd";
+				writer.WriteLine(eg::console::InfoColor, timesMessage.str());
+			}
+		});
+
+	eg::console::AddCommand(
+		"waterCompactCheck", 0,
+		[](std::span<const std::string_view> args, eg::console::Writer& writer)
+		{
+			const uint32_t numSteps = CountArgument(args, 0, 30);
+
+			// Positions must be precise enough that the quantization is not visible next to the smallest particles
+			constexpr float MAX_POSITION_ERROR = MIN_PARTICLE_RADIUS * 0.05f;
+			constexpr float MAX_GLOW_TIME_ERROR = 1E-3f;
+
+			WaterBenchmarkScene scene = WaterBenchmarkScene::CreateFloodedRoom(COMMAND_NUM_PARTICLES);
+			const WaterCompactOutputCheckResult result = RunWaterCompactOutputCheck(scene, numSteps);
+
+			const bool withinLimits =
+				result.maxPositionError < MAX_POSITION_ERROR && result.maxGlowTimeError < MAX_GLOW_TIME_ERROR;
+
+			std::ostringstream message;
+			message << result.numParticles << " particles, position range " << result.positionRange.x << "x"
+					<< result.positionRange.y << "x" << result.positionRange.z << ": max position error "
+					<< result.maxPositionError << " (limit " << MAX_POSITION_ERROR << "), max glow time error "
+					<< result.maxGlowTimeError << " over " << result.numGlowingParticles << " glowing particles";
+			writer.WriteLine(withinLimits ? eg::console::InfoColor : eg::console::ErrorColor, message.str());
+		});
+
+	eg::console::AddCommand(
+		"waterReproCheck", 0,
+		[](std::span<const std::string_view> args, eg::console::Writer& writer)
+		{
+			const uint32_t numSteps = CountArgument(args, 0, 30);
+
+			// The particle state must be the same for every thread count
+			std::optional<uint64_t> firstHash;
+			for (uint32_t numThreads : REPRODUCIBILITY_THREAD_COUNTS)
+			{
+				const WaterBenchmarkResult result = BenchmarkFloodedRoom(
+					COMMAND_NUM_PARTICLES, numSteps,
+					[&](WaterBenchmarkScene& scene)
+					{
+						scene.reproducible = true;
+						scene.numThreads = numThreads;
+					});
+				if (!firstHash.has_value())
+					firstHash = result.stateHash;
+
+				std::ostringstream message;
+				message << std::fixed << std::setprecision(2) << numThreads << " threads: state hash " << std::hex
+						<< result.stateHash << std::dec << ", " << result.stepsPerSecond << " steps/s";
+				writer.WriteLine(
+					result.stateHash == *firstHash ? eg::console::InfoColor : eg::console::ErrorColor, message.str());
+			}
+		});
+}
+
+#endif
@@ -0,0 +1,182 @@
+#pragma once
+
+#ifdef IOMOMI_ENABLE_WATER
+
+#include "WaterSimulatorImpl.hpp"
+
+// Synthetic scene used to benchmark the water simulator without loading a level.
+struct WaterBenchmarkScene
+{
+	glm::ivec3 minBounds;
+	glm::ivec3 maxBounds;
+	std::vector<uint8_t> isAirBuffer;
+	std::vector<glm::vec3> particlePositions;
+	std::vector<WaterBlocker> waterBlockers;
+	std::vector<WaterPumpDescription> waterPumps;
+
+	glm::vec3 cameraPos{ 0.0f };
+
+	// LOD settings passed to the simulator, see WaterSimulatorImpl::SimulateArgs
+	float lodDistance = 0;
+	uint32_t lodInterval = 1;
+
+	// See WaterSimulatorImpl::ConstructorArgs
+	std::optional<bool> useIslands;
+	bool compactOutput = false;
+	bool reproducible = false;
+	uint32_t numThreads = 0;
+
+	// Instruction set to simulate with, or the same one as in the game if not set
+	std::optional<WaterSimIsa> isa;
+
+	// Creates a closed room which is half filled with the given number of particles, with the camera in the center.
+	static WaterBenchmarkScene CreateFloodedRoom(uint32_t numParticles);
+
+	// Creates a scene with the voxels, water, water blockers and pumps of a level, in the same way as when the level
+	//  is played. The camera is placed at the level's thumbnail camera position.
+	static WaterBenchmarkScene CreateFromWorld(class World& world);
+
+	// Places barriers of one voxel at random positions in the water. Like the ones made by water blocking entities,
+	//  each barrier consists of two blockers facing away from each other.
+	void AddBarriers(uint32_t numBarriers);
+
+	// Places pumps that move water between random positions in the water, with the default settings of pump entities
+	void AddPumps(uint32_t numPumps);
+
+	// Splits the room into poolsPerSide * poolsPerSide pools with walls going from the floor to the ceiling, removing
+	//  particles inside the walls
+	void SplitIntoPools(int poolsPerSide);
+
+	WaterSimulatorImpl::ConstructorArgs MakeConstructorArgs();
+};
+
+struct WaterBenchmarkResult
+{
+	std::string implName;
+	uint32_t numParticles;
+	uint32_t numSteps;
+	bool wideParticleIndices;
+	double stepsPerSecond;
+	size_t closeParticlesMemoryBytes;
+	uint64_t closeParticleRebuilds;
+	uint32_t numWaterBlockers;
+	uint32_t numWaterPumps;
+
+	// Average fraction of particles that were frozen by LOD per step
+	double lodFrozenFraction;
+
+	// Average number of islands per step, which is 0 if islands are not used
+	double averageIslands;
+
+	// Largest particle speed after the last step, which grows without bound if the simulation is unstable
+	float finalMaxSpeed;
+
+	// Average time per step spent in each stage, indexed by WaterSimStage
+	std::array<double, NUM_WATER_SIM_STAGES> stageMilliseconds;
+
+	// Hash of the particle state after the last step, which only depends on the scene and the number of steps if the
+	//  scene is reproducible (for a given instruction set and build)
+	uint64_t stateHash;
+};
+
+WaterBenchmarkResult RunWaterBenchmark(WaterBenchmarkScene& scene, uint32_t numSteps);
+
+// Settings for adaptive time stepping, with the same defaults as the water_cfl, water_max_merged_steps and
+//  water_max_substeps tweak variables. See WaterSimulatorImpl::ChooseTimeStep.
+struct WaterAdaptiveTimeStepSettings
+{
+	float cflNumber = 0.25f;
+	uint32_t maxMergedSteps = 2;
+	uint32_t maxSubsteps = 8;
+};
+
+struct WaterPresimBenchmarkResult
+{
+	// The number of steps of 1/60 seconds that were presimulated, and the number of calls to Simulate that it took
+	uint32_t numPresimSteps;
+	uint32_t numSimulatedSteps;
+
+	uint32_t maxSubsteps;
+	double milliseconds;
+
+	// Largest and average particle speed after presimulation, which show how settled the water is
+	float finalMaxSpeed;
+	float finalAverageSpeed;
+};
+
+// Presimulates the scene in the same way as the game does when a level is loaded, with fixed steps or with adaptive
+//  time stepping if adaptiveTimeStep is set.
+WaterPresimBenchmarkResult RunWaterPresimBenchmark(
+	WaterBenchmarkScene& scene, uint32_t numPresimSteps,
+	std::optional<WaterAdaptiveTimeStepSettings> adaptiveTimeStep);
+
+struct WaterSimdAgreementResult
+{
+	uint32_t closeParticleListMismatches;
+	float maxCloseParticleDistError;
+	float maxPositionError;
+	float maxVelocityError;
+	double scalarDetectCloseMs;
+	double simdDetectCloseMs;
+	double scalarDiffusionAndCollisionMs;
+	double simdDiffusionAndCollisionMs;
+
+	// Whether close particle lists are the same and positions and velocities only differ by rounding errors
+	bool Agrees() const
+	{
+		return closeParticleListMismatches == 0 && maxPositionError < 1E-4f && maxVelocityError < 1E-3f;
+	}
+};
+
+struct WaterSimdCheckResult
+{
+	WaterSimIsa isa;
+	std::string implName;
+	uint32_t numParticles;
+	WaterSimdAgreementResult agreement;
+};
+
+// For each supported instruction set with a simd implementation, or only for scene.isa if it is set, simulates the
+//  scene for a number of steps and then compares the stages that have simd implementations against the scalar
+//  implementation, timing each stage over numRepetitions runs.
+std::vector<WaterSimdCheckResult> RunWaterSimdCheck(
+	WaterBenchmarkScene& scene, uint32_t numSteps, uint32_t numRepetitions);
+
+struct WaterCompactOutputCheckResult
+{
+	uint32_t numParticles;
+	glm::vec3 positionRange;
+
+	// Largest distance between a decoded compact position and the float position of the same particle
+	float maxPositionError;
+
+	// Largest difference between decoded and actual glow times, for particles that started glowing recently enough
+	//  for their glow age to fit in the compact format
+	float maxGlowTimeError;
+	uint32_t numGlowingParticles;
+};
+
+// Simulates the scene with compact output enabled, changing gravity for the water halfway through so that particles
+//  glow, and then compares the decoded compact particles of the last output frame against the float particles.
+WaterCompactOutputCheckResult RunWaterCompactOutputCheck(WaterBenchmarkScene& scene, uint32_t numSteps);
+
+struct WaterQueryBenchmarkResult
+{
+	uint32_t numQueries;
+	double linearMilliseconds;
+	double batchedMilliseconds;
+
+	// Number of queries where Query and QueryBatch found a different number of intersecting particles
+	uint32_t mismatchedQueries;
+};
+
+// Simulates the scene for a number of steps, and then times answering queries for cube sized boxes placed at random
+//  positions in the water. This is done for each number of queries in queryCounts, both by calling Query for each box
+//  and with a single call to QueryBatch.
+std::vector<WaterQueryBenchmarkResult> RunWaterQueryBenchmark(
+	WaterBenchmarkScene& scene, uint32_t numSteps, std::span<const uint32_t> queryCounts, uint32_t numRepetitions);
+
+// Adds the console commands that run the water benchmarks and checks
+void RegisterWaterBenchmarkCommands();
+
+#endif
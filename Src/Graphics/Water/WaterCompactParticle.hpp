@@ -0,0 +1,62 @@
+#pragma once
+
+// Compact format for particles in the positions GPU buffer, which uses 8 bytes per particle instead of 16. Positions
+//  are stored as 16-bit fractions of a range covering the simulation bounds, and the time that the particle last
+//  started glowing is stored as a 16-bit fraction of COMPACT_GLOW_MAX_AGE before a base time which is shared by all
+//  particles in a frame. Decoded on the GPU by loadParticle in Shaders/Water/WaterParticleData.glh.
+struct WaterCompactParticle
+{
+	uint16_t x;
+	uint16_t y;
+	uint16_t z;
+	uint16_t glowAge;
+};
+
+// Glow ages are clamped to this, which must be longer than GLOW_DURATION in WaterSphere.vs.glsl
+static constexpr float COMPACT_GLOW_MAX_AGE = 1.0f;
+
+// Distance outside of the simulation bounds that is covered by the range of compact positions
+static constexpr float COMPACT_POSITION_MARGIN = 2.0f;
+
+// Describes how particles are stored in the positions GPU buffer
+struct WaterParticleDataLayout
+{
+	// If false, each particle is stored as a vec4 with the position in xyz and the glow time in w
+	bool compact = false;
+
+	// Used to decode compact particles
+	glm::vec3 positionMin{ 0.0f };
+	glm::vec3 positionRange{ 1.0f };
+	float glowTimeBase = 0;
+
+	uint32_t BytesPerParticle() const { return compact ? sizeof(WaterCompactParticle) : sizeof(float) * 4; }
+};
+
+inline WaterCompactParticle EncodeCompactWaterParticle(const glm::vec4& particle, const WaterParticleDataLayout& layout)
+{
+	// Written so that NaN is stored as 0
+	auto Quantize = [](float fraction) -> uint16_t
+	{
+		if (!(fraction > 0))
+			return 0;
+		if (fraction >= 1)
+			return UINT16_MAX;
+		return static_cast<uint16_t>(fraction * static_cast<float>(UINT16_MAX) + 0.5f);
+	};
+
+	const glm::vec3 relPos = (glm::vec3(particle) - layout.positionMin) / layout.positionRange;
+	return WaterCompactParticle{
+		.x = Quantize(relPos.x),
+		.y = Quantize(relPos.y),
+		.z = Quantize(relPos.z),
+		.glowAge = Quantize((layout.glowTimeBase - particle.w) / COMPACT_GLOW_MAX_AGE),
+	};
+}
+
+inline glm::vec4 DecodeCompactWaterParticle(const WaterCompactParticle& particle, const WaterParticleDataLayout& layout)
+{
+	const glm::vec3 relPos = glm::vec3(particle.x, particle.y, particle.z) / static_cast<float>(UINT16_MAX);
+	const float glowAge = static_cast<float>(particle.glowAge) / static_cast<float>(UINT16_MAX);
+	return glm::vec4(
+		layout.positionMin + relPos * layout.positionRange, layout.glowTimeBase - glowAge * COMPACT_GLOW_MAX_AGE);
+}
@@ -0,0 +1,166 @@
+#ifdef IOMOMI_ENABLE_WATER
+
+#include "WaterPresimCache.hpp"
+
+#include <filesystem>
+#include <fstream>
+
+#include "../../FileUtils.hpp"
+
+static const char MAGIC[] = { 'I', 'W', 'P', 'S' };
+
+// Should be incremented when the simulation changes in a way that makes previously cached states invalid
+static constexpr uint32_t CACHE_VERSION = 3;
+
+// The most recently used cache files that are kept, older files are deleted when a new file is saved
+static constexpr size_t MAX_CACHE_FILES = 16;
+
+// Cache files are named after the level content hash, so that editing a level gives it a new cache file. Other
+//  key fields are stored in the file and checked when it is loaded.
+static std::string GetCacheDirectoryPath()
+{
+	return appDataDirPath + "WaterCache";
+}
+
+static std::string GetCacheFilePath(const WaterPresimCacheKey& key)
+{
+	char fileName[32];
+	snprintf(fileName, sizeof(fileName), "/%016llx.bin", static_cast<unsigned long long>(key.levelContentHash));
+	return GetCacheDirectoryPath() + fileName;
+}
+
+static void WriteCacheKey(std::ostream& stream, const WaterPresimCacheKey& key)
+{
+	eg::BinWrite(stream, key.levelContentHash);
+	eg::BinWrite(stream, key.presimIterations);
+	eg::BinWrite(stream, key.stepsPerSecond);
+	eg::BinWrite(stream, static_cast<uint8_t>(key.adaptiveTimeStep));
+	eg::BinWrite(stream, key.cflNumber);
+	eg::BinWrite(stream, key.maxSubsteps);
+	eg::BinWrite(stream, key.maxMergedSteps);
+	eg::BinWrite(stream, key.simSettings.verletSkin);
+	eg::BinWrite(stream, key.simSettings.reorderInterval);
+	eg::BinWrite(stream, static_cast<uint8_t>(key.simSettings.halfPairs));
+	eg::BinWrite(stream, static_cast<uint8_t>(key.simSettings.islands));
+	eg::BinWrite(stream, static_cast<uint8_t>(key.simSettings.reproducible));
+}
+
+static WaterPresimCacheKey ReadCacheKey(std::istream& stream)
+{
+	WaterPresimCacheKey key;
+	key.levelContentHash = eg::BinRead<uint64_t>(stream);
+	key.presimIterations = eg::BinRead<uint32_t>(stream);
+	key.stepsPerSecond = eg::BinRead<uint32_t>(stream);
+	key.adaptiveTimeStep = eg::BinRead<uint8_t>(stream) != 0;
+	key.cflNumber = eg::BinRead<float>(stream);
+	key.maxSubsteps = eg::BinRead<uint32_t>(stream);
+	key.maxMergedSteps = eg::BinRead<uint32_t>(stream);
+	key.simSettings.verletSkin = eg::BinRead<float>(stream);
+	key.simSettings.reorderInterval = eg::BinRead<uint32_t>(stream);
+	key.simSettings.halfPairs = eg::BinRead<uint8_t>(stream) != 0;
+	key.simSettings.islands = eg::BinRead<uint8_t>(stream) != 0;
+	key.simSettings.reproducible = eg::BinRead<uint8_t>(stream) != 0;
+	return key;
+}
+
+// Deletes the least recently used cache files, so that play-testing edited levels doesn't fill up the directory
+static void PruneCacheDirectory(const std::string& directoryPath)
+{
+	std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+	std::error_code ec;
+	for (const auto& entry : std::filesystem::directory_iterator(directoryPath, ec))
+	{
+		std::filesystem::file_time_type writeTime = entry.last_write_time(ec);
+		if (!ec && entry.is_regular_file(ec))
+			files.emplace_back(writeTime, entry.path());
+	}
+	if (files.size() <= MAX_CACHE_FILES)
+		return;
+
+	std::sort(files.begin(), files.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+	for (size_t i = MAX_CACHE_FILES; i < files.size(); i++)
+	{
+		std::filesystem::remove(files[i].second, ec);
+	}
+}
+
+std::optional<WaterPresimState> LoadWaterPresimState(const WaterPresimCacheKey& key)
+{
+	const std::string path = GetCacheFilePath(key);
+	std::ifstream stream(path, std::ios::binary);
+	if (!stream)
+		return std::nullopt;
+
+	char magic[sizeof(MAGIC)];
+	stream.read(magic, sizeof(magic));
+	if (!stream || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || eg::BinRead<uint32_t>(stream) != CACHE_VERSION ||
+	    ReadCacheKey(stream) != key)
+	{
+		return std::nullopt;
+	}
+
+	const uint32_t numParticles = eg::BinRead<uint32_t>(stream);
+	if (!stream)
+		return std::nullopt;
+
+	WaterPresimState state;
+	state.positions.resize(numParticles);
+	state.velocities.resize(numParticles);
+	state.gravities.resize(numParticles);
+	stream.read(reinterpret_cast<char*>(state.positions.data()), numParticles * sizeof(glm::vec3));
+	stream.read(reinterpret_cast<char*>(state.velocities.data()), numParticles * sizeof(glm::vec3));
+	stream.read(reinterpret_cast<char*>(state.gravities.data()), numParticles);
+
+	// Files that are cut short, for example if the game exited while writing, are ignored
+	if (!stream)
+	{
+		eg::Log(eg::LogLevel::Warning, "water", "Ignoring incomplete water presim cache file");
+		return std::nullopt;
+	}
+
+	// Marks the file as recently used, so that it is pruned last
+	std::error_code ec;
+	std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+
+	return state;
+}
+
+void SaveWaterPresimState(const WaterPresimCacheKey& key, const WaterPresimState& state)
+{
+	const std::string directoryPath = GetCacheDirectoryPath();
+	if (!eg::FileExists(directoryPath.c_str()))
+		eg::CreateDirectory(directoryPath.c_str());
+
+	// Writes to a temporary file which is then renamed, so that a partially written file is never loaded
+	const std::string path = GetCacheFilePath(key);
+	const std::string tempPath = path + ".tmp";
+	{
+		std::ofstream stream(tempPath, std::ios::binary);
+		if (!stream)
+		{
+			eg::Log(eg::LogLevel::Error, "water", "Failed to save water presim cache to {0}", tempPath);
+			return;
+		}
+
+		const uint32_t numParticles = eg::UnsignedNarrow<uint32_t>(state.positions.size());
+		stream.write(MAGIC, sizeof(MAGIC));
+		eg::BinWrite(stream, CACHE_VERSION);
+		WriteCacheKey(stream, key);
+		eg::BinWrite(stream, numParticles);
+		stream.write(reinterpret_cast<const char*>(state.positions.data()), numParticles * sizeof(glm::vec3));
+		stream.write(reinterpret_cast<const char*>(state.velocities.data()), numParticles * sizeof(glm::vec3));
+		stream.write(reinterpret_cast<const char*>(state.gravities.data()), numParticles);
+	}
+
+	std::error_code renameError;
+	std::filesystem::rename(tempPath, path, renameError);
+	if (renameError)
+	{
+		eg::Log(eg::LogLevel::Error, "water", "Failed to save water presim cache: {0}", renameError.message());
+		return;
+	}
+
+	PruneCacheDirectory(directoryPath);
+}
+
+#endif
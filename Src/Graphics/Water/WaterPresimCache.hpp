@@ -0,0 +1,40 @@
+#pragma once
+
+#ifdef IOMOMI_ENABLE_WATER
+
+#include <optional>
+
+#include "WaterSimulatorImpl.hpp"
+
+// Particle state after presimulation. This is cached on disk, so that later loads of the same level can start from
+//  the cached state instead of presimulating again.
+struct WaterPresimState
+{
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> velocities;
+	std::vector<uint8_t> gravities;
+};
+
+// Identifies a presimulated state. A cached state is only used if all fields match.
+struct WaterPresimCacheKey
+{
+	uint64_t levelContentHash;
+	uint32_t presimIterations;
+	uint32_t stepsPerSecond;
+
+	// Adaptive time stepping settings, the others should be zero if adaptiveTimeStep is false
+	bool adaptiveTimeStep;
+	float cflNumber;
+	uint32_t maxSubsteps;
+	uint32_t maxMergedSteps;
+
+	WaterSimulatorImpl::StateSettings simSettings;
+
+	bool operator==(const WaterPresimCacheKey&) const = default;
+};
+
+std::optional<WaterPresimState> LoadWaterPresimState(const WaterPresimCacheKey& key);
+
+void SaveWaterPresimState(const WaterPresimCacheKey& key, const WaterPresimState& state);
+
+#endif
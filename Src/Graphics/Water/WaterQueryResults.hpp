@@ -3,6 +3,6 @@
 struct WaterQueryResults
 {
 	int numIntersecting = 0;
-	glm::vec3 waterVelocity;
-	glm::vec3 buoyancy;
+	glm::vec3 waterVelocity = glm::vec3(0.0f);
+	glm::vec3 buoyancy = glm::vec3(0.0f);
 };
@@ -0,0 +1,161 @@
+#ifdef IOMOMI_ENABLE_WATER
+
+#include "WaterRayGrid.hpp"
+
+WaterRayGrid::WaterRayGrid(glm::ivec3 minBounds, glm::ivec3 maxBounds)
+{
+	m_gridMin = minBounds - GRID_MARGIN;
+	m_numCells = glm::max(maxBounds - minBounds + GRID_MARGIN * 2, 1);
+	m_cellsStart.resize(NumCells() + 2, 0);
+}
+
+bool WaterRayGrid::GetCellRange(glm::vec3 position, glm::ivec3& cellMinOut, glm::ivec3& cellMaxOut) const
+{
+	const glm::vec3 relPos = position - glm::vec3(m_gridMin);
+	cellMinOut = glm::ivec3(glm::floor(relPos - PARTICLE_RADIUS));
+	cellMaxOut = glm::ivec3(glm::floor(relPos + PARTICLE_RADIUS));
+
+	// The comparisons are written so that NaN positions also end up outside of the grid
+	return glm::all(glm::greaterThanEqual(relPos - PARTICLE_RADIUS, glm::vec3(0))) &&
+	       glm::all(glm::lessThan(relPos + PARTICLE_RADIUS, glm::vec3(m_numCells)));
+}
+
+void WaterRayGrid::Build(
+	uint32_t numParticles, const float* positionsX, const float* positionsY, const float* positionsZ,
+	const uint32_t* outputIndices)
+{
+	const uint32_t outsideGridBucket = NumCells();
+	std::fill(m_cellsStart.begin(), m_cellsStart.end(), 0);
+
+	// Counts the number of particles in each cell
+	uint32_t numEntries = 0;
+	for (uint32_t i = 0; i < numParticles; i++)
+	{
+		glm::ivec3 cellMin, cellMax;
+		if (!GetCellRange(glm::vec3(positionsX[i], positionsY[i], positionsZ[i]), cellMin, cellMax))
+		{
+			m_cellsStart[outsideGridBucket]++;
+			numEntries++;
+			continue;
+		}
+		for (int z = cellMin.z; z <= cellMax.z; z++)
+		{
+			for (int y = cellMin.y; y <= cellMax.y; y++)
+			{
+				for (int x = cellMin.x; x <= cellMax.x; x++)
+					m_cellsStart[CellIdx(glm::ivec3(x, y, z))]++;
+			}
+		}
+		numEntries += (cellMax.x - cellMin.x + 1) * (cellMax.y - cellMin.y + 1) * (cellMax.z - cellMin.z + 1);
+	}
+
+	// Turns the counts into the end of each bucket. Particles are then added by decrementing the end, which leaves
+	//  the start of each bucket in m_cellsStart.
+	for (uint32_t c = 1; c <= outsideGridBucket; c++)
+		m_cellsStart[c] += m_cellsStart[c - 1];
+	m_cellsStart.back() = numEntries;
+
+	m_cellParticles.resize(numEntries);
+	for (uint32_t i = 0; i < numParticles; i++)
+	{
+		glm::ivec3 cellMin, cellMax;
+		if (!GetCellRange(glm::vec3(positionsX[i], positionsY[i], positionsZ[i]), cellMin, cellMax))
+		{
+			m_cellParticles[--m_cellsStart[outsideGridBucket]] = outputIndices[i];
+			continue;
+		}
+		for (int z = cellMin.z; z <= cellMax.z; z++)
+		{
+			for (int y = cellMin.y; y <= cellMax.y; y++)
+			{
+				for (int x = cellMin.x; x <= cellMax.x; x++)
+					m_cellParticles[--m_cellsStart[CellIdx(glm::ivec3(x, y, z))]] = outputIndices[i];
+			}
+		}
+	}
+}
+
+std::pair<float, glm::vec3> WaterRayGrid::RayIntersect(const eg::Ray& ray, const glm::vec4* outputPositions) const
+{
+	float minDst = INFINITY;
+	glm::vec3 particlePos(0.0f);
+
+	auto TestCell = [&](uint32_t cell)
+	{
+		for (uint32_t i = m_cellsStart[cell]; i < m_cellsStart[cell + 1]; i++)
+		{
+			const glm::vec3 posCopy(outputPositions[m_cellParticles[i]]);
+			float dst;
+			if (ray.Intersects(eg::Sphere(posCopy, PARTICLE_RADIUS), dst) && dst > 0 && dst < minDst)
+			{
+				minDst = dst;
+				particlePos = posCopy;
+			}
+		}
+	};
+
+	if (m_cellsStart.empty())
+		return { minDst, particlePos };
+
+	TestCell(NumCells());
+
+	// Clips the ray against the bounds of the grid
+	const glm::vec3 start = ray.GetStart() - glm::vec3(m_gridMin);
+	const glm::vec3 dir = ray.GetDirection();
+	float tEnter = 0;
+	float tExit = INFINITY;
+	for (int d = 0; d < 3; d++)
+	{
+		if (dir[d] == 0)
+		{
+			if (start[d] < 0 || start[d] > static_cast<float>(m_numCells[d]))
+				return { minDst, particlePos };
+			continue;
+		}
+		const float t1 = -start[d] / dir[d];
+		const float t2 = (static_cast<float>(m_numCells[d]) - start[d]) / dir[d];
+		tEnter = std::max(tEnter, std::min(t1, t2));
+		tExit = std::min(tExit, std::max(t1, t2));
+	}
+	if (tEnter > tExit || tEnter >= minDst)
+		return { minDst, particlePos };
+
+	// Walks through the cells along the ray (Amanatides & Woo). Since a hit point lies in one of the cells that the
+	//  particle was added to, the walk can stop once the closest hit so far is before the end of the current cell.
+	glm::ivec3 cell = glm::clamp(glm::ivec3(glm::floor(start + dir * tEnter)), glm::ivec3(0), m_numCells - 1);
+	glm::ivec3 step;
+	glm::vec3 tNext;
+	glm::vec3 tDelta;
+	for (int d = 0; d < 3; d++)
+	{
+		step[d] = dir[d] < 0 ? -1 : 1;
+		if (dir[d] == 0)
+		{
+			tNext[d] = INFINITY;
+			tDelta[d] = INFINITY;
+		}
+		else
+		{
+			tNext[d] = (static_cast<float>(cell[d] + (step[d] > 0 ? 1 : 0)) - start[d]) / dir[d];
+			tDelta[d] = std::abs(1.0f / dir[d]);
+		}
+	}
+
+	while (true)
+	{
+		TestCell(CellIdx(cell));
+
+		const int axis = tNext.x < tNext.y ? (tNext.x < tNext.z ? 0 : 2) : (tNext.y < tNext.z ? 1 : 2);
+		if (minDst <= tNext[axis] || tNext[axis] >= tExit)
+			break;
+
+		cell[axis] += step[axis];
+		if (cell[axis] < 0 || cell[axis] >= m_numCells[axis])
+			break;
+		tNext[axis] += tDelta[axis];
+	}
+
+	return { minDst, particlePos };
+}
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#ifdef IOMOMI_ENABLE_WATER
+
+// Coarse grid over the simulation bounds which is used to find the particles that a ray might hit, without testing
+//  every particle. Each particle is stored, by its index in the output buffer, in every cell that its bounding box
+//  overlaps. Particles that are not entirely inside the grid are stored in an extra bucket which is always tested.
+class WaterRayGrid
+{
+public:
+	// Radius of the sphere that rays are tested against for each particle
+	static constexpr float PARTICLE_RADIUS = 0.3f;
+
+	WaterRayGrid() = default;
+	WaterRayGrid(glm::ivec3 minBounds, glm::ivec3 maxBounds);
+
+	// Rebuilds the grid from particle positions in storage order. outputIndices maps each storage index to the index
+	//  of the particle in the output order, which is how particles are stored in the grid.
+	void Build(
+		uint32_t numParticles, const float* positionsX, const float* positionsY, const float* positionsZ,
+		const uint32_t* outputIndices);
+
+	// Finds the closest particle hit by the ray. outputPositions are the positions in the output order that the grid
+	//  was built for. Returns a pair of distance and particle position, like IWaterSimulator::RayIntersect.
+	std::pair<float, glm::vec3> RayIntersect(const eg::Ray& ray, const glm::vec4* outputPositions) const;
+
+	uint32_t NumCells() const { return m_numCells.x * m_numCells.y * m_numCells.z; }
+
+private:
+	// Gets the range of cells overlapped by a particle's bounding box, or returns false if it isn't inside the grid
+	bool GetCellRange(glm::vec3 position, glm::ivec3& cellMinOut, glm::ivec3& cellMaxOut) const;
+
+	int CellIdx(glm::ivec3 cell) const { return cell.x + m_numCells.x * (cell.y + m_numCells.y * cell.z); }
+
+	// The grid extends this many cells outside the simulation bounds, so that particles touching the walls are
+	//  still inside the grid
+	static constexpr int GRID_MARGIN = 1;
+
+	glm::ivec3 m_gridMin{ 0 };
+	glm::ivec3 m_numCells{ 0 };
+
+	// The particles in cell c are stored at [m_cellsStart[c], m_cellsStart[c + 1]). Has one extra bucket for
+	//  particles outside of the grid and one element for the end of the last bucket.
+	std::vector<uint32_t> m_cellsStart;
+	std::vector<uint32_t> m_cellParticles;
+};
+
+#endif
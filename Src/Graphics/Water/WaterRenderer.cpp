@@ -51,29 +51,43 @@ WaterRenderer::WaterRenderer()
 	pipelineCITemplate.vertexAttributes[0] = { 0, eg::DataType::Float32, 2, 0 };
 	pipelineCITemplate.vertexBindings[0] = { sizeof(float) * 2, eg::InputRate::Vertex };
 
-	eg::GraphicsPipelineCreateInfo pipelineDepthMinCI = pipelineCITemplate;
-	pipelineDepthMinCI.vertexShader = sphereVS.GetVariant("VDepthMin");
-	pipelineDepthMinCI.fragmentShader = sphereDepthFS.GetVariant("VDepthMin");
-	pipelineDepthMinCI.enableDepthTest = true;
-	pipelineDepthMinCI.enableDepthWrite = true;
-	pipelineDepthMinCI.enableDepthClamp = true;
-	pipelineDepthMinCI.depthCompare = eg::CompareOp::Less;
-	pipelineDepthMinCI.label = "WaterDepthMin";
-	m_pipelineDepthMin = eg::Pipeline::Create(pipelineDepthMinCI);
-	m_pipelineDepthMin.FramebufferFormatHint(
-		GetFormatForRenderTexture(RenderTex::WaterGlowIntensity), GetFormatForRenderTexture(RenderTex::WaterMinDepth));
-
-	eg::GraphicsPipelineCreateInfo pipelineDepthMaxCI = pipelineCITemplate;
-	pipelineDepthMaxCI.vertexShader = sphereVS.GetVariant("VDepthMax");
-	pipelineDepthMaxCI.fragmentShader = sphereDepthFS.GetVariant("VDepthMax");
-	pipelineDepthMaxCI.enableDepthTest = true;
-	pipelineDepthMaxCI.enableDepthWrite = true;
-	pipelineDepthMaxCI.enableDepthClamp = true;
-	pipelineDepthMaxCI.depthCompare = eg::CompareOp::Greater;
-	pipelineDepthMaxCI.label = "WaterDepthMax";
-	m_pipelineDepthMax = eg::Pipeline::Create(pipelineDepthMaxCI);
-	m_pipelineDepthMax.FramebufferFormatHint(
-		eg::Format::Undefined, GetFormatForRenderTexture(RenderTex::WaterMinDepth));
+	// Sets COMPACT_PARTICLES in WaterParticleData.glh
+	eg::SpecializationConstantEntry compactSpecConstants[] = { { 152, 0, sizeof(uint32_t) } };
+	const uint32_t compactSpecConstantValues[] = { 0, 1 };
+
+	for (uint32_t compact = 0; compact < 2; compact++)
+	{
+		eg::GraphicsPipelineCreateInfo pipelineDepthMinCI = pipelineCITemplate;
+		pipelineDepthMinCI.vertexShader = sphereVS.GetVariant("VDepthMin");
+		pipelineDepthMinCI.vertexShader.specConstants = compactSpecConstants;
+		pipelineDepthMinCI.vertexShader.specConstantsData = &compactSpecConstantValues[compact];
+		pipelineDepthMinCI.vertexShader.specConstantsDataSize = sizeof(uint32_t);
+		pipelineDepthMinCI.fragmentShader = sphereDepthFS.GetVariant("VDepthMin");
+		pipelineDepthMinCI.enableDepthTest = true;
+		pipelineDepthMinCI.enableDepthWrite = true;
+		pipelineDepthMinCI.enableDepthClamp = true;
+		pipelineDepthMinCI.depthCompare = eg::CompareOp::Less;
+		pipelineDepthMinCI.label = compact ? "WaterDepthMin[Compact]" : "WaterDepthMin";
+		m_pipelineDepthMin[compact] = eg::Pipeline::Create(pipelineDepthMinCI);
+		m_pipelineDepthMin[compact].FramebufferFormatHint(
+			GetFormatForRenderTexture(RenderTex::WaterGlowIntensity),
+			GetFormatForRenderTexture(RenderTex::WaterMinDepth));
+
+		eg::GraphicsPipelineCreateInfo pipelineDepthMaxCI = pipelineCITemplate;
+		pipelineDepthMaxCI.vertexShader = sphereVS.GetVariant("VDepthMax");
+		pipelineDepthMaxCI.vertexShader.specConstants = compactSpecConstants;
+		pipelineDepthMaxCI.vertexShader.specConstantsData = &compactSpecConstantValues[compact];
+		pipelineDepthMaxCI.vertexShader.specConstantsDataSize = sizeof(uint32_t);
+		pipelineDepthMaxCI.fragmentShader = sphereDepthFS.GetVariant("VDepthMax");
+		pipelineDepthMaxCI.enableDepthTest = true;
+		pipelineDepthMaxCI.enableDepthWrite = true;
+		pipelineDepthMaxCI.enableDepthClamp = true;
+		pipelineDepthMaxCI.depthCompare = eg::CompareOp::Greater;
+		pipelineDepthMaxCI.label = compact ? "WaterDepthMax[Compact]" : "WaterDepthMax";
+		m_pipelineDepthMax[compact] = eg::Pipeline::Create(pipelineDepthMaxCI);
+		m_pipelineDepthMax[compact].FramebufferFormatHint(
+			eg::Format::Undefined, GetFormatForRenderTexture(RenderTex::WaterMinDepth));
+	}
 
 	auto& postFS = eg::GetAsset<eg::ShaderModuleAsset>("Shaders/Water/WaterPost.fs.glsl");
 	eg::GraphicsPipelineCreateInfo pipelinePostCI;
@@ -119,6 +133,15 @@ void WaterRenderer::CreateDepthBlurPipelines(uint32_t samples)
 	m_pipelineBlurPass2.FramebufferFormatHint(eg::Format::R16G16_Float);
 }
 
+// Should match the push constants in WaterSphere.vs.glsl
+struct __attribute__((__packed__, __may_alias__)) WaterSpherePC
+{
+	glm::vec3 compactPositionMin;
+	float compactGlowTimeBase;
+	glm::vec3 compactPositionRange;
+	uint32_t lastParticleIndex;
+};
+
 struct __attribute__((__packed__, __may_alias__)) WaterBlurPC
 {
 	float blurDirX;
@@ -140,7 +163,9 @@ high:  16 samples, 32-bit, HQ-Shader
 vhigh: 26 samples, 32-bit, HQ-Shader
 */
 
-void WaterRenderer::RenderEarly(eg::BufferRef positionsBuffer, uint32_t numParticles, RenderTexManager& rtManager)
+void WaterRenderer::RenderEarly(
+	eg::BufferRef positionsBuffer, uint32_t numParticles, const WaterParticleDataLayout& particleDataLayout,
+	RenderTexManager& rtManager)
 {
 	if (m_currentQualityLevel != settings.waterQuality)
 	{
@@ -169,12 +194,22 @@ void WaterRenderer::RenderEarly(eg::BufferRef positionsBuffer, uint32_t numParti
 	depthMinRPBeginInfo.colorAttachments[0].clearValue = eg::ColorLin(0, 0, 0, 0);
 	eg::DC.BeginRenderPass(depthMinRPBeginInfo);
 
-	eg::DC.BindPipeline(m_pipelineDepthMin);
+	const uint32_t compact = particleDataLayout.compact ? 1 : 0;
+	const uint64_t particleDataSize = static_cast<uint64_t>(numParticles) * particleDataLayout.BytesPerParticle();
+
+	WaterSpherePC spherePC;
+	spherePC.compactPositionMin = particleDataLayout.positionMin;
+	spherePC.compactGlowTimeBase = particleDataLayout.glowTimeBase;
+	spherePC.compactPositionRange = particleDataLayout.positionRange;
+	spherePC.lastParticleIndex = numParticles - 1;
+
+	eg::DC.BindPipeline(m_pipelineDepthMin[compact]);
+	eg::DC.PushConstants(0, spherePC);
 
 	eg::DC.BindUniformBuffer(RenderSettings::instance->Buffer(), 0, 0, 0, RenderSettings::BUFFER_SIZE);
 
 	eg::DC.BindVertexBuffer(0, m_quadVB, 0);
-	eg::DC.BindStorageBuffer(positionsBuffer, 0, 1, 0, numParticles * sizeof(float) * 4);
+	eg::DC.BindStorageBuffer(positionsBuffer, 0, 1, 0, particleDataSize);
 	eg::DC.Draw(0, 4, 0, numParticles);
 
 	eg::DC.EndRenderPass();
@@ -193,13 +228,11 @@ void WaterRenderer::RenderEarly(eg::BufferRef positionsBuffer, uint32_t numParti
 	depthMaxRPBeginInfo.depthClearValue = 0;
 	eg::DC.BeginRenderPass(depthMaxRPBeginInfo);
 
-	eg::DC.BindPipeline(m_pipelineDepthMax);
-
-	uint32_t depthMaxPC = numParticles - 1;
-	eg::DC.PushConstants(0, sizeof(uint32_t), &depthMaxPC);
+	eg::DC.BindPipeline(m_pipelineDepthMax[compact]);
+	eg::DC.PushConstants(0, spherePC);
 
 	eg::DC.BindUniformBuffer(RenderSettings::instance->Buffer(), 0, 0, 0, RenderSettings::BUFFER_SIZE);
-	eg::DC.BindStorageBuffer(positionsBuffer, 0, 1, 0, numParticles * sizeof(float) * 4);
+	eg::DC.BindStorageBuffer(positionsBuffer, 0, 1, 0, particleDataSize);
 	eg::DC.BindTexture(rtManager.GetRenderTexture(RenderTex::GBDepth), 0, 2);
 
 	eg::DC.BindVertexBuffer(0, m_quadVB, 0);
@@ -316,7 +349,11 @@ void WaterRenderer::RenderPost(RenderTexManager& rtManager)
 
 WaterRenderer::WaterRenderer() {}
 void WaterRenderer::CreateDepthBlurPipelines(uint32_t samples) {}
-void WaterRenderer::RenderEarly(eg::BufferRef positionsBuffer, uint32_t numParticles, RenderTexManager& rtManager) {}
+void WaterRenderer::RenderEarly(
+	eg::BufferRef positionsBuffer, uint32_t numParticles, const WaterParticleDataLayout& particleDataLayout,
+	RenderTexManager& rtManager)
+{
+}
 void WaterRenderer::RenderPost(RenderTexManager& rtManager) {}
 
 #endif
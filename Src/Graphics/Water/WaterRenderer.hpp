@@ -3,13 +3,16 @@
 #include <EGame/EG.hpp>
 
 #include "../QualityLevel.hpp"
+#include "WaterCompactParticle.hpp"
 
 class WaterRenderer
 {
 public:
 	WaterRenderer();
 
-	void RenderEarly(eg::BufferRef positionsBuffer, uint32_t numParticles, class RenderTexManager& rtManager);
+	void RenderEarly(
+		eg::BufferRef positionsBuffer, uint32_t numParticles, const WaterParticleDataLayout& particleDataLayout,
+		class RenderTexManager& rtManager);
 	void RenderPost(class RenderTexManager& rtManager);
 
 	static eg::TextureRef GetDummyDepthTexture();
@@ -21,8 +24,9 @@ private:
 
 	eg::Buffer m_quadVB;
 
-	eg::Pipeline m_pipelineDepthMin;
-	eg::Pipeline m_pipelineDepthMax;
+	// Indexed by whether particles are stored in the compact format
+	eg::Pipeline m_pipelineDepthMin[2];
+	eg::Pipeline m_pipelineDepthMax[2];
 	eg::Pipeline m_pipelineBlurPass1;
 	eg::Pipeline m_pipelineBlurPass2;
 	eg::Pipeline m_pipelinePostStdQual;
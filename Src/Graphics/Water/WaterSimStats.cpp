@@ -0,0 +1,110 @@
+#ifdef IOMOMI_ENABLE_WATER
+
+#include "WaterSimStats.hpp"
+
+void WaterSimStepStats::AddSubstep(const WaterSimStepStats& substep)
+{
+	for (size_t s = 0; s < NUM_WATER_SIM_STAGES; s++)
+		stageTimes[s] += substep.stageTimes[s];
+
+	threadTimes.resize(std::max(threadTimes.size(), substep.threadTimes.size()), WaterSimThreadStepTimes{});
+	for (size_t t = 0; t < substep.threadTimes.size(); t++)
+	{
+		for (size_t s = 0; s < NUM_WATER_SIM_STAGES; s++)
+			threadTimes[t].stageBusyTimes[s] += substep.threadTimes[t].stageBusyTimes[s];
+		threadTimes[t].barrierWaitTime += substep.threadTimes[t].barrierWaitTime;
+	}
+
+	neighboursPerParticle = substep.neighboursPerParticle;
+	particlesOutsideGrid = substep.particlesOutsideGrid;
+	numSubsteps++;
+}
+
+WaterSimStatsWindow::WaterSimStatsWindow(uint32_t capacity) : m_capacity(std::max(capacity, 1u))
+{
+	m_steps.reserve(m_capacity);
+}
+
+void WaterSimStatsWindow::AddStep(const WaterSimStepStats& stats)
+{
+	if (m_steps.size() < m_capacity)
+		m_steps.push_back(stats);
+	else
+		m_steps[m_nextStep] = stats;
+	m_nextStep = (m_nextStep + 1) % m_capacity;
+}
+
+// Accumulates values into a WaterSimStatRange. The average is divided by the number of steps once all steps have
+//  been added.
+static void AddToRange(WaterSimStatRange& range, double value, bool first)
+{
+	range.min = first ? value : std::min(range.min, value);
+	range.max = first ? value : std::max(range.max, value);
+	range.avg += value;
+}
+
+static void FinishRange(WaterSimStatRange& range, size_t numSteps)
+{
+	range.avg /= static_cast<double>(numSteps);
+}
+
+WaterSimStatsSummary WaterSimStatsWindow::Summarize() const
+{
+	WaterSimStatsSummary summary;
+	summary.numSteps = eg::UnsignedNarrow<uint32_t>(m_steps.size());
+	if (m_steps.empty())
+		return summary;
+
+	constexpr double NS_TO_MS = 1E-6;
+
+	const size_t numThreads = m_steps.front().threadTimes.size();
+	summary.threadStageBusyTimes.resize(numThreads);
+	summary.threadBarrierWaitTimes.resize(numThreads);
+
+	for (size_t i = 0; i < m_steps.size(); i++)
+	{
+		const WaterSimStepStats& step = m_steps[i];
+		const bool first = i == 0;
+
+		for (size_t s = 0; s < NUM_WATER_SIM_STAGES; s++)
+			AddToRange(summary.stageTimes[s], static_cast<double>(step.stageTimes[s]) * NS_TO_MS, first);
+		AddToRange(summary.queryTime, static_cast<double>(step.queryTime) * NS_TO_MS, first);
+		AddToRange(summary.stepTime, static_cast<double>(step.stepTime) * NS_TO_MS, first);
+
+		for (size_t t = 0; t < std::min(numThreads, step.threadTimes.size()); t++)
+		{
+			const WaterSimThreadStepTimes& threadTimes = step.threadTimes[t];
+			for (size_t s = 0; s < NUM_WATER_SIM_STAGES; s++)
+			{
+				AddToRange(
+					summary.threadStageBusyTimes[t][s], static_cast<double>(threadTimes.stageBusyTimes[s]) * NS_TO_MS,
+					first);
+			}
+			AddToRange(
+				summary.threadBarrierWaitTimes[t], static_cast<double>(threadTimes.barrierWaitTime) * NS_TO_MS, first);
+		}
+
+		AddToRange(summary.neighboursPerParticle, step.neighboursPerParticle, first);
+		AddToRange(summary.particlesOutsideGrid, step.particlesOutsideGrid, first);
+		AddToRange(summary.numSubsteps, step.numSubsteps, first);
+	}
+
+	for (WaterSimStatRange& range : summary.stageTimes)
+		FinishRange(range, m_steps.size());
+	FinishRange(summary.queryTime, m_steps.size());
+	FinishRange(summary.stepTime, m_steps.size());
+	for (std::array<WaterSimStatRange, NUM_WATER_SIM_STAGES>& threadRanges : summary.threadStageBusyTimes)
+	{
+		for (WaterSimStatRange& range : threadRanges)
+			FinishRange(range, m_steps.size());
+	}
+	for (WaterSimStatRange& range : summary.threadBarrierWaitTimes)
+		FinishRange(range, m_steps.size());
+	FinishRange(summary.neighboursPerParticle, m_steps.size());
+	FinishRange(summary.particlesOutsideGrid, m_steps.size());
+	FinishRange(summary.numSubsteps, m_steps.size());
+
+	return summary;
+}
+
+#endif
@@ -0,0 +1,107 @@
+#pragma once
+
+#ifdef IOMOMI_ENABLE_WATER
+
+#include <array>
+
+// Parts of a simulation step that are timed separately
+enum class WaterSimStage
+{
+	MoveAcrossPumps,
+	BinParticles,
+	DetectClose,
+	FindIslands,
+	ComputeNumberDensity,
+	Acceleration,
+	DiffusionAndCollision,
+
+	// With islands, the time spent on the previous three stages is still counted for those stages, and this is the
+	//  remaining time spent looking for island work and waiting for other islands
+	SimulateIslands,
+	ChangeParticleGravity,
+};
+
+constexpr size_t NUM_WATER_SIM_STAGES = 9;
+
+extern const std::array<const char*, NUM_WATER_SIM_STAGES> WATER_SIM_STAGE_NAMES;
+
+// Time in nanoseconds that one simulation thread spent in a step
+struct WaterSimThreadStepTimes
+{
+	// Time spent working on each stage, not including time spent waiting for other threads
+	std::array<uint64_t, NUM_WATER_SIM_STAGES> stageBusyTimes;
+
+	// Time spent waiting at barriers for other threads to catch up
+	uint64_t barrierWaitTime;
+};
+
+// Timings and counters for one simulation step
+struct WaterSimStepStats
+{
+	// Adds the times of another substep of the same step. Counters are taken from the later substep.
+	void AddSubstep(const WaterSimStepStats& substep);
+
+	// Time in nanoseconds from the start to the end of each stage, indexed by WaterSimStage
+	std::array<uint64_t, NUM_WATER_SIM_STAGES> stageTimes;
+
+	// Time in nanoseconds spent answering AABB queries after the step, and for the whole step including queries
+	uint64_t queryTime;
+	uint64_t stepTime;
+
+	// Indexed by simulation thread
+	std::vector<WaterSimThreadStepTimes> threadTimes;
+
+	// The average length of the close particle lists that the step used
+	float neighboursPerParticle;
+
+	// Particles outside of the partition grid. These are not dropped, but are binned into a single bucket that has
+	//  to be searched by every particle close to the edge of the grid.
+	uint32_t particlesOutsideGrid;
+
+	// The number of substeps that the step was split into by adaptive time stepping
+	uint32_t numSubsteps;
+};
+
+// The minimum, average and maximum of a value over the steps in a WaterSimStatsWindow
+struct WaterSimStatRange
+{
+	double min = 0;
+	double avg = 0;
+	double max = 0;
+};
+
+struct WaterSimStatsSummary
+{
+	uint32_t numSteps = 0;
+
+	// Times are in milliseconds
+	std::array<WaterSimStatRange, NUM_WATER_SIM_STAGES> stageTimes;
+	WaterSimStatRange queryTime;
+	WaterSimStatRange stepTime;
+
+	// Indexed by simulation thread
+	std::vector<std::array<WaterSimStatRange, NUM_WATER_SIM_STAGES>> threadStageBusyTimes;
+	std::vector<WaterSimStatRange> threadBarrierWaitTimes;
+
+	WaterSimStatRange neighboursPerParticle;
+	WaterSimStatRange particlesOutsideGrid;
+	WaterSimStatRange numSubsteps;
+};
+
+// Keeps the stats of the most recent steps, so that spikes are visible alongside the average
+class WaterSimStatsWindow
+{
+public:
+	explicit WaterSimStatsWindow(uint32_t capacity);
+
+	void AddStep(const WaterSimStepStats& stats);
+
+	WaterSimStatsSummary Summarize() const;
+
+private:
+	std::vector<WaterSimStepStats> m_steps;
+	uint32_t m_capacity;
+	uint32_t m_nextStep = 0;
+};
+
+#endif
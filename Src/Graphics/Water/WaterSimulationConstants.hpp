@@ -16,10 +16,4 @@ static constexpr float AMBIENT_DENSITY = 0.5f;
 
 static constexpr float WATER_GRAVITY = 10;
 
-// Maximum number of particles per partition grid cell
-static constexpr uint32_t MAX_PER_PART_CELL = 512;
-
-// Maximum number of close particles
-static constexpr uint32_t MAX_CLOSE = 512;
-
 static constexpr int CELL_GROUP_SIZE = 4;
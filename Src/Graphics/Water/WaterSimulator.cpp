@@ -14,9 +14,10 @@
 #include "../../World/Player.hpp"
 #include "../../World/World.hpp"
 #include "../RenderSettings.hpp"
+#include "WaterPresimCache.hpp"
 #include "WaterSimulatorImpl.hpp"
 
-static std::vector<glm::vec3> GenerateWater(World& world)
+std::vector<glm::vec3> GenerateWater(World& world)
 {
 	std::unordered_set<glm::ivec3, IVec3Hash> alreadyGenerated;
 
@@ -64,8 +65,87 @@ static std::vector<glm::vec3> GenerateWater(World& world)
 	return positions;
 }
 
+void CollectWaterBlockers(const World& world, std::vector<WaterBlocker>& blockersOut)
+{
+	const_cast<EntityManager&>(world.entManager)
+		.ForEachWithComponent<WaterBlockComp>(
+			[&](const Ent& entity)
+			{
+				const WaterBlockComp& component = *entity.GetComponent<WaterBlockComp>();
+
+				if (!eg::Contains(component.blockedGravities, true))
+					return;
+
+				float tangentLen = glm::length(component.tangent);
+				float biTangentLen = glm::length(component.biTangent);
+				glm::vec3 normal = glm::normalize(glm::cross(component.tangent, component.biTangent));
+
+				WaterBlocker blocker;
+				blocker.tangent = (component.tangent / tangentLen);
+				blocker.biTangent = (component.biTangent / biTangentLen);
+				blocker.tangentLen = tangentLen;
+				blocker.biTangentLen = biTangentLen;
+				blocker.center = (component.center);
+				blocker.blockedGravities = 0;
+				for (int i = 0; i < 6; i++)
+				{
+					if (component.blockedGravities[i])
+						blocker.blockedGravities |= static_cast<uint8_t>(1 << i);
+				}
+
+				for (int dir = -1; dir <= 1; dir += 2)
+				{
+					WaterBlocker& addedBlocker = blockersOut.emplace_back(blocker);
+					addedBlocker.center = (component.center + normal * (static_cast<float>(dir) * 0.1f));
+					addedBlocker.normal = (normal * static_cast<float>(dir));
+				}
+			});
+}
+
+void CollectWaterPumps(const World& world, std::vector<WaterPumpDescription>& pumpsOut)
+{
+	const_cast<EntityManager&>(world.entManager)
+		.ForEachOfType<PumpEnt>(
+			[&](const PumpEnt& ent)
+			{
+				if (std::optional<WaterPumpDescription> desc = ent.GetPumpDescription())
+				{
+					pumpsOut.push_back(*desc);
+				}
+			});
+}
+
 static int* stepsPerSecondVar = eg::TweakVarInt("water_sps", 60, 1);
 
+// Uploads particles in the compact format (see WaterCompactParticle.hpp), which halves the upload size. Read when the
+//  simulator is created.
+static int* compactOutputVar = eg::TweakVarInt("water_compact_output", 0, 0, 1);
+
+// Caches the water state after presimulation on disk, so that loading the same level again skips presimulation
+static int* presimCacheVar = eg::TweakVarInt("water_presim_cache", 1, 0, 1);
+
+// Water further than water_lod_dist from the camera is only simulated every water_lod_interval steps (0 disables LOD).
+//  Frozen steps are not made up for, so distant water moves water_lod_interval times slower than near water.
+static float* lodDistanceVar = eg::TweakVarFloat("water_lod_dist", 0.0f, 0);
+static int* lodIntervalVar = eg::TweakVarInt("water_lod_interval", 4, 1);
+
+// Water in regions where the average speed has been below water_sleep_speed for water_sleep_steps steps is put to
+//  sleep after presimulation (0 steps disables sleeping)
+static float* sleepSpeedVar = eg::TweakVarFloat("water_sleep_speed", 0.5f, 0);
+static int* sleepStepsVar = eg::TweakVarInt("water_sleep_steps", 60, 0, UINT8_MAX);
+
+// Adapts the time step to the speed of the fastest particle, so that no particle moves further than
+//  water_cfl * INFLUENCE_RADIUS per step. Fast steps are split into up to water_max_substeps substeps, and during
+//  presimulation up to water_max_merged_steps steps are merged into one when the water is calm. One output frame is
+//  still published per 1/water_sps seconds.
+static int* adaptiveTimeStepVar = eg::TweakVarInt("water_adaptive_dt", 0, 0, 1);
+static float* cflNumberVar = eg::TweakVarFloat("water_cfl", 0.25f, 0.01f, 1.0f);
+static int* maxSubstepsVar = eg::TweakVarInt("water_max_substeps", 8, 1);
+static int* maxMergedStepsVar = eg::TweakVarInt("water_max_merged_steps", 2, 1);
+
+// The number of steps that stats are kept for (see GetStats)
+static constexpr uint32_t STATS_WINDOW_STEPS = 120;
+
 class WaterSimulator : public IWaterSimulator
 {
 public:
@@ -90,41 +170,36 @@ public:
 		eg::AABB m_aabbBT;
 	};
 
-	WaterSimulator(World& world, std::span<const glm::vec3> positions)
+	// The simulator starts from initialState and presimulates it for presimIterations steps. If presimCacheKey is
+	//  set, the state after presimulation is saved to the presim cache.
+	WaterSimulator(
+		World& world, const WaterPresimState& initialState, uint32_t presimIterations,
+		std::optional<WaterPresimCacheKey> presimCacheKey)
 	{
-		auto [worldBoundsMin, worldBoundsMax] = world.voxels.CalculateBounds();
-		glm::ivec3 worldSize = worldBoundsMax - worldBoundsMin;
-
-		// Copies voxel air data to isVoxelAir
-		uint8_t* isVoxelAir = (uint8_t*)std::calloc((worldSize.x * worldSize.y * worldSize.z + 7) / 8, 1);
-		for (int z = 0; z < worldSize.z; z++)
-		{
-			for (int y = 0; y < worldSize.y; y++)
-			{
-				for (int x = 0; x < worldSize.x; x++)
-				{
-					size_t index = x + y * worldSize.x + z * worldSize.x * worldSize.y;
-					if (world.voxels.IsAir(glm::ivec3(x, y, z) + worldBoundsMin))
-						isVoxelAir[index / 8] |= static_cast<uint8_t>(1 << (index % 8));
-				}
-			}
-		}
+		m_voxelAir = world.voxels.GetAirBitset();
 
-		m_numParticles = eg::UnsignedNarrow<uint32_t>(positions.size()) + world.extraWaterParticles;
+		m_numParticles = eg::UnsignedNarrow<uint32_t>(initialState.positions.size()) + world.extraWaterParticles;
 
 		WaterSimulatorImpl::ConstructorArgs newArgs;
-		newArgs.minBounds = worldBoundsMin;
-		newArgs.maxBounds = worldBoundsMax;
-		newArgs.isAirBuffer = isVoxelAir;
+		newArgs.minBounds = m_voxelAir->MinBounds();
+		newArgs.maxBounds = m_voxelAir->MaxBounds();
+		newArgs.isAirBuffer = m_voxelAir->Bytes().data();
 		newArgs.extraParticles = world.extraWaterParticles;
-		newArgs.particlePositions = positions;
+		newArgs.particlePositions = initialState.positions;
+		newArgs.particleVelocities = initialState.velocities;
+		newArgs.particleGravities = initialState.gravities;
+		newArgs.compactOutput = *compactOutputVar != 0;
 		m_impl = WaterSimulatorImpl::CreateInstance(newArgs);
 
 		eg::Log(
 			eg::LogLevel::Info, "water", "Initialized water simulator {0} using {1} threads",
 			eg::DemangeTypeName(typeid(*m_impl).name()), m_impl->NumThreads());
 
-		uint64_t bufferSize = sizeof(float) * 4 * m_numParticles;
+		// Acquires the initial output frame, so that the particle data layout is known before the first update
+		m_outputFrame = &m_impl->AcquireOutputFrame();
+		m_particleDataLayout = m_outputFrame->layout;
+
+		uint64_t bufferSize = static_cast<uint64_t>(m_particleDataLayout.BytesPerParticle()) * m_numParticles;
 		m_positionsBuffer = eg::Buffer(eg::BufferFlags::CopyDst | eg::BufferFlags::StorageBuffer, bufferSize, nullptr);
 
 		m_positionsUploadBuffer = eg::Buffer(
@@ -135,7 +210,8 @@ public:
 
 		m_lastGravityBufferVersion = UINT32_MAX;
 		m_presimIterationsCompleted = 0;
-		m_targetPresimIterations = world.waterPresimIterations;
+		m_targetPresimIterations = presimIterations;
+		m_presimCacheKey = presimCacheKey;
 		m_run = true;
 		m_pausedSH = true;
 		m_thread = std::thread(&WaterSimulator::ThreadTarget, this);
@@ -176,55 +252,14 @@ public:
 			return;
 		}
 
-		// Collects information about water blockers
 		m_waterBlockersMT.clear();
-		const_cast<EntityManager&>(world.entManager)
-			.ForEachWithComponent<WaterBlockComp>(
-				[&](const Ent& entity)
-				{
-					const WaterBlockComp& component = *entity.GetComponent<WaterBlockComp>();
-
-					if (!eg::Contains(component.blockedGravities, true))
-						return;
-
-					float tangentLen = glm::length(component.tangent);
-					float biTangentLen = glm::length(component.biTangent);
-					glm::vec3 normal = glm::normalize(glm::cross(component.tangent, component.biTangent));
-
-					WaterBlocker blocker;
-					blocker.tangent = (component.tangent / tangentLen);
-					blocker.biTangent = (component.biTangent / biTangentLen);
-					blocker.tangentLen = tangentLen;
-					blocker.biTangentLen = biTangentLen;
-					blocker.center = (component.center);
-					blocker.blockedGravities = 0;
-					for (int i = 0; i < 6; i++)
-					{
-						if (component.blockedGravities[i])
-							blocker.blockedGravities |= static_cast<uint8_t>(1 << i);
-					}
+		CollectWaterBlockers(world, m_waterBlockersMT);
 
-					for (int dir = -1; dir <= 1; dir += 2)
-					{
-						WaterBlocker& addedBlocker = m_waterBlockersMT.emplace_back(blocker);
-						addedBlocker.center = (component.center + normal * (static_cast<float>(dir) * 0.1f));
-						addedBlocker.normal = (normal * static_cast<float>(dir));
-					}
-				});
-
-		// Collects information about water pumps
 		m_waterPumpsMT.clear();
-		const_cast<EntityManager&>(world.entManager)
-			.ForEachOfType<PumpEnt>(
-				[&](const PumpEnt& ent)
-				{
-					if (std::optional<WaterPumpDescription> desc = ent.GetPumpDescription())
-					{
-						m_waterPumpsMT.push_back(*desc);
-					}
-				});
+		CollectWaterPumps(world, m_waterPumpsMT);
 
-		const uint64_t uploadBufferOffset = eg::CFrameIdx() * m_numParticles * 4 * sizeof(float);
+		const uint64_t bytesPerParticle = m_particleDataLayout.BytesPerParticle();
+		const uint64_t uploadBufferOffset = eg::CFrameIdx() * m_numParticles * bytesPerParticle;
 		const uint64_t gravitiesUploadBufferOffset = eg::CFrameIdx() * m_numParticles;
 		bool gravitiesBufferChanged = false;
 
@@ -276,21 +311,20 @@ public:
 			m_gameTimeSH = RenderSettings::instance->gameTime + GAME_TIME_OFFSET;
 			m_cameraPosSH = cameraPos;
 			m_pausedSH = paused;
-			m_numParticlesToDraw = m_impl->CopyToOutputBuffer();
+		}
 
-			if (m_gravitiesBuffer.handle)
-			{
-				uint32_t gravityBufferVersion;
-				void* gravitiesBufferData = m_impl->GetGravitiesOutputBuffer(gravityBufferVersion);
-				if (m_lastGravityBufferVersion != gravityBufferVersion)
-				{
-					std::memcpy(
-						m_gravitiesUploadBufferMemory + gravitiesUploadBufferOffset, gravitiesBufferData,
-						m_numParticles);
-					m_lastGravityBufferVersion = gravityBufferVersion;
-					gravitiesBufferChanged = true;
-				}
-			}
+		// The output frame is published by the background thread without locking, and stays unchanged until the
+		//  next frame is acquired
+		m_outputFrame = &m_impl->AcquireOutputFrame();
+		m_numParticlesToDraw = m_outputFrame->numParticles;
+		m_particleDataLayout = m_outputFrame->layout;
+
+		if (m_gravitiesBuffer.handle && m_lastGravityBufferVersion != m_outputFrame->gravityVersion)
+		{
+			std::memcpy(
+				m_gravitiesUploadBufferMemory + gravitiesUploadBufferOffset, m_outputFrame->gravities, m_numParticles);
+			m_lastGravityBufferVersion = m_outputFrame->gravityVersion;
+			gravitiesBufferChanged = true;
 		}
 
 		if (!paused)
@@ -307,16 +341,21 @@ public:
 			eg::Log(eg::LogLevel::Info, "w", "updated water gravities buffer");
 		}
 
-		std::memcpy(
-			m_positionsUploadBufferMemory + uploadBufferOffset, m_impl->GetOutputBuffer(),
-			m_numParticlesToDraw * sizeof(float) * 4);
-
-		const uint64_t uploadBufferRange = m_numParticlesToDraw * 4 * sizeof(float);
+		const uint64_t uploadBufferRange = m_numParticlesToDraw * bytesPerParticle;
+		if (m_particleDataLayout.compact)
+		{
+			std::memcpy(
+				m_positionsUploadBufferMemory + uploadBufferOffset, m_outputFrame->compactParticles, uploadBufferRange);
+		}
+		else
+		{
+			std::memcpy(
+				m_positionsUploadBufferMemory + uploadBufferOffset, m_outputFrame->positions, uploadBufferRange);
+		}
 
 		m_changeGravityParticleMT.reset();
 
 		m_positionsUploadBuffer.Flush(uploadBufferOffset, uploadBufferRange);
-		m_currentParticlePositions = reinterpret_cast<float*>(m_positionsUploadBufferMemory + uploadBufferOffset);
 
 		eg::DC.CopyBuffer(m_positionsUploadBuffer, m_positionsBuffer, uploadBufferOffset, 0, uploadBufferRange);
 		m_positionsBuffer.UsageHint(eg::BufferUsage::StorageBufferRead, eg::ShaderAccessFlags::Vertex);
@@ -329,8 +368,15 @@ public:
 		std::vector<WaterBlocker> waterBlockers;
 		std::vector<WaterPumpDescription> waterPumps;
 
+		std::vector<eg::AABB> queryAABBs;
+		std::vector<WaterQueryResults> queryResults;
+
 		glm::vec3 cameraPos;
 
+		WaterSimStepStats stepStats = {};
+		WaterSimStepStats substepStats = {};
+
+		bool firstStep = true;
 		bool presimDone = false;
 		Clock::time_point lastStepEnd = Clock::now();
 		while (true)
@@ -338,6 +384,7 @@ public:
 			WaterSimulatorImpl::SimulateArgs simulateArgs;
 			simulateArgs.shouldChangeParticleGravity = false;
 			int stepsPerSecond;
+			WaterSimulatorImpl::TimeStep timeStep;
 
 			{
 				std::unique_lock<std::mutex> lock(m_mutex);
@@ -349,20 +396,45 @@ public:
 				if (!m_run)
 					break;
 
-				if (m_presimIterationsCompleted != 0)
-					m_impl->SwapBuffers();
 				if (m_presimIterationsCompleted >= m_targetPresimIterations)
 					presimDone = true;
-				else
-					m_presimIterationsCompleted++;
 
 				stepsPerSecond = *stepsPerSecondVar;
+				const float baseDt = 1.0f / static_cast<float>(stepsPerSecond);
+				simulateArgs.baseDt = baseDt;
+				if (*adaptiveTimeStepVar)
+				{
+					// Steps are only merged during presimulation, which doesn't publish frames at a fixed rate
+					uint32_t maxBaseSteps = 1;
+					if (!presimDone)
+					{
+						maxBaseSteps = std::min(
+							static_cast<uint32_t>(*maxMergedStepsVar),
+							m_targetPresimIterations - m_presimIterationsCompleted);
+					}
+					timeStep = WaterSimulatorImpl::ChooseTimeStep(
+						baseDt, m_impl->LastStepMaxSpeed(), *cflNumberVar, maxBaseSteps,
+						static_cast<uint32_t>(*maxSubstepsVar));
+				}
+				else
+				{
+					timeStep = { .numBaseSteps = 1, .numSubsteps = 1, .dt = baseDt };
+				}
+
+				if (!presimDone)
+					m_presimIterationsCompleted += timeStep.numBaseSteps;
 
 				waterBlockers = m_waterBlockersSH;
 				waterPumps = m_waterPumpsSH;
 				simulateArgs.gameTime = m_gameTimeSH;
 				simulateArgs.cameraPos = m_cameraPosSH;
 
+				// All water is simulated during presimulation, since the camera position isn't known yet
+				simulateArgs.lodDistance = presimDone ? *lodDistanceVar : 0.0f;
+				simulateArgs.lodInterval = static_cast<uint32_t>(*lodIntervalVar);
+				simulateArgs.sleepSpeed = *sleepSpeedVar;
+				simulateArgs.sleepSteps = presimDone ? static_cast<uint32_t>(*sleepStepsVar) : 0;
+
 				if (!m_changeGravityParticles.empty())
 				{
 					simulateArgs.shouldChangeParticleGravity = true;
@@ -373,25 +445,76 @@ public:
 				}
 			}
 
-			simulateArgs.dt = 1.0f / static_cast<float>(stepsPerSecond);
+			// The main thread only reads published output frames, so buffers can be swapped without holding the lock
+			if (!firstStep)
+				m_impl->SwapBuffers();
+			firstStep = false;
+
+			if (presimDone && m_presimCacheKey.has_value())
+			{
+				WaterPresimState presimState;
+				m_impl->GetParticleState(presimState.positions, presimState.velocities, presimState.gravities);
+				SaveWaterPresimState(*m_presimCacheKey, presimState);
+				m_presimCacheKey.reset();
+			}
+
+			simulateArgs.dt = timeStep.dt;
 			simulateArgs.waterBlockers = waterBlockers;
 			simulateArgs.waterPumps = waterPumps;
-			m_impl->Simulate(simulateArgs);
+			for (uint32_t substep = 0; substep < timeStep.numSubsteps; substep++)
+			{
+				// Gravity is only changed in the first substep
+				simulateArgs.continuesBaseStep = substep != 0;
+				if (substep != 0)
+				{
+					m_impl->SwapBuffers();
+					simulateArgs.shouldChangeParticleGravity = false;
+				}
+				m_impl->Simulate(simulateArgs);
+
+				if (substep == 0)
+				{
+					m_impl->GetLastStepStats(stepStats);
+				}
+				else
+				{
+					m_impl->GetLastStepStats(substepStats);
+					stepStats.AddSubstep(substepStats);
+				}
+			}
 
+			queryAABBs.clear();
 			for (const std::shared_ptr<QueryAABB>& qaabb : m_queryAABBsBT)
 			{
 				eg::AABB aabb = qaabb->m_aabbBT;
 				aabb.min = glm::min(aabb.min, aabb.max);
 				aabb.max = glm::max(aabb.min, aabb.max);
+				queryAABBs.push_back(aabb);
+			}
+
+			const Clock::time_point queryStart = Clock::now();
+			queryResults.resize(queryAABBs.size());
+			m_impl->QueryBatch(queryAABBs, queryResults);
+			stepStats.queryTime =
+				std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - queryStart).count();
 
-				WaterQueryResults queryResults = m_impl->Query(aabb);
+			m_impl->PublishOutputFrame();
 
-				std::lock_guard<std::mutex> lock(qaabb->m_mutex);
-				qaabb->m_results = queryResults;
+			for (size_t i = 0; i < m_queryAABBsBT.size(); i++)
+			{
+				std::lock_guard<std::mutex> lock(m_queryAABBsBT[i]->m_mutex);
+				m_queryAABBsBT[i]->m_results = queryResults[i];
 			}
 
+			m_numSleepingParticles = m_impl->NumSleepingParticles();
 			m_lastUpdateTime = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - lastStepEnd).count();
 
+			stepStats.stepTime = m_lastUpdateTime;
+			{
+				std::lock_guard<std::mutex> lock(m_statsMutex);
+				m_statsWindow.AddStep(stepStats);
+			}
+
 			if (presimDone)
 				std::this_thread::sleep_until(lastStepEnd + std::chrono::nanoseconds(1000000000LL / stepsPerSecond));
 			lastStepEnd = Clock::now();
@@ -400,27 +523,9 @@ public:
 
 	std::pair<float, glm::vec3> RayIntersect(const eg::Ray& ray) const override
 	{
-		float minDst = INFINITY;
-		glm::vec3 particlePos(0.0f);
-		if (m_currentParticlePositions != nullptr)
-		{
-			for (uint32_t i = 0; i < m_numParticlesToDraw; i++)
-			{
-				glm::vec3 posCopy(
-					m_currentParticlePositions[i * 4], m_currentParticlePositions[i * 4 + 1],
-					m_currentParticlePositions[i * 4 + 2]);
-				float dst;
-				if (ray.Intersects(eg::Sphere(posCopy, 0.3f), dst))
-				{
-					if (dst > 0 && dst < minDst)
-					{
-						minDst = dst;
-						particlePos = posCopy;
-					}
-				}
-			}
-		}
-		return { minDst, particlePos };
+		if (m_outputFrame == nullptr)
+			return { INFINITY, glm::vec3(0.0f) };
+		return m_outputFrame->rayGrid.RayIntersect(ray, m_outputFrame->positions);
 	}
 
 	void ChangeGravity(const glm::vec3& particlePos, Dir newGravity, bool highlightOnly) override
@@ -447,9 +552,18 @@ public:
 	eg::BufferRef GetPositionsGPUBuffer() const override { return m_positionsBuffer; }
 	eg::BufferRef GetGravitiesGPUBuffer() const override { return m_gravitiesBuffer; }
 
+	WaterParticleDataLayout GetParticleDataLayout() const override { return m_particleDataLayout; }
+
 	uint32_t NumParticles() const override { return m_numParticles; }
 	uint32_t NumParticlesToDraw() const override { return m_numParticlesToDraw; }
 	uint64_t LastUpdateTime() const override { return m_lastUpdateTime; }
+	uint32_t NumSleepingParticles() const override { return m_numSleepingParticles; }
+
+	WaterSimStatsSummary GetStats() const override
+	{
+		std::lock_guard<std::mutex> lock(m_statsMutex);
+		return m_statsWindow.Summarize();
+	}
 
 	std::shared_ptr<IQueryAABB> AddQueryAABB(const eg::AABB& aabb) override
 	{
@@ -465,9 +579,17 @@ public:
 	uint32_t m_presimIterationsCompleted = 0;
 	uint32_t m_targetPresimIterations = 0;
 
+	// Only accessed by the background thread after construction
+	std::optional<WaterPresimCacheKey> m_presimCacheKey;
+
 	uint32_t m_lastGravityBufferVersion = 0;
 
 	std::atomic_uint64_t m_lastUpdateTime{ 0 };
+	std::atomic_uint32_t m_numSleepingParticles{ 0 };
+
+	// Written by the background thread after every step
+	mutable std::mutex m_statsMutex;
+	WaterSimStatsWindow m_statsWindow{ STATS_WINDOW_STEPS };
 
 	std::vector<std::weak_ptr<QueryAABB>> m_queryAABBs;
 	std::vector<std::shared_ptr<QueryAABB>> m_queryAABBsBT;
@@ -498,6 +620,10 @@ public:
 	bool m_pausedSH = false;
 	std::condition_variable m_unpausedSignal;
 
+	// Kept alive for the simulator, which reads voxels from it. Declared before m_impl, so that it is destroyed after
+	//  the simulator's threads have stopped.
+	std::shared_ptr<const VoxelAirBitset> m_voxelAir;
+
 	std::unique_ptr<WaterSimulatorImpl> m_impl;
 
 	eg::Buffer m_positionsUploadBuffer;
@@ -508,17 +634,44 @@ public:
 	char* m_gravitiesUploadBufferMemory;
 	eg::Buffer m_gravitiesBuffer;
 
-	volatile const float* m_currentParticlePositions = nullptr;
+	const WaterSimulatorImpl::OutputFrame* m_outputFrame = nullptr;
+	WaterParticleDataLayout m_particleDataLayout;
 
 	std::thread m_thread;
 };
 
 std::unique_ptr<IWaterSimulator> CreateWaterSimulator(class World& world)
 {
-	std::vector<glm::vec3> waterPositions = GenerateWater(world);
-	if (waterPositions.empty() && world.extraWaterParticles == 0)
+	std::optional<WaterPresimCacheKey> presimCacheKey;
+	if (*presimCacheVar && world.contentHash != 0)
+	{
+		presimCacheKey = WaterPresimCacheKey{
+			.levelContentHash = world.contentHash,
+			.presimIterations = world.waterPresimIterations,
+			.stepsPerSecond = static_cast<uint32_t>(*stepsPerSecondVar),
+			.adaptiveTimeStep = *adaptiveTimeStepVar != 0,
+			.cflNumber = *adaptiveTimeStepVar ? *cflNumberVar : 0.0f,
+			.maxSubsteps = *adaptiveTimeStepVar ? static_cast<uint32_t>(*maxSubstepsVar) : 0,
+			.maxMergedSteps = *adaptiveTimeStepVar ? static_cast<uint32_t>(*maxMergedStepsVar) : 0,
+			.simSettings = WaterSimulatorImpl::GetStateSettings(),
+		};
+
+		if (std::optional<WaterPresimState> cachedState = LoadWaterPresimState(*presimCacheKey))
+		{
+			if (cachedState->positions.empty() && world.extraWaterParticles == 0)
+				return nullptr;
+			eg::Log(
+				eg::LogLevel::Info, "water", "Loaded {0} presimulated water particles from cache",
+				cachedState->positions.size());
+			return std::make_unique<WaterSimulator>(world, *cachedState, 0, std::nullopt);
+		}
+	}
+
+	WaterPresimState initialState;
+	initialState.positions = GenerateWater(world);
+	if (initialState.positions.empty() && world.extraWaterParticles == 0)
 		return nullptr;
-	return std::make_unique<WaterSimulator>(world, waterPositions);
+	return std::make_unique<WaterSimulator>(world, initialState, world.waterPresimIterations, presimCacheKey);
 }
 
 #else
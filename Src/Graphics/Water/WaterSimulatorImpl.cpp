@@ -5,6 +5,11 @@
 
 #include <SDL2/SDL_cpuinfo.h>
 #include <new>
+#include <numeric>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
 
 #ifdef __x86_64__
 static int* waterEnableAvx512 = eg::TweakVarInt("wsim_enable_avx512", 1, 0, 1);
@@ -14,14 +19,16 @@ std::unique_ptr<WaterSimulatorImpl> CreateWaterSimulatorImplAvx512(const WaterSi
 std::unique_ptr<WaterSimulatorImpl> CreateWaterSimulatorImplAvx2(const WaterSimulatorImpl::ConstructorArgs& args);
 #endif
 
+const std::array<const char*, NUM_WATER_SIM_ISAS> WATER_SIM_ISA_NAMES = { "Scalar", "AVX2", "AVX-512" };
+
 std::unique_ptr<WaterSimulatorImpl> WaterSimulatorImpl::CreateInstance(const ConstructorArgs& args)
 {
 #ifdef __x86_64__
-	if (SDL_HasAVX512F() && *waterEnableAvx512)
+	if (IsIsaSupported(WaterSimIsa::Avx512) && *waterEnableAvx512)
 	{
 		return CreateWaterSimulatorImplAvx512(args);
 	}
-	if (SDL_HasAVX2() && *waterEnableAvx2)
+	if (IsIsaSupported(WaterSimIsa::Avx2) && *waterEnableAvx2)
 	{
 		return CreateWaterSimulatorImplAvx2(args);
 	}
@@ -29,23 +36,118 @@ std::unique_ptr<WaterSimulatorImpl> WaterSimulatorImpl::CreateInstance(const Con
 	return std::make_unique<WaterSimulatorImpl>(args, alignof(float));
 }
 
+std::unique_ptr<WaterSimulatorImpl> WaterSimulatorImpl::CreateInstance(const ConstructorArgs& args, WaterSimIsa isa)
+{
+	EG_ASSERT(IsIsaSupported(isa));
+#ifdef __x86_64__
+	if (isa == WaterSimIsa::Avx512)
+		return CreateWaterSimulatorImplAvx512(args);
+	if (isa == WaterSimIsa::Avx2)
+		return CreateWaterSimulatorImplAvx2(args);
+#endif
+	return std::make_unique<WaterSimulatorImpl>(args, alignof(float));
+}
+
+bool WaterSimulatorImpl::IsIsaSupported(WaterSimIsa isa)
+{
+	switch (isa)
+	{
+	case WaterSimIsa::Scalar:
+		return true;
+#ifdef __x86_64__
+	case WaterSimIsa::Avx2:
+		return SDL_HasAVX2();
+	case WaterSimIsa::Avx512:
+		return SDL_HasAVX512F();
+#endif
+	default:
+		return false;
+	}
+}
+
+static int* waterNumThreads = eg::TweakVarInt("wsim_threads", 0, 0);
+static int* waterWorkStealing = eg::TweakVarInt("wsim_work_stealing", 1, 0, 1);
+static int* waterPinThreads = eg::TweakVarInt("wsim_pin_threads", 0, 0, 1);
+
+// Extra distance to search for close particles, so that close particle lists can be reused across steps
+static float* waterVerletSkin = eg::TweakVarFloat("wsim_verlet_skin", 0, 0, INFLUENCE_RADIUS);
+
+// Stores each pair of close particles only once, and applies pair interactions to both particles
+static int* waterHalfPairs = eg::TweakVarInt("wsim_half_pairs", 0, 0, 1);
+
+// Simulates bodies of water that are not connected to each other independently
+static int* waterIslands = eg::TweakVarInt("wsim_islands", 0, 0, 1);
+
+// Number of steps between reordering particle data to follow the partition grid, 0 disables reordering
+static int* waterReorderInterval = eg::TweakVarInt("wsim_reorder_interval", 16, 0);
+
+// Number of steps that the connected particles found for a gravity change can be reused by highlight requests
+static int* waterConnectedCacheSteps = eg::TweakVarInt("wsim_connected_cache_steps", 8, 0);
+
+// Makes the simulation reproducible across runs and thread counts (see ConstructorArgs::reproducible)
+static int* waterReproducible = eg::TweakVarInt("wsim_reproducible", 0, 0, 1);
+
+// The seed used in reproducible mode. Otherwise the seed is taken from the current time.
+static constexpr uint64_t REPRODUCIBLE_RNG_SEED = 0x10305017;
+
+const std::array<const char*, NUM_WATER_SIM_STAGES> WATER_SIM_STAGE_NAMES = {
+	"Pumps", "Binning", "Detect Close", "Find Islands", "Density", "Acceleration",
+	"Diffusion & Collision", "Simulate Islands", "Change Gravity",
+};
+
+WaterSimulatorImpl::StateSettings WaterSimulatorImpl::GetStateSettings()
+{
+	return StateSettings{
+		.verletSkin = *waterVerletSkin,
+		.reorderInterval = static_cast<uint32_t>(*waterReorderInterval),
+		.halfPairs = *waterHalfPairs != 0,
+		.islands = *waterIslands != 0,
+		.reproducible = *waterReproducible != 0,
+	};
+}
+
 static std::uniform_real_distribution<float> radiusDist(MIN_PARTICLE_RADIUS, MAX_PARTICLE_RADIUS);
 
-static int GetThreadCount()
+static int GetThreadCount(uint32_t numThreadsArg)
 {
-	constexpr double THREAD_COUNT_MUL = 2;
-	double threadCountD = std::round(static_cast<double>(std::thread::hardware_concurrency()) * THREAD_COUNT_MUL);
+	if (numThreadsArg > 0)
+		return static_cast<int>(numThreadsArg);
+	if (*waterNumThreads > 0)
+		return *waterNumThreads;
+
+	// Without work stealing, more threads than cores are used so that uneven ranges balance out a bit better
+	const double threadCountMul = *waterWorkStealing ? 1 : 2;
+	double threadCountD = std::round(static_cast<double>(std::thread::hardware_concurrency()) * threadCountMul);
 	return std::max(static_cast<int>(threadCountD), 1);
 }
 
+static void PinThreadToCore(std::thread& thread, uint32_t core)
+{
+#ifdef __linux__
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	CPU_SET(core % std::max(std::thread::hardware_concurrency(), 1u), &cpuSet);
+	pthread_setaffinity_np(thread.native_handle(), sizeof(cpuSet), &cpuSet);
+#else
+	(void)thread;
+	(void)core;
+#endif
+}
+
 WaterSimulatorImpl::WaterSimulatorImpl(const ConstructorArgs& args, size_t memoryAlignment)
-	: m_numThreads(GetThreadCount()), m_barrier(m_numThreads)
+	: m_numThreads(GetThreadCount(args.numThreads)), m_barrier(m_numThreads)
 {
-	pcg32_fast initialRng(time(nullptr));
+	m_reproducible = args.reproducible || *waterReproducible != 0;
+	m_rngSeed = m_reproducible ? REPRODUCIBLE_RNG_SEED : static_cast<uint64_t>(time(nullptr));
+
+	// Thread random number generators are seeded separately, so that the numbers drawn from initialRng don't depend
+	//  on the number of threads
+	pcg32_fast threadSeedRng(m_rngSeed + 1);
 	for (uint32_t i = 0; i < m_numThreads; i++)
 	{
-		m_threadRngs.emplace_back(initialRng());
+		m_threadRngs.emplace_back(threadSeedRng());
 	}
+	pcg32_fast initialRng(m_rngSeed);
 
 #if __cpp_lib_hardware_interference_size >= 201603
 	m_itemsPerThreadPreferredDivisibility = std::hardware_destructive_interference_size / 4;
@@ -62,6 +164,46 @@ WaterSimulatorImpl::WaterSimulatorImpl(const ConstructorArgs& args, size_t memor
 		m_allocatedParticles = eg::RoundToNextMultiple(m_allocatedParticles, allocatedParticlesAlign);
 	}
 
+	m_wideParticleIndices = m_allocatedParticles > UINT16_MAX + 1;
+
+	m_useWorkStealing = *waterWorkStealing != 0;
+	if (m_useWorkStealing)
+	{
+		m_numWorkRanges = (m_numParticles + WORK_CHUNK_SIZE - 1) / WORK_CHUNK_SIZE;
+
+		// Gives each thread an equal share of the chunks for every stage
+		m_chunkQueues = std::make_unique<ChunkQueue[]>(NUM_WORK_STEALING_STAGES * m_numThreads);
+		for (uint32_t stage = 0; stage < NUM_WORK_STEALING_STAGES; stage++)
+		{
+			for (uint32_t t = 0; t < m_numThreads; t++)
+			{
+				ChunkQueue& queue = m_chunkQueues[stage * m_numThreads + t];
+				queue.firstChunk = m_numWorkRanges * t / m_numThreads;
+				queue.endChunk = m_numWorkRanges * (t + 1) / m_numThreads;
+				queue.nextChunk = queue.firstChunk;
+			}
+		}
+	}
+	else
+	{
+		m_numWorkRanges = m_numThreads;
+	}
+
+	// Half pair interactions are summed up from per thread accumulators, so the result depends on how particles are
+	//  split between threads
+	m_halfPairLists = *waterHalfPairs != 0 && !m_reproducible;
+	m_useIslands = args.useIslands.value_or(*waterIslands != 0) && !m_halfPairLists;
+	m_verletSkin = *waterVerletSkin;
+	m_closeParticlesSearchRadius = INFLUENCE_RADIUS + m_verletSkin;
+
+	m_memoryAlignment = memoryAlignment;
+	m_closeParticlesPadding = std::max<uint32_t>(allocatedParticlesAlign, 1);
+	m_closeParticlesScratch.resize(m_numWorkRanges);
+	m_threadStepTimes.resize(m_numThreads);
+	m_threadStepMaxima.resize(m_numThreads);
+	if (m_useIslands)
+		m_threadIslandRuns.resize(m_numThreads);
+
 	struct MemoryAllocSubBlock
 	{
 		void** dest;
@@ -100,17 +242,38 @@ WaterSimulatorImpl::WaterSimulatorImpl(const ConstructorArgs& args, size_t memor
 	AllocateParticleMemory(&m_particlesVel2.x);
 	AllocateParticleMemory(&m_particlesVel2.y);
 	AllocateParticleMemory(&m_particlesVel2.z);
-	AllocateParticleMemory(&m_outputBuffer);
 	AllocateParticleMemory(&m_particleDensityX);
 	AllocateParticleMemory(&m_particleDensityY);
 	AllocateParticleMemory(&m_particlesRadius);
 	AllocateParticleMemory(&m_particlesGlowTime);
 	AllocateParticleMemory(&m_particlesGravity);
-	AllocateParticleMemory(&m_particlesGravity2);
+	AllocateParticleMemory(&m_particlesSkipped);
+	AllocateParticleMemory(&m_particlesWake);
+	for (OutputFrame& frame : m_outputFrames)
+	{
+		AllocateParticleMemory(&frame.positions);
+		AllocateParticleMemory(&frame.gravities);
+		if (args.compactOutput)
+			AllocateParticleMemory(&frame.compactParticles);
+		else
+			frame.compactParticles = nullptr;
+	}
 
 	AllocateParticleMemory(&m_numCloseParticles);
-	AllocateParticleMemory(&m_closeParticlesIdx, MAX_CLOSE);
-	AllocateParticleMemory(&m_closeParticlesDist, MAX_CLOSE);
+	AllocateParticleMemory(&m_closeParticlesStart);
+	AllocateParticleMemory(&m_particleOutputIndices);
+	if (m_verletSkin > 0)
+	{
+		AllocateParticleMemory(&m_closeParticlesBuildPos.x);
+		AllocateParticleMemory(&m_closeParticlesBuildPos.y);
+		AllocateParticleMemory(&m_closeParticlesBuildPos.z);
+	}
+	AllocateParticleMemory(&m_reorderScratch);
+	if (m_useIslands)
+	{
+		AllocateParticleMemory(&m_islandParents);
+		AllocateParticleMemory(&m_islandIndexOfRoot);
+	}
 
 	m_dataMemory.reset(aligned_alloc(memoryAlignment, dataMemoryOffset));
 	std::memset(m_dataMemory.get(), 0, dataMemoryOffset);
@@ -120,6 +283,24 @@ WaterSimulatorImpl::WaterSimulatorImpl(const ConstructorArgs& args, size_t memor
 		*block.dest = reinterpret_cast<char*>(m_dataMemory.get()) + block.offset;
 	}
 
+	if (m_halfPairLists)
+	{
+		const size_t accumulatorFloats = static_cast<size_t>(m_allocatedParticles) * 3 * m_numThreads;
+		m_threadPairAccumulatorsMemory.reset(aligned_alloc(memoryAlignment, accumulatorFloats * sizeof(float)));
+		float* accumulators = static_cast<float*>(m_threadPairAccumulatorsMemory.get());
+		std::fill_n(accumulators, accumulatorFloats, 0.0f);
+
+		for (uint32_t t = 0; t < m_numThreads; t++)
+		{
+			float* threadAccumulators = accumulators + static_cast<size_t>(m_allocatedParticles) * 3 * t;
+			m_threadPairAccumulators.push_back(Vec3SOA{
+				.x = threadAccumulators,
+				.y = threadAccumulators + m_allocatedParticles,
+				.z = threadAccumulators + m_allocatedParticles * 2,
+			});
+		}
+	}
+
 	// Generates random particle radii
 	for (uint32_t i = 0; i < m_numParticles; i++)
 	{
@@ -127,7 +308,7 @@ WaterSimulatorImpl::WaterSimulatorImpl(const ConstructorArgs& args, size_t memor
 	}
 
 	std::fill_n(m_particlesGravity, m_allocatedParticles, (uint8_t)Dir::NegY);
-	std::fill_n(m_particlesGravity2, m_allocatedParticles, (uint8_t)Dir::NegY);
+	std::iota(m_particleOutputIndices, m_particleOutputIndices + m_allocatedParticles, 0);
 
 	// Copies particle positions
 	for (size_t i = 0; i < m_numParticles; i++)
@@ -137,24 +318,71 @@ WaterSimulatorImpl::WaterSimulatorImpl(const ConstructorArgs& args, size_t memor
 		m_particlesPos1.z[i] = args.particlePositions[i].z;
 	}
 
+	// Copies saved velocities and gravities
+	if (args.particleVelocities.size() == m_numParticles)
+	{
+		for (size_t i = 0; i < m_numParticles; i++)
+		{
+			m_particlesVel1.x[i] = args.particleVelocities[i].x;
+			m_particlesVel1.y[i] = args.particleVelocities[i].y;
+			m_particlesVel1.z[i] = args.particleVelocities[i].z;
+		}
+	}
+	if (args.particleGravities.size() == m_numParticles)
+	{
+		std::copy_n(args.particleGravities.data(), m_numParticles, m_particlesGravity);
+	}
+
 	worldMin = args.minBounds;
 	worldSize = args.maxBounds - args.minBounds;
 	isVoxelAir = args.isAirBuffer;
 	voxelAirStrideZ = worldSize.x * worldSize.y;
+	BuildCollisionFaces();
+
+	for (OutputFrame& frame : m_outputFrames)
+	{
+		std::fill_n(frame.gravities, m_allocatedParticles, (uint8_t)Dir::NegY);
+		frame.gravityVersion = UINT32_MAX;
+		frame.layout.compact = args.compactOutput;
+		frame.layout.positionMin = glm::vec3(args.minBounds) - COMPACT_POSITION_MARGIN;
+		frame.layout.positionRange = glm::vec3(args.maxBounds - args.minBounds) + COMPACT_POSITION_MARGIN * 2;
+		frame.rayGrid = WaterRayGrid(args.minBounds, args.maxBounds);
+	}
+
+	// Publishes the initial particles, so that there is something to draw before the first step
+	WriteOutputFrame(m_outputFrames[0], m_particlesPos1);
+	m_outputFramePublished = 0 | OUTPUT_FRAME_NEW_BIT;
+
+	m_blockerGridNumCells = glm::max((worldSize + BLOCKER_GRID_CELL_SIZE - 1) / BLOCKER_GRID_CELL_SIZE, 1);
+	m_blockerGridCellsStart.resize(m_blockerGridNumCells.x * m_blockerGridNumCells.y * m_blockerGridNumCells.z + 1, 0);
 
 	constexpr int GRID_CELLS_MARGIN = 5;
-	partGridMin = glm::ivec3(glm::floor(glm::vec3(args.minBounds) / INFLUENCE_RADIUS)) - GRID_CELLS_MARGIN;
-	glm::ivec3 partGridMax = glm::ivec3(glm::ceil(glm::vec3(args.maxBounds) / INFLUENCE_RADIUS)) + GRID_CELLS_MARGIN;
+	partGridCellSize = m_closeParticlesSearchRadius;
+	partGridMin = glm::ivec3(glm::floor(glm::vec3(args.minBounds) / partGridCellSize)) - GRID_CELLS_MARGIN;
+	glm::ivec3 partGridMax = glm::ivec3(glm::ceil(glm::vec3(args.maxBounds) / partGridCellSize)) + GRID_CELLS_MARGIN;
 	partGridNumCellGroups = ((partGridMax - partGridMin) + (CELL_GROUP_SIZE - 1)) / CELL_GROUP_SIZE;
 	partGridNumCells = partGridNumCellGroups * CELL_GROUP_SIZE;
-	cellNumParticles.resize(partGridNumCells.x * partGridNumCells.y * partGridNumCells.z);
-	cellParticles.resize(cellNumParticles.size());
+
+	// Has one extra bucket for particles outside of the grid and one element for the end of the last bucket
+	cellParticlesStart.resize(partGridNumCells.x * partGridNumCells.y * partGridNumCells.z + 2);
+	cellParticlesStart.back() = m_numParticles;
+	m_cellCounts.resize(cellParticlesStart.size() - 1, 0);
+	m_cellRestSteps.resize(m_cellCounts.size(), 0);
+	m_cellMoveDistSums.resize(m_cellCounts.size(), 0);
+	m_cellRangeParticleCounts.resize(m_numThreads);
+
+	const size_t particleIndexSize = m_wideParticleIndices ? sizeof(uint32_t) : sizeof(uint16_t);
+	m_cellParticlesMemory.reset(std::malloc((m_allocatedParticles + CELL_PARTICLES_OVERREAD) * particleIndexSize));
 
 	particleCells.resize(m_allocatedParticles);
+	particleCellIndices.resize(m_allocatedParticles);
+	m_connectedParticlesGeneration.resize(m_allocatedParticles, 0);
 
 	for (uint32_t i = 1; i < m_numThreads; i++)
 	{
-		m_workerThreads.emplace_back([this, i] { WorkerThreadTarget(i); });
+		std::thread& thread = m_workerThreads.emplace_back([this, i] { WorkerThreadTarget(i); });
+		if (*waterPinThreads)
+			PinThreadToCore(thread, i);
 	}
 }
 
@@ -168,26 +396,96 @@ WaterSimulatorImpl::~WaterSimulatorImpl()
 		thread.join();
 }
 
-uint32_t WaterSimulatorImpl::CopyToOutputBuffer()
+void WaterSimulatorImpl::WriteOutputFrame(OutputFrame& frame, const Vec3SOA& positions)
+{
+	frame.numParticles = m_numParticles;
+	for (uint32_t i = 0; i < m_numParticles; i++)
+	{
+		frame.positions[m_particleOutputIndices[i]] =
+			glm::vec4(positions.x[i], positions.y[i], positions.z[i], static_cast<float>(m_particlesGlowTime[i]));
+	}
+
+	if (frame.layout.compact)
+	{
+		frame.layout.glowTimeBase = m_lastStepGameTime;
+		for (uint32_t i = 0; i < m_numParticles; i++)
+		{
+			frame.compactParticles[i] = EncodeCompactWaterParticle(frame.positions[i], frame.layout);
+		}
+	}
+
+	if (frame.gravityVersion != gravityVersion)
+	{
+		for (uint32_t i = 0; i < m_numParticles; i++)
+		{
+			frame.gravities[m_particleOutputIndices[i]] = m_particlesGravity[i];
+		}
+		frame.gravityVersion = gravityVersion;
+	}
+
+	frame.rayGrid.Build(m_numParticles, positions.x, positions.y, positions.z, m_particleOutputIndices);
+}
+
+void WaterSimulatorImpl::GetParticleState(
+	std::vector<glm::vec3>& positionsOut, std::vector<glm::vec3>& velocitiesOut,
+	std::vector<uint8_t>& gravitiesOut) const
 {
+	positionsOut.resize(m_numParticles);
+	velocitiesOut.resize(m_numParticles);
+	gravitiesOut.resize(m_numParticles);
 	for (uint32_t i = 0; i < m_numParticles; i++)
 	{
-		m_outputBuffer[i] = glm::vec4(
-			m_particlesPos1.x[i], m_particlesPos1.y[i], m_particlesPos1.z[i],
-			static_cast<float>(m_particlesGlowTime[i]));
+		const uint32_t outputIndex = m_particleOutputIndices[i];
+		positionsOut[outputIndex] = m_particlesPos1[i];
+		velocitiesOut[outputIndex] = m_particlesVel1[i];
+		gravitiesOut[outputIndex] = m_particlesGravity[i];
 	}
-	return m_numParticles;
 }
 
-void* WaterSimulatorImpl::GetOutputBuffer() const
+void WaterSimulatorImpl::PublishOutputFrame()
 {
-	return m_outputBuffer;
+	WriteOutputFrame(m_outputFrames[m_outputFrameWriting], m_particlesPos2);
+
+	// The previously published frame is written to next, or the frame that the main thread released if it has
+	//  acquired the previously published frame since then
+	const uint32_t previous =
+		m_outputFramePublished.exchange(m_outputFrameWriting | OUTPUT_FRAME_NEW_BIT, std::memory_order_acq_rel);
+	m_outputFrameWriting = previous & ~OUTPUT_FRAME_NEW_BIT;
+}
+
+const WaterSimulatorImpl::OutputFrame& WaterSimulatorImpl::AcquireOutputFrame()
+{
+	if (m_outputFramePublished.load(std::memory_order_relaxed) & OUTPUT_FRAME_NEW_BIT)
+	{
+		const uint32_t published = m_outputFramePublished.exchange(m_outputFrameAcquired, std::memory_order_acq_rel);
+		m_outputFrameAcquired = published & ~OUTPUT_FRAME_NEW_BIT;
+	}
+	return m_outputFrames[m_outputFrameAcquired];
+}
+
+size_t WaterSimulatorImpl::CloseParticlesMemoryUsage() const
+{
+	const size_t particleIndexSize = m_wideParticleIndices ? sizeof(uint32_t) : sizeof(uint16_t);
+	size_t bytes = static_cast<size_t>(m_closeParticlesCapacity) * (particleIndexSize + sizeof(float));
+	bytes +=
+		static_cast<size_t>(m_allocatedParticles) * (sizeof(*m_numCloseParticles) + sizeof(*m_closeParticlesStart));
+	for (const CloseParticlesScratch& scratch : m_closeParticlesScratch)
+	{
+		bytes += scratch.indices.capacity() * sizeof(uint32_t) + scratch.distances.capacity() * sizeof(float);
+	}
+	return bytes;
 }
 
-void* WaterSimulatorImpl::GetGravitiesOutputBuffer(uint32_t& versionOut) const
+void WaterSimulatorImpl::AddToQueryResults(WaterQueryResults& results, const eg::AABB& aabb, uint32_t particle) const
 {
-	versionOut = gravityVersion2;
-	return m_particlesGravity2;
+	glm::vec3 poslo = m_particlesPos2[particle] - m_particlesRadius[particle];
+	glm::vec3 poshi = m_particlesPos2[particle] + m_particlesRadius[particle];
+	if (!glm::any(glm::greaterThan(aabb.min, poshi)) && !glm::any(glm::lessThan(aabb.max, poslo)))
+	{
+		results.numIntersecting++;
+		results.waterVelocity += m_particlesVel2[particle];
+		results.buoyancy -= DirectionVector(static_cast<Dir>(m_particlesGravity[particle]));
+	}
 }
 
 WaterQueryResults WaterSimulatorImpl::Query(const eg::AABB& aabb) const
@@ -196,17 +494,63 @@ WaterQueryResults WaterSimulatorImpl::Query(const eg::AABB& aabb) const
 
 	for (uint32_t p = 0; p < m_numParticles; p++)
 	{
-		glm::vec3 poslo = m_particlesPos2[p] - m_particlesRadius[p];
-		glm::vec3 poshi = m_particlesPos2[p] + m_particlesRadius[p];
-		if (!glm::any(glm::greaterThan(aabb.min, poshi)) && !glm::any(glm::lessThan(aabb.max, poslo)))
+		AddToQueryResults(result, aabb, p);
+	}
+
+	return result;
+}
+
+void WaterSimulatorImpl::QueryBatch(std::span<const eg::AABB> aabbs, std::span<WaterQueryResults> resultsOut) const
+{
+	EG_ASSERT(aabbs.size() == resultsOut.size());
+	if (m_wideParticleIndices)
+		QueryBatchImpl<uint32_t>(aabbs, resultsOut);
+	else
+		QueryBatchImpl<uint16_t>(aabbs, resultsOut);
+}
+
+template <typename IdxT, typename Fn>
+void WaterSimulatorImpl::ForEachParticleInGridBox(glm::vec3 boxMin, glm::vec3 boxMax, Fn fn) const
+{
+	auto VisitCellParticles = [&](int cell)
+	{
+		const IdxT* cellParticles = GetCellParticlesPtr<IdxT>(cell);
+		const uint32_t numCellParticles = GetCellNumParticles(cell);
+		for (uint32_t i = 0; i < numCellParticles; i++)
+			fn(static_cast<uint32_t>(cellParticles[i]));
+	};
+
+	const glm::ivec3 cellsMin =
+		glm::max(glm::ivec3(glm::floor(boxMin / partGridCellSize)) - partGridMin, glm::ivec3(0));
+	const glm::ivec3 cellsMax =
+		glm::min(glm::ivec3(glm::floor(boxMax / partGridCellSize)) - partGridMin, partGridNumCells - 1);
+	for (int z = cellsMin.z; z <= cellsMax.z; z++)
+	{
+		for (int y = cellsMin.y; y <= cellsMax.y; y++)
 		{
-			result.numIntersecting++;
-			result.waterVelocity += m_particlesVel2[p];
-			result.buoyancy -= DirectionVector(static_cast<Dir>(m_particlesGravity[p]));
+			for (int x = cellsMin.x; x <= cellsMax.x; x++)
+				VisitCellParticles(CellIdx(glm::ivec3(x, y, z)));
 		}
 	}
+	VisitCellParticles(partGridNumCells.x * partGridNumCells.y * partGridNumCells.z);
+}
 
-	return result;
+template <typename IdxT>
+void WaterSimulatorImpl::QueryBatchImpl(std::span<const eg::AABB> aabbs, std::span<WaterQueryResults> resultsOut) const
+{
+	// The partition grid was built from the positions at the start of the step, so the area to search is expanded by
+	//  how far particles have moved since then, in addition to the particle radius.
+	const float searchMargin = m_lastStepMaxMoveDist + MAX_PARTICLE_RADIUS;
+
+	for (size_t q = 0; q < aabbs.size(); q++)
+	{
+		const eg::AABB& aabb = aabbs[q];
+		WaterQueryResults result;
+		ForEachParticleInGridBox<IdxT>(
+			aabb.min - searchMargin, aabb.max + searchMargin,
+			[&](uint32_t particle) { AddToQueryResults(result, aabb, particle); });
+		resultsOut[q] = result;
+	}
 }
 
 void WaterSimulatorImpl::SwapBuffers()
@@ -214,13 +558,68 @@ void WaterSimulatorImpl::SwapBuffers()
 	std::swap(m_particlesPos1, m_particlesPos2);
 	std::swap(m_particlesVel1, m_particlesVel2);
 
-	if (gravityVersion2 != gravityVersion)
+	// Reordering is done here since other threads don't read particle data while the buffers are being swapped
+	if (*waterReorderInterval > 0 && m_stepsSinceReorder >= static_cast<uint32_t>(*waterReorderInterval))
 	{
-		std::memcpy(m_particlesGravity2, m_particlesGravity, m_numParticles);
-		gravityVersion2 = gravityVersion;
+		if (m_wideParticleIndices)
+			ReorderParticles<uint32_t>();
+		else
+			ReorderParticles<uint16_t>();
+		m_stepsSinceReorder = 0;
 	}
 }
 
+// Reorders particle data so that particles are stored in the order of the sorted particle list from the last step.
+//  Particles in the same partition cell then end up next to each other in memory, which makes gathering close
+//  particles much more cache friendly.
+template <typename IdxT>
+void WaterSimulatorImpl::ReorderParticles()
+{
+	const IdxT* order = static_cast<const IdxT*>(m_cellParticlesMemory.get());
+
+	auto Gather = [&]<typename T>(const T* src, T* dst)
+	{
+		for (uint32_t i = 0; i < m_numParticles; i++)
+			dst[i] = src[order[i]];
+	};
+
+	auto GatherInPlace = [&]<typename T>(T* data)
+	{
+		static_assert(sizeof(T) <= sizeof(*m_reorderScratch));
+		T* scratch = reinterpret_cast<T*>(m_reorderScratch);
+		Gather(data, scratch);
+		std::copy_n(scratch, m_numParticles, data);
+	};
+
+	// The second position and velocity buffers are overwritten in the next step, so they can be used as scratch
+	Gather(m_particlesPos1.x, m_particlesPos2.x);
+	Gather(m_particlesPos1.y, m_particlesPos2.y);
+	Gather(m_particlesPos1.z, m_particlesPos2.z);
+	Gather(m_particlesVel1.x, m_particlesVel2.x);
+	Gather(m_particlesVel1.y, m_particlesVel2.y);
+	Gather(m_particlesVel1.z, m_particlesVel2.z);
+	std::swap(m_particlesPos1, m_particlesPos2);
+	std::swap(m_particlesVel1, m_particlesVel2);
+
+	GatherInPlace(m_particlesGravity);
+	GatherInPlace(m_particlesGlowTime);
+	GatherInPlace(m_particlesWake);
+
+	// Skipped particles keep their densities from the last step where they were simulated
+	GatherInPlace(m_particleDensityX);
+	GatherInPlace(m_particleDensityY);
+	GatherInPlace(m_particlesRadius);
+	GatherInPlace(m_particleOutputIndices);
+
+	// Particles are now stored in partition cell order, so the partition grid is updated to match
+	IdxT* cellParticles = static_cast<IdxT*>(m_cellParticlesMemory.get());
+	std::iota(cellParticles, cellParticles + m_numParticles, 0);
+
+	// Close particle lists and connected particles refer to particles by storage index, so they must be rebuilt
+	m_closeParticlesOutdated = true;
+	m_connectedParticlesAge = UINT32_MAX;
+}
+
 int WaterSimulatorImpl::CellIdx(glm::ivec3 coord) const
 {
 	if (coord[0] < 0 || coord[1] < 0 || coord[2] < 0 || coord[0] >= partGridNumCells.x ||
@@ -234,8 +633,12 @@ int WaterSimulatorImpl::CellIdx(glm::ivec3 coord) const
 	int groupIdx =
 		group.x + group.y * partGridNumCellGroups.x + group.z * partGridNumCellGroups.x * partGridNumCellGroups.y;
 
-	return groupIdx * CELL_GROUP_SIZE * CELL_GROUP_SIZE * CELL_GROUP_SIZE + local.x + local.y * CELL_GROUP_SIZE +
-	       local.z * CELL_GROUP_SIZE * CELL_GROUP_SIZE;
+	// Cells within a group are ordered along a Z-order curve by interleaving the bits of the local coordinate
+	static_assert(CELL_GROUP_SIZE == 4);
+	static constexpr int SPREAD_BITS[4] = { 0b000, 0b001, 0b1000, 0b1001 };
+	int localIdx = SPREAD_BITS[local.x] | (SPREAD_BITS[local.y] << 1) | (SPREAD_BITS[local.z] << 2);
+
+	return groupIdx * CELL_GROUP_SIZE * CELL_GROUP_SIZE * CELL_GROUP_SIZE + localIdx;
 }
 
 bool WaterSimulatorImpl::IsVoxelAir(glm::ivec3 coord) const
@@ -250,40 +653,81 @@ bool WaterSimulatorImpl::IsVoxelAir(glm::ivec3 coord) const
 	return isVoxelAir[idx / 8] & (1 << (idx % 8));
 }
 
-void WaterSimulatorImpl::MoveAcrossPumps(std::span<const WaterPumpDescription> pumps, float dt)
+void WaterSimulatorImpl::MoveAcrossPumps(std::span<const WaterPumpDescription> pumps, float dt, float baseDt)
 {
 	static constexpr int MAX_PUMP_PER_ITERATION = 16;
 
-	for (const WaterPumpDescription& pump : pumps)
-	{
-		int numToMove =
-			glm::clamp(static_cast<int>(std::round(pump.particlesPerSecond * dt)), 1, MAX_PUMP_PER_ITERATION);
+	m_pumpedParticles.clear();
+	m_pumpBudgets.resize(pumps.size(), 0.0f);
 
-		uint16_t closestIndices[MAX_PUMP_PER_ITERATION];
+	for (size_t pumpIndex = 0; pumpIndex < pumps.size(); pumpIndex++)
+	{
+		const WaterPumpDescription& pump = pumps[pumpIndex];
+
+		// A base step moves the rate rounded to whole particles, at least one. Substeps and merged steps move their
+		//  share of that, and the remaining fraction of a particle carries over to the next step.
+		const float particlesPerBaseStep =
+			glm::clamp(std::round(pump.particlesPerSecond * baseDt), 1.0f, static_cast<float>(MAX_PUMP_PER_ITERATION));
+		float& budget = m_pumpBudgets[pumpIndex];
+		budget = std::min(budget + particlesPerBaseStep * (dt / baseDt), static_cast<float>(MAX_PUMP_PER_ITERATION));
+		const int numToMove = static_cast<int>(budget);
+		budget -= static_cast<float>(numToMove);
+		if (numToMove == 0)
+			continue;
+
+		uint32_t closestIndices[MAX_PUMP_PER_ITERATION];
 		float closestDist2[MAX_PUMP_PER_ITERATION];
-		std::fill_n(closestIndices, MAX_PUMP_PER_ITERATION, UINT16_MAX);
+		std::fill_n(closestIndices, MAX_PUMP_PER_ITERATION, UINT32_MAX);
 		std::fill_n(closestDist2, MAX_PUMP_PER_ITERATION, INFINITY);
 
 		// Selects candidate particles ordered by distance to the pump
-		for (uint32_t i = 0; i < m_numParticles; i++)
+		auto AddCandidate = [&](uint32_t i)
 		{
 			glm::vec3 sep = pump.source - m_particlesPos1[i];
 			float dist2 = glm::length2(sep);
 			if (dist2 > pump.maxInputDistSquared)
-				continue;
+				return;
 
 			size_t idx = std::lower_bound(closestDist2, closestDist2 + MAX_PUMP_PER_ITERATION, dist2) - closestDist2;
 			if (idx >= (size_t)MAX_PUMP_PER_ITERATION)
-				continue;
+				return;
 
 			std::copy_backward(
 				closestIndices + idx, closestIndices + MAX_PUMP_PER_ITERATION - 1,
 				closestIndices + MAX_PUMP_PER_ITERATION);
 			std::copy_backward(
-				closestDist2 + idx, closestDist2 + MAX_PUMP_PER_ITERATION - 1, closestIndices + MAX_PUMP_PER_ITERATION);
+				closestDist2 + idx, closestDist2 + MAX_PUMP_PER_ITERATION - 1, closestDist2 + MAX_PUMP_PER_ITERATION);
 
 			closestIndices[idx] = i;
 			closestDist2[idx] = dist2;
+		};
+
+		if (m_partitionGridBuilt)
+		{
+			// Only particles in partition cells within the input distance are candidates. Particles may have moved
+			//  since they were binned, and those moved by earlier pumps are far from their cells, so they are
+			//  checked separately (unless they were already found in the grid).
+			const float searchRadius = std::sqrt(pump.maxInputDistSquared) + m_lastStepMaxMoveDist;
+			const glm::vec3 searchMin = pump.source - searchRadius;
+			const glm::vec3 searchMax = pump.source + searchRadius;
+			if (m_wideParticleIndices)
+				ForEachParticleInGridBox<uint32_t>(searchMin, searchMax, AddCandidate);
+			else
+				ForEachParticleInGridBox<uint16_t>(searchMin, searchMax, AddCandidate);
+
+			for (uint32_t i : m_pumpedParticles)
+			{
+				if (std::find(closestIndices, closestIndices + MAX_PUMP_PER_ITERATION, i) ==
+				    closestIndices + MAX_PUMP_PER_ITERATION)
+				{
+					AddCandidate(i);
+				}
+			}
+		}
+		else
+		{
+			for (uint32_t i = 0; i < m_numParticles; i++)
+				AddCandidate(i);
 		}
 
 		std::uniform_real_distribution<float> offsetDist(-pump.maxOutputDist, pump.maxOutputDist);
@@ -291,8 +735,8 @@ void WaterSimulatorImpl::MoveAcrossPumps(std::span<const WaterPumpDescription> p
 		// Moves particles
 		for (int i = 0; i < numToMove; i++)
 		{
-			const uint16_t idx = closestIndices[i];
-			if (idx != UINT16_MAX)
+			const uint32_t idx = closestIndices[i];
+			if (idx != UINT32_MAX)
 			{
 				m_particlesPos1.x[idx] = pump.dest.x + offsetDist(m_threadRngs[0]);
 				m_particlesPos1.y[idx] = pump.dest.y + offsetDist(m_threadRngs[0]);
@@ -300,74 +744,304 @@ void WaterSimulatorImpl::MoveAcrossPumps(std::span<const WaterPumpDescription> p
 				m_particlesVel1.x[idx] = 0;
 				m_particlesVel1.y[idx] = 0;
 				m_particlesVel1.z[idx] = 0;
+				m_pumpedParticles.push_back(idx);
 			}
 		}
+
+		// Wakes the water that the moved particles were taken from, so that it flows in to replace them
+		for (int i = numToMove; i < MAX_PUMP_PER_ITERATION; i++)
+		{
+			if (closestIndices[i] != UINT32_MAX)
+				m_particlesWake[closestIndices[i]] = 1;
+		}
 	}
 }
 
-// Changes gravity for particles.
-//  This is done by running a DFS across the graph of close particles, starting at the changed particle.
-void WaterSimulatorImpl::ChangeParticleGravity(glm::vec3 changePos, bool highlightOnly, Dir newGravity, float gameTime)
+// Finds the particle closest to pos by searching the partition grid cells around it
+template <typename IdxT>
+uint32_t WaterSimulatorImpl::FindClosestParticle(glm::vec3 pos) const
 {
-	// Finds the particle closest to the change gravity particle position
-	size_t changeGravityParticle = SIZE_MAX;
+	uint32_t closestParticle = UINT32_MAX;
 	float closestParticleDist2 = INFINITY;
-	for (uint32_t i = 0; i < m_numParticles; i++)
+
+	auto SearchCell = [&](int cell)
+	{
+		const IdxT* cellParticles = GetCellParticlesPtr<IdxT>(cell);
+		const uint32_t numCellParticles = GetCellNumParticles(cell);
+		for (uint32_t i = 0; i < numCellParticles; i++)
+		{
+			float dist2 = glm::distance2(pos, m_particlesPos1[cellParticles[i]]);
+			if (dist2 < closestParticleDist2)
+			{
+				closestParticleDist2 = dist2;
+				closestParticle = cellParticles[i];
+			}
+		}
+	};
+
+	SearchCell(partGridNumCells.x * partGridNumCells.y * partGridNumCells.z);
+
+	const glm::ivec3 centerCell = glm::ivec3(glm::floor(pos / partGridCellSize)) - partGridMin;
+	const glm::ivec3 maxRingPerAxis = glm::max(glm::abs(centerCell), glm::abs(partGridNumCells - 1 - centerCell));
+	const int maxRing = std::max(maxRingPerAxis.x, std::max(maxRingPerAxis.y, maxRingPerAxis.z));
+
+	for (int ring = 0; ring <= maxRing; ring++)
 	{
-		float dist2 = glm::distance2(changePos, m_particlesPos1[i]);
-		if (dist2 < closestParticleDist2)
+		// Particles in cells of this ring are at least ring - 1 cells away from pos along some axis
+		const float ringMinDist = static_cast<float>(std::max(ring - 1, 0)) * partGridCellSize;
+		if (closestParticleDist2 <= ringMinDist * ringMinDist)
+			break;
+
+		const glm::ivec3 cellsMin = glm::max(centerCell - ring, glm::ivec3(0));
+		const glm::ivec3 cellsMax = glm::min(centerCell + ring, partGridNumCells - 1);
+		for (int z = cellsMin.z; z <= cellsMax.z; z++)
 		{
-			closestParticleDist2 = dist2;
-			changeGravityParticle = i;
+			for (int y = cellsMin.y; y <= cellsMax.y; y++)
+			{
+				// Cells inside the ring have already been searched, so only the ends of rows that don't lie on a
+				//  face of the ring are searched
+				if (std::abs(z - centerCell.z) == ring || std::abs(y - centerCell.y) == ring)
+				{
+					for (int x = cellsMin.x; x <= cellsMax.x; x++)
+						SearchCell(CellIdx(glm::ivec3(x, y, z)));
+				}
+				else
+				{
+					if (centerCell.x - ring >= 0)
+						SearchCell(CellIdx(glm::ivec3(centerCell.x - ring, y, z)));
+					if (centerCell.x + ring < partGridNumCells.x)
+						SearchCell(CellIdx(glm::ivec3(centerCell.x + ring, y, z)));
+				}
+			}
 		}
 	}
 
-	if (changeGravityParticle != SIZE_MAX)
+	return closestParticle;
+}
+
+template <typename IdxT>
+void WaterSimulatorImpl::FindConnectedParticles(uint32_t particle)
+{
+	m_connectedGeneration++;
+	if (m_connectedGeneration == 0)
+	{
+		std::fill(m_connectedParticlesGeneration.begin(), m_connectedParticlesGeneration.end(), 0);
+		std::fill(m_connectedCellsGeneration.begin(), m_connectedCellsGeneration.end(), 0);
+		std::fill(m_connectedCellBoxesGeneration.begin(), m_connectedCellBoxesGeneration.end(), 0);
+		m_connectedGeneration = 1;
+	}
+	m_connectedParticles.clear();
+	m_connectedParticlesAge = 0;
+
+	if (m_halfPairLists)
 	{
-		std::vector<bool> seen(m_numParticles, false);
-		seen[changeGravityParticle] = true;
-		std::vector<uint16_t> particlesStack;
-		particlesStack.reserve(m_numParticles);
-		particlesStack.push_back(eg::UnsignedNarrow<uint16_t>(changeGravityParticle));
-		while (!particlesStack.empty())
+		// Close particle lists only contain particles with a higher index in half pair mode, so a flood fill
+		//  wouldn't reach all connected particles. Connected components are instead found with union-find, over the
+		//  particles in the partition cells that can be reached from the particle's cell. The flood fill over cells
+		//  moves to a neighbouring cell if the bounding boxes of the particles in the two cells are closer than
+		//  INFLUENCE_RADIUS, so the cells contain all connected particles since cells are at least INFLUENCE_RADIUS
+		//  wide. Particles outside the grid can be close to particles in any cell, so all particles are searched if
+		//  there are any.
+		const int outsideGridCell = partGridNumCells.x * partGridNumCells.y * partGridNumCells.z;
+		m_connectedCells.clear();
+		if (GetCellNumParticles(outsideGridCell) != 0)
+		{
+			for (int cell = 0; cell <= outsideGridCell; cell++)
+				m_connectedCells.push_back(cell);
+		}
+		else
+		{
+			// Bounding boxes are computed when first needed, which stamps the cell with m_connectedGeneration in
+			//  m_connectedCellBoxesGeneration. Positions haven't changed since the close particle distances were
+			//  computed, since the new positions are written to the other buffer.
+			m_connectedCellsGeneration.resize(outsideGridCell, 0);
+			m_connectedCellBoxesGeneration.resize(outsideGridCell, 0);
+			m_connectedCellBoxes.resize(outsideGridCell);
+			auto GetCellBox = [&](int cell) -> const eg::AABB&
+			{
+				if (m_connectedCellBoxesGeneration[cell] != m_connectedGeneration)
+				{
+					m_connectedCellBoxesGeneration[cell] = m_connectedGeneration;
+					eg::AABB& box = m_connectedCellBoxes[cell];
+					box = eg::AABB(glm::vec3(INFINITY), glm::vec3(-INFINITY));
+					const IdxT* cellParticles = GetCellParticlesPtr<IdxT>(cell);
+					for (uint32_t i = 0; i < GetCellNumParticles(cell); i++)
+					{
+						box.min = glm::min(box.min, m_particlesPos1[cellParticles[i]]);
+						box.max = glm::max(box.max, m_particlesPos1[cellParticles[i]]);
+					}
+				}
+				return m_connectedCellBoxes[cell];
+			};
+
+			// The distance between boxes has a small margin, since it may be rounded differently than distances
+			//  between particles
+			constexpr float MAX_BOX_DIST = INFLUENCE_RADIUS * 1.01f;
+
+			// Flood fill over cells, where m_connectedCells and m_connectedCellCoords also serve as the queue of cells
+			//  to visit
+			const int startCell = CellIdx(particleCells[particle]);
+			m_connectedCellsGeneration[startCell] = m_connectedGeneration;
+			m_connectedCells.push_back(startCell);
+			m_connectedCellCoords.clear();
+			m_connectedCellCoords.push_back(particleCells[particle]);
+			for (size_t i = 0; i < m_connectedCells.size(); i++)
+			{
+				const eg::AABB box = GetCellBox(m_connectedCells[i]);
+				for (int z = -1; z <= 1; z++)
+				{
+					for (int y = -1; y <= 1; y++)
+					{
+						for (int x = -1; x <= 1; x++)
+						{
+							const glm::ivec3 coord = m_connectedCellCoords[i] + glm::ivec3(x, y, z);
+							const int cell = CellIdx(coord);
+							if (cell == -1 || m_connectedCellsGeneration[cell] == m_connectedGeneration ||
+							    GetCellNumParticles(cell) == 0)
+							{
+								continue;
+							}
+
+							const eg::AABB& neighbourBox = GetCellBox(cell);
+							const glm::vec3 gap =
+								glm::max(glm::max(neighbourBox.min - box.max, box.min - neighbourBox.max), 0.0f);
+							if (glm::length2(gap) < MAX_BOX_DIST * MAX_BOX_DIST)
+							{
+								m_connectedCellsGeneration[cell] = m_connectedGeneration;
+								m_connectedCells.push_back(cell);
+								m_connectedCellCoords.push_back(coord);
+							}
+						}
+					}
+				}
+			}
+		}
+
+		m_unionFindParent.resize(m_numParticles);
+		for (int cell : m_connectedCells)
+		{
+			const IdxT* cellParticles = GetCellParticlesPtr<IdxT>(cell);
+			for (uint32_t i = 0; i < GetCellNumParticles(cell); i++)
+				m_unionFindParent[cellParticles[i]] = cellParticles[i];
+		}
+
+		auto FindRoot = [&](uint32_t p)
 		{
-			uint16_t cur = particlesStack.back();
-			particlesStack.pop_back();
+			while (m_unionFindParent[p] != p)
+			{
+				m_unionFindParent[p] = m_unionFindParent[m_unionFindParent[p]];
+				p = m_unionFindParent[p];
+			}
+			return p;
+		};
 
-			if (!highlightOnly)
+		for (int cell : m_connectedCells)
+		{
+			const IdxT* cellParticles = GetCellParticlesPtr<IdxT>(cell);
+			for (uint32_t i = 0; i < GetCellNumParticles(cell); i++)
 			{
-				m_particlesGravity[cur] = static_cast<uint8_t>(newGravity);
+				const uint32_t a = cellParticles[i];
+				const IdxT* closeParticles = GetCloseParticlesIdxPtr<IdxT>(a);
+				const float* closeParticlesDist = GetCloseParticlesDistPtr(a);
+				for (uint32_t bI = 0; bI < m_numCloseParticles[a]; bI++)
+				{
+					if (closeParticlesDist[bI] >= INFLUENCE_RADIUS)
+						continue;
+					const uint32_t rootA = FindRoot(a);
+					const uint32_t rootB = FindRoot(closeParticles[bI]);
+					if (rootA != rootB)
+						m_unionFindParent[rootA] = rootB;
+				}
 			}
-			m_particlesGlowTime[cur] = gameTime;
+		}
 
-			for (uint16_t bI = 0; bI < m_numCloseParticles[cur]; bI++)
+		const uint32_t root = FindRoot(particle);
+		for (int cell : m_connectedCells)
+		{
+			const IdxT* cellParticles = GetCellParticlesPtr<IdxT>(cell);
+			for (uint32_t i = 0; i < GetCellNumParticles(cell); i++)
 			{
-				uint16_t b = GetCloseParticlesIdxPtr(cur)[bI];
-				if (!seen[b])
+				if (FindRoot(cellParticles[i]) == root)
 				{
-					particlesStack.push_back(b);
-					seen[b] = true;
+					m_connectedParticlesGeneration[cellParticles[i]] = m_connectedGeneration;
+					m_connectedParticles.push_back(cellParticles[i]);
 				}
 			}
 		}
+	}
+	else
+	{
+		// Flood fill where m_connectedParticles also serves as the queue of particles to visit
+		m_connectedParticlesGeneration[particle] = m_connectedGeneration;
+		m_connectedParticles.push_back(particle);
+		for (size_t i = 0; i < m_connectedParticles.size(); i++)
+		{
+			const uint32_t cur = m_connectedParticles[i];
+			for (uint32_t bI = 0; bI < m_numCloseParticles[cur]; bI++)
+			{
+				if (GetCloseParticlesDistPtr(cur)[bI] >= INFLUENCE_RADIUS)
+					continue;
+				const uint32_t b = GetCloseParticleIdx(cur, bI);
+				if (m_connectedParticlesGeneration[b] != m_connectedGeneration)
+				{
+					m_connectedParticlesGeneration[b] = m_connectedGeneration;
+					m_connectedParticles.push_back(b);
+				}
+			}
+		}
+	}
+}
+
+// Changes gravity for particles.
+//  This is done by running a DFS across the graph of close particles, starting at the changed particle. With half
+//  pair lists the graph can't be traversed backwards, so connected particles are instead found with union-find over
+//  the partition cells around the changed particle.
+void WaterSimulatorImpl::ChangeParticleGravity(glm::vec3 changePos, bool highlightOnly, Dir newGravity, float gameTime)
+{
+	const uint32_t changeGravityParticle =
+		m_wideParticleIndices ? FindClosestParticle<uint32_t>(changePos) : FindClosestParticle<uint16_t>(changePos);
+	if (changeGravityParticle == UINT32_MAX)
+		return;
+
+	// Highlighting only affects how the water looks, so the connected particles from an earlier request are good
+	//  enough if they are recent and include the closest particle
+	const bool reuseConnectedParticles = highlightOnly &&
+	                                     m_connectedParticlesAge <= static_cast<uint32_t>(*waterConnectedCacheSteps) &&
+	                                     m_connectedParticlesGeneration[changeGravityParticle] == m_connectedGeneration;
+	if (!reuseConnectedParticles)
+	{
+		if (m_wideParticleIndices)
+			FindConnectedParticles<uint32_t>(changeGravityParticle);
+		else
+			FindConnectedParticles<uint16_t>(changeGravityParticle);
+	}
 
+	for (uint32_t particle : m_connectedParticles)
+	{
 		if (!highlightOnly)
 		{
-			gravityVersion++;
+			m_particlesGravity[particle] = static_cast<uint8_t>(newGravity);
+			m_particlesWake[particle] = 1;
 		}
+		m_particlesGlowTime[particle] = gameTime;
+	}
+
+	if (!highlightOnly)
+	{
+		gravityVersion++;
 	}
 }
 
-std::pair<uint32_t, uint32_t> WaterSimulatorImpl::GetThreadWorkingRange(uint32_t threadIndex) const
+std::pair<uint32_t, uint32_t> WaterSimulatorImpl::GetThreadWorkingRange(uint32_t threadIndex, uint32_t numItems) const
 {
-	uint32_t itemsPerThread = m_numParticles / m_numThreads;
+	uint32_t itemsPerThread = numItems / m_numThreads;
 	itemsPerThread &= ~(m_itemsPerThreadPreferredDivisibility - 1);
 
 	uint32_t lo = itemsPerThread * threadIndex;
 	uint32_t hi = lo + itemsPerThread;
 	if (threadIndex == m_numThreads - 1)
 	{
-		hi = m_numParticles;
+		hi = numItems;
 	}
 	return { lo, hi };
 }
@@ -404,47 +1078,1076 @@ static const glm::vec3 voxelBitangentsF[6] = {
 	glm::vec3(0, 0, 1), glm::vec3(1, 0, 0), glm::vec3(1, 0, 0),
 };
 
-void WaterSimulatorImpl::WorkerThreadTarget(uint32_t threadIndex)
+// Precomputes the faces that a particle in each voxel can collide with, which are the faces from solid voxels to air
+//  voxels in the 3x3x3 neighborhood of that voxel.
+void WaterSimulatorImpl::BuildCollisionFaces()
 {
-	uint64_t oldIteration = 0;
-	while (true)
+	// Finds the faces of each solid voxel that face an air voxel (bits 0-5 of the mask). Bits 6-11 and 12-17 are set
+	//  if the face is extended along its tangent or bitangent, which is done when the neighbors along it are solid.
+	const glm::ivec3 masksMin = worldMin - (COLLISION_FACES_MARGIN + 1);
+	const glm::ivec3 masksSize = worldSize + 2 * (COLLISION_FACES_MARGIN + 1);
+	auto MaskIdx = [&](int x, int y, int z) { return x + masksSize.x * (y + masksSize.y * z); };
+
+	std::vector<uint32_t> faceMasks(masksSize.x * masksSize.y * masksSize.z, 0);
+	for (int z = 0; z < masksSize.z; z++)
 	{
-		std::unique_lock<std::mutex> lock(m_workerThreadWakeLock);
-		m_workerThreadWakeSignal.wait(lock, [&] { return m_workerThreadRunIteration != oldIteration; });
-		if (m_workerThreadRunIteration == UINT64_MAX)
-			return;
-		oldIteration = m_workerThreadRunIteration;
-		float dt = m_dtForWorkerThread;
-		std::span<const WaterBlocker> waterBlockers = m_waterBlockersForWorkerThread;
-		lock.unlock();
-
+		for (int y = 0; y < masksSize.y; y++)
+		{
+			for (int x = 0; x < masksSize.x; x++)
+			{
+				const glm::ivec3 voxelCoordSolid = masksMin + glm::ivec3(x, y, z);
+				if (IsVoxelAir(voxelCoordSolid))
+					continue;
+
+				uint32_t mask = 0;
+				for (size_t n = 0; n < std::size(voxelNormalsI); n++)
+				{
+					if (!IsVoxelAir(voxelCoordSolid + voxelNormalsI[n]))
+						continue;
+					mask |= 1u << n;
+
+					const glm::ivec3 tangent = voxelTangentsI[n];
+					const glm::ivec3 bitangent = voxelBitangentsI[n];
+					if (!IsVoxelAir(voxelCoordSolid + tangent) && !IsVoxelAir(voxelCoordSolid - tangent))
+						mask |= 1u << (6 + n);
+					if (!IsVoxelAir(voxelCoordSolid + bitangent) && !IsVoxelAir(voxelCoordSolid - bitangent))
+						mask |= 1u << (12 + n);
+				}
+				faceMasks[MaskIdx(x, y, z)] = mask;
+			}
+		}
+	}
+
+	m_collisionFacesMin = worldMin - COLLISION_FACES_MARGIN;
+	m_collisionFacesSize = worldSize + 2 * COLLISION_FACES_MARGIN;
+	m_voxelCollisionFacesStart.clear();
+	m_voxelCollisionFacesStart.reserve(m_collisionFacesSize.x * m_collisionFacesSize.y * m_collisionFacesSize.z + 1);
+	m_voxelCollisionFaces.clear();
+
+	for (int z = 0; z < m_collisionFacesSize.z; z++)
+	{
+		for (int y = 0; y < m_collisionFacesSize.y; y++)
+		{
+			for (int x = 0; x < m_collisionFacesSize.x; x++)
+			{
+				m_voxelCollisionFacesStart.push_back(eg::UnsignedNarrow<uint32_t>(m_voxelCollisionFaces.size()));
+
+				// Faces are stored in the order that they would be found by looping over the neighborhood
+				for (int dz = -1; dz <= 1; dz++)
+				{
+					for (int dy = -1; dy <= 1; dy++)
+					{
+						for (int dx = -1; dx <= 1; dx++)
+						{
+							const uint32_t mask = faceMasks[MaskIdx(x + 1 + dx, y + 1 + dy, z + 1 + dz)];
+							for (uint32_t n = 0; n < std::size(voxelNormalsI); n++)
+							{
+								if (!(mask & (1u << n)))
+									continue;
+								m_voxelCollisionFaces.push_back(CollisionFace{
+									.solidOffsetX = static_cast<int8_t>(dx),
+									.solidOffsetY = static_cast<int8_t>(dy),
+									.solidOffsetZ = static_cast<int8_t>(dz),
+									.normalIndex = static_cast<uint8_t>(n),
+									.extendedTangent = static_cast<uint8_t>((mask >> (6 + n)) & 1),
+									.extendedBitangent = static_cast<uint8_t>((mask >> (12 + n)) & 1),
+								});
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	m_voxelCollisionFacesStart.push_back(eg::UnsignedNarrow<uint32_t>(m_voxelCollisionFaces.size()));
+}
+
+std::span<const WaterSimulatorImpl::CollisionFace> WaterSimulatorImpl::GetCollisionFaces(glm::ivec3 voxel) const
+{
+	const glm::ivec3 rel = voxel - m_collisionFacesMin;
+	if (rel.x < 0 || rel.y < 0 || rel.z < 0 || rel.x >= m_collisionFacesSize.x || rel.y >= m_collisionFacesSize.y ||
+	    rel.z >= m_collisionFacesSize.z)
+	{
+		return {};
+	}
+
+	const size_t idx = rel.x + m_collisionFacesSize.x * (rel.y + m_collisionFacesSize.y * rel.z);
+	const uint32_t start = m_voxelCollisionFacesStart[idx];
+	const uint32_t end = m_voxelCollisionFacesStart[idx + 1];
+	return std::span<const CollisionFace>(m_voxelCollisionFaces.data() + start, end - start);
+}
+
+glm::ivec3 WaterSimulatorImpl::GetBlockerGridCell(glm::vec3 pos) const
+{
+	glm::ivec3 cell = glm::ivec3(glm::floor((pos - glm::vec3(worldMin)) / static_cast<float>(BLOCKER_GRID_CELL_SIZE)));
+	return glm::clamp(cell, glm::ivec3(0), m_blockerGridNumCells - 1);
+}
+
+void WaterSimulatorImpl::BinWaterBlockers(std::span<const WaterBlocker> waterBlockers)
+{
+	// Particles only collide with a blocker when they are within half their radius of its plane
+	constexpr float MARGIN = MAX_PARTICLE_RADIUS;
+
+	const glm::ivec3 numCells = m_blockerGridNumCells;
+	auto CellIdx = [&](int x, int y, int z) { return x + numCells.x * (y + numCells.y * z); };
+
+	auto ForEachOverlappingCell = [&](const WaterBlocker& blocker, auto callback)
+	{
+		const glm::vec3 extent = glm::abs(blocker.tangent) * blocker.tangentLen +
+		                         glm::abs(blocker.biTangent) * blocker.biTangentLen + MARGIN;
+		const glm::ivec3 cellsMin = GetBlockerGridCell(blocker.center - extent);
+		const glm::ivec3 cellsMax = GetBlockerGridCell(blocker.center + extent);
+		for (int z = cellsMin.z; z <= cellsMax.z; z++)
+		{
+			for (int y = cellsMin.y; y <= cellsMax.y; y++)
+			{
+				for (int x = cellsMin.x; x <= cellsMax.x; x++)
+					callback(CellIdx(x, y, z));
+			}
+		}
+	};
+
+	// Counts the blockers in each cell, and then converts the counts to the end of each cell's range
+	std::fill(m_blockerGridCellsStart.begin(), m_blockerGridCellsStart.end(), 0);
+	for (const WaterBlocker& blocker : waterBlockers)
+	{
+		ForEachOverlappingCell(blocker, [&](int cell) { m_blockerGridCellsStart[cell + 1]++; });
+	}
+	std::partial_sum(m_blockerGridCellsStart.begin(), m_blockerGridCellsStart.end(), m_blockerGridCellsStart.begin());
+
+	// Inserts blockers in order, which moves the start of each cell forward to the start of the next cell
+	m_blockerGridIndices.resize(m_blockerGridCellsStart.back());
+	for (uint32_t i = 0; i < waterBlockers.size(); i++)
+	{
+		ForEachOverlappingCell(
+			waterBlockers[i], [&](int cell) { m_blockerGridIndices[m_blockerGridCellsStart[cell]++] = i; });
+	}
+	std::shift_right(m_blockerGridCellsStart.begin(), m_blockerGridCellsStart.end(), 1);
+	m_blockerGridCellsStart[0] = 0;
+}
+
+static bool operator==(const WaterBlocker& a, const WaterBlocker& b)
+{
+	return a.center == b.center && a.normal == b.normal && a.tangent == b.tangent && a.biTangent == b.biTangent &&
+	       a.tangentLen == b.tangentLen && a.biTangentLen == b.biTangentLen && a.blockedGravities == b.blockedGravities;
+}
+
+// Wakes particles close to blockers that have been added or removed since the last step
+void WaterSimulatorImpl::WakeParticlesNearChangedBlockers(std::span<const WaterBlocker> waterBlockers)
+{
+	if (m_sleepSteps != 0 && m_partitionGridBuilt)
+	{
+		auto WakeParticlesNear = [&](const WaterBlocker& blocker)
+		{
+			const glm::vec3 extent = glm::abs(blocker.tangent) * blocker.tangentLen +
+			                         glm::abs(blocker.biTangent) * blocker.biTangentLen + MAX_PARTICLE_RADIUS +
+			                         m_lastStepMaxMoveDist;
+			auto WakeParticle = [&](uint32_t particle) { m_particlesWake[particle] = 1; };
+			if (m_wideParticleIndices)
+				ForEachParticleInGridBox<uint32_t>(blocker.center - extent, blocker.center + extent, WakeParticle);
+			else
+				ForEachParticleInGridBox<uint16_t>(blocker.center - extent, blocker.center + extent, WakeParticle);
+		};
+
+		auto WakeParticlesNearMissing = [&](std::span<const WaterBlocker> blockers, std::span<const WaterBlocker> other)
+		{
+			for (const WaterBlocker& blocker : blockers)
+			{
+				if (std::find(other.begin(), other.end(), blocker) == other.end())
+					WakeParticlesNear(blocker);
+			}
+		};
+		WakeParticlesNearMissing(waterBlockers, m_lastStepWaterBlockers);
+		WakeParticlesNearMissing(m_lastStepWaterBlockers, waterBlockers);
+	}
+
+	m_lastStepWaterBlockers.assign(waterBlockers.begin(), waterBlockers.end());
+}
+
+std::span<const uint32_t> WaterSimulatorImpl::GetNearbyWaterBlockers(glm::vec3 pos) const
+{
+	const glm::ivec3 cell = GetBlockerGridCell(pos);
+	const int cellIdx = cell.x + m_blockerGridNumCells.x * (cell.y + m_blockerGridNumCells.y * cell.z);
+	const uint32_t start = m_blockerGridCellsStart[cellIdx];
+	const uint32_t end = m_blockerGridCellsStart[cellIdx + 1];
+	return std::span<const uint32_t>(m_blockerGridIndices.data() + start, end - start);
+}
+
+void WaterSimulatorImpl::WorkerThreadTarget(uint32_t threadIndex)
+{
+	uint64_t oldIteration = 0;
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(m_workerThreadWakeLock);
+		m_workerThreadWakeSignal.wait(lock, [&] { return m_workerThreadRunIteration != oldIteration; });
+		if (m_workerThreadRunIteration == UINT64_MAX)
+			return;
+		oldIteration = m_workerThreadRunIteration;
+		float dt = m_dtForWorkerThread;
+		std::span<const WaterBlocker> waterBlockers = m_waterBlockersForWorkerThread;
+		lock.unlock();
+
 		RunAllParallelizedSimulationStages(threadIndex, dt, waterBlockers);
 	}
 }
 
-void WaterSimulatorImpl::RunAllParallelizedSimulationStages(
-	uint32_t threadIndex, float dt, std::span<const WaterBlocker> waterBlockers)
+void WaterSimulatorImpl::RunAllParallelizedSimulationStages(
+	uint32_t threadIndex, float dt, std::span<const WaterBlocker> waterBlockers)
+{
+	auto [plo, phi] = GetThreadWorkingRange(threadIndex, m_numParticles);
+
+	// Waits for all threads to finish the current stage. The first thread also measures how long the stage took.
+	auto stageStartTime = std::chrono::steady_clock::now();
+	m_threadStepTimes[threadIndex].workStartTime = stageStartTime;
+	auto EndStage = [&](WaterSimStage stage)
+	{
+		WaitForAllThreads(threadIndex, stage);
+		if (threadIndex == 0)
+		{
+			auto stageEndTime = std::chrono::steady_clock::now();
+			m_lastStepStageTimes[static_cast<size_t>(stage)] =
+				std::chrono::duration_cast<std::chrono::nanoseconds>(stageEndTime - stageStartTime).count();
+			stageStartTime = stageEndTime;
+		}
+	};
+
+	BinParticles(threadIndex, plo, phi);
+	EndStage(WaterSimStage::BinParticles);
+
+	const bool rebuildCloseParticles = m_verletSkin <= 0 || m_closeParticlesOutdated.load(std::memory_order_relaxed);
+	if (rebuildCloseParticles)
+	{
+		RunStageForAllRanges(
+			0, threadIndex, dt,
+			[&](SimulateStageArgs args)
+			{
+				CloseParticlesScratch& closeParticlesScratch = m_closeParticlesScratch[args.rangeIndex];
+				closeParticlesScratch.indices.clear();
+				closeParticlesScratch.distances.clear();
+				uint32_t numDetectCloseParticles = 0;
+				if (m_skipParticlesThisStep && !m_detectCloseForAllParticles)
+				{
+					for (uint32_t i = args.loIdx; i < args.hiIdx; i++)
+					{
+						m_numCloseParticles[i] = 0;
+						m_closeParticlesStart[i] = 0;
+					}
+					ForEachSimulatedRange(
+						args,
+						[&](SimulateStageArgs runArgs)
+						{
+							Stage1_DetectClose(runArgs);
+							numDetectCloseParticles += runArgs.hiIdx - runArgs.loIdx;
+						});
+				}
+				else
+				{
+					Stage1_DetectClose(args);
+					numDetectCloseParticles = args.hiIdx - args.loIdx;
+				}
+				m_numDetectCloseParticles.fetch_add(numDetectCloseParticles, std::memory_order_relaxed);
+
+				if (m_verletSkin > 0)
+				{
+					for (uint32_t i = args.loIdx; i < args.hiIdx; i++)
+					{
+						m_closeParticlesBuildPos.x[i] = m_particlesPos1.x[i];
+						m_closeParticlesBuildPos.y[i] = m_particlesPos1.y[i];
+						m_closeParticlesBuildPos.z[i] = m_particlesPos1.z[i];
+					}
+				}
+			});
+	}
+	else
+	{
+		RunStageForAllRanges(0, threadIndex, dt, [&](SimulateStageArgs args) { RefreshCloseParticleDistances(args); });
+	}
+
+	// The last thread to finish stage 1 makes room for all close particles before the other threads continue.
+	//  All threads have read m_closeParticlesOutdated at this point, so it can also be reset here.
+	if (m_stage1ThreadsRemaining.fetch_sub(1, std::memory_order_acq_rel) == 1 && rebuildCloseParticles)
+	{
+		AllocateCloseParticlesStorage();
+		m_closeParticlesOutdated = false;
+		m_numCloseParticleRebuilds++;
+	}
+	EndStage(WaterSimStage::DetectClose);
+
+	auto CompactCloseParticlesIfRebuilt = [&](SimulateStageArgs args)
+	{
+		if (rebuildCloseParticles)
+			CompactCloseParticles(args);
+	};
+
+	if (m_useIslands)
+	{
+		RunStageForAllRanges(
+			1, threadIndex, dt,
+			[&](SimulateStageArgs args)
+			{
+				CompactCloseParticlesIfRebuilt(args);
+				UnionCloseParticleIslands(args);
+			});
+		WaitForAllThreads(threadIndex, WaterSimStage::FindIslands);
+
+		// The last thread to find the islands in its range builds the island groups before the other threads continue
+		FindIslands(threadIndex);
+		if (m_findIslandsThreadsRemaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			BuildIslands();
+		EndStage(WaterSimStage::FindIslands);
+
+		SimulateIslands(threadIndex, dt, waterBlockers);
+		EndStage(WaterSimStage::SimulateIslands);
+		if (threadIndex == 0)
+			SplitIslandStageTimes();
+		return;
+	}
+
+	if (m_halfPairLists)
+	{
+		// Each stage is split into accumulating pair interactions and then applying the accumulated values, since
+		//  interactions for a particle can come from any thread.
+		RunStageForAllRanges(
+			1, threadIndex, dt,
+			[&](SimulateStageArgs args)
+			{
+				CompactCloseParticlesIfRebuilt(args);
+				if (m_wideParticleIndices)
+					AccumulateNumberDensityHalfPairs<uint32_t>(args);
+				else
+					AccumulateNumberDensityHalfPairs<uint16_t>(args);
+			});
+		WaitForAllThreads(threadIndex, WaterSimStage::ComputeNumberDensity);
+		RunStageForAllRanges(4, threadIndex, dt, [&](SimulateStageArgs args) { FinishNumberDensityHalfPairs(args); });
+		EndStage(WaterSimStage::ComputeNumberDensity);
+
+		RunStageForAllRanges(
+			2, threadIndex, dt,
+			[&](SimulateStageArgs args)
+			{
+				if (m_wideParticleIndices)
+					AccumulateAccelerationHalfPairs<uint32_t>(args);
+				else
+					AccumulateAccelerationHalfPairs<uint16_t>(args);
+			});
+		WaitForAllThreads(threadIndex, WaterSimStage::Acceleration);
+		RunStageForAllRanges(5, threadIndex, dt, [&](SimulateStageArgs args) { FinishAccelerationHalfPairs(args); });
+		EndStage(WaterSimStage::Acceleration);
+
+		RunStageForAllRanges(
+			3, threadIndex, dt,
+			[&](SimulateStageArgs args)
+			{
+				if (m_wideParticleIndices)
+					AccumulateDiffusionHalfPairs<uint32_t>(args);
+				else
+					AccumulateDiffusionHalfPairs<uint16_t>(args);
+			});
+		WaitForAllThreads(threadIndex, WaterSimStage::DiffusionAndCollision);
+		RunStageForAllRanges(
+			6, threadIndex, dt,
+			[&](SimulateStageArgs args) { FinishDiffusionAndCollisionHalfPairs(args, waterBlockers); });
+		EndStage(WaterSimStage::DiffusionAndCollision);
+		return;
+	}
+
+	RunStageForAllRanges(
+		1, threadIndex, dt,
+		[&](SimulateStageArgs args)
+		{
+			CompactCloseParticlesIfRebuilt(args);
+			ForEachSimulatedRange(args, [&](SimulateStageArgs runArgs) { Stage2_ComputeNumberDensity(runArgs); });
+		});
+	EndStage(WaterSimStage::ComputeNumberDensity);
+
+	RunStageForAllRanges(
+		2, threadIndex, dt,
+		[&](SimulateStageArgs args)
+		{ ForEachSimulatedRange(args, [&](SimulateStageArgs runArgs) { Stage3_Acceleration(runArgs); }); });
+	EndStage(WaterSimStage::Acceleration);
+
+	RunStageForAllRanges(
+		3, threadIndex, dt,
+		[&](SimulateStageArgs args)
+		{
+			KeepSkippedParticles(args.loIdx, args.hiIdx, args.threadIndex);
+			ForEachSimulatedRange(
+				args, [&](SimulateStageArgs runArgs) { Stage4_DiffusionAndCollision(runArgs, waterBlockers); });
+		});
+	EndStage(WaterSimStage::DiffusionAndCollision);
+}
+
+// Skipped particles stay where they are, but keep their velocity for the next step where they are simulated
+void WaterSimulatorImpl::KeepSkippedParticles(uint32_t loIdx, uint32_t hiIdx, uint32_t threadIndex)
+{
+	if (!m_skipParticlesThisStep)
+		return;
+
+	float maxSpeed2 = 0;
+	for (uint32_t i = loIdx; i < hiIdx; i++)
+	{
+		if (m_particlesSkipped[i])
+		{
+			m_particlesPos2.x[i] = m_particlesPos1.x[i];
+			m_particlesPos2.y[i] = m_particlesPos1.y[i];
+			m_particlesPos2.z[i] = m_particlesPos1.z[i];
+			m_particlesVel2.x[i] = m_particlesVel1.x[i];
+			m_particlesVel2.y[i] = m_particlesVel1.y[i];
+			m_particlesVel2.z[i] = m_particlesVel1.z[i];
+			maxSpeed2 = std::max(maxSpeed2, glm::length2(m_particlesVel1[i]));
+		}
+	}
+
+	float& threadMaxSpeed2 = m_threadStepMaxima[threadIndex].speed2;
+	threadMaxSpeed2 = std::max(threadMaxSpeed2, maxSpeed2);
+}
+
+uint32_t WaterSimulatorImpl::FindIslandRoot(uint32_t particle)
+{
+	while (true)
+	{
+		const uint32_t parent = std::atomic_ref<uint32_t>(m_islandParents[particle]).load(std::memory_order_relaxed);
+		if (parent == particle)
+			return particle;
+
+		// Path halving. Parents only ever change to another ancestor, so this doesn't need to be atomic with the load.
+		const uint32_t grandparent =
+			std::atomic_ref<uint32_t>(m_islandParents[parent]).load(std::memory_order_relaxed);
+		std::atomic_ref<uint32_t>(m_islandParents[particle]).store(grandparent, std::memory_order_relaxed);
+		particle = grandparent;
+	}
+}
+
+// Joins the island of each particle in the range with the islands of its close particles. Two simulated particles
+//  that are close are in each other's close particle lists, so only particles with a lower index are looked at.
+void WaterSimulatorImpl::UnionCloseParticleIslands(SimulateStageArgs args)
+{
+	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
+	{
+		uint32_t rootA = FindIslandRoot(a);
+		for (uint32_t bI = 0; bI < m_numCloseParticles[a]; bI++)
+		{
+			const uint32_t b = GetCloseParticleIdx(a, bI);
+			if (b > a)
+				continue;
+
+			uint32_t rootB = FindIslandRoot(b);
+			while (rootA != rootB)
+			{
+				// Links the root with the higher index to the other one, unless another thread changed it first
+				const uint32_t hi = std::max(rootA, rootB);
+				const uint32_t lo = std::min(rootA, rootB);
+				uint32_t expected = hi;
+				if (std::atomic_ref<uint32_t>(m_islandParents[hi])
+				        .compare_exchange_weak(expected, lo, std::memory_order_relaxed))
+				{
+					rootA = lo;
+					break;
+				}
+				rootA = FindIslandRoot(rootA);
+				rootB = FindIslandRoot(rootB);
+			}
+		}
+	}
+}
+
+// Replaces the parent of each particle in this thread's range with the root of its island, and finds the runs of
+//  consecutive simulated particles in the same island. Skipped particles are not part of any island, so they are
+//  copied here instead of in the diffusion and collision stage.
+void WaterSimulatorImpl::FindIslands(uint32_t threadIndex)
+{
+	// Runs store the root of their island until BuildIslands has grouped the islands
+	std::vector<IslandRun>& runs = m_threadIslandRuns[threadIndex].runs;
+	runs.clear();
+
+	auto [lo, hi] = GetThreadWorkingRange(threadIndex, m_numParticles);
+	for (uint32_t p = lo; p < hi; p++)
+	{
+		const uint32_t root = FindIslandRoot(p);
+		std::atomic_ref<uint32_t>(m_islandParents[p]).store(root, std::memory_order_relaxed);
+		if (m_skipParticlesThisStep && m_particlesSkipped[p])
+			continue;
+
+		if (!runs.empty() && runs.back().hi == p && runs.back().island == root)
+			runs.back().hi = p + 1;
+		else
+			runs.push_back(IslandRun{ .lo = p, .hi = p + 1, .island = root });
+	}
+	KeepSkippedParticles(lo, hi, threadIndex);
+}
+
+// Groups the runs found by all threads by island, and splits them into chunks
+void WaterSimulatorImpl::BuildIslands()
+{
+	m_islands.clear();
+	for (const ThreadIslandRuns& threadRuns : m_threadIslandRuns)
+	{
+		for (const IslandRun& run : threadRuns.runs)
+		{
+			// m_islandIndexOfRoot isn't cleared between steps, so an index is only valid if that island has this root
+			uint32_t& islandIndex = m_islandIndexOfRoot[run.island];
+			if (islandIndex >= m_islands.size() || m_islands[islandIndex].root != run.island)
+			{
+				islandIndex = eg::UnsignedNarrow<uint32_t>(m_islands.size());
+				m_islands.push_back(Island{ .root = run.island, .numParticles = 0 });
+			}
+			m_islands[islandIndex].numParticles += run.hi - run.lo;
+		}
+	}
+	m_numIslands = eg::UnsignedNarrow<uint32_t>(m_islands.size());
+
+	// The largest islands are placed first, so that they are started as early as possible. Islands that are smaller
+	//  than a chunk are grouped together with the following islands, so that splashes of single particles don't need
+	//  to be scheduled one by one. Groups are simulated the same way as islands.
+	std::sort(
+		m_islands.begin(), m_islands.end(),
+		[](const Island& a, const Island& b) { return a.numParticles > b.numParticles; });
+	m_numIslandGroups = 0;
+	uint32_t groupParticles = WORK_CHUNK_SIZE;
+	for (const Island& island : m_islands)
+	{
+		if (groupParticles >= WORK_CHUNK_SIZE)
+		{
+			m_numIslandGroups++;
+			groupParticles = 0;
+		}
+		m_islandIndexOfRoot[island.root] = m_numIslandGroups - 1;
+		groupParticles += island.numParticles;
+	}
+
+	if (m_islandStatesCapacity < m_numIslandGroups)
+	{
+		m_islandStatesCapacity = std::max(m_numIslandGroups, m_islandStatesCapacity * 2);
+		m_islandStates = std::make_unique<IslandState[]>(m_islandStatesCapacity);
+	}
+	for (uint32_t i = 0; i < m_numIslandGroups; i++)
+	{
+		IslandState& state = m_islandStates[i];
+		state.numChunks = 0;
+		state.stage = 0;
+		for (uint32_t s = 0; s < NUM_ISLAND_STAGES; s++)
+		{
+			state.nextChunk[s] = 0;
+			state.doneChunks[s] = 0;
+		}
+	}
+
+	// Counts the chunks in each group, and then places the chunks of each group after each other
+	for (ThreadIslandRuns& threadRuns : m_threadIslandRuns)
+	{
+		for (IslandRun& run : threadRuns.runs)
+		{
+			run.island = m_islandIndexOfRoot[run.island];
+			m_islandStates[run.island].numChunks += (run.hi - run.lo + WORK_CHUNK_SIZE - 1) / WORK_CHUNK_SIZE;
+		}
+	}
+	uint32_t numChunks = 0;
+	for (uint32_t i = 0; i < m_numIslandGroups; i++)
+	{
+		m_islandStates[i].firstChunk = numChunks;
+		numChunks += m_islandStates[i].numChunks;
+		m_islandStates[i].numChunks = 0;
+	}
+	m_islandChunks.resize(numChunks);
+	for (const ThreadIslandRuns& threadRuns : m_threadIslandRuns)
+	{
+		for (const IslandRun& run : threadRuns.runs)
+		{
+			IslandState& state = m_islandStates[run.island];
+			for (uint32_t lo = run.lo; lo < run.hi; lo += WORK_CHUNK_SIZE)
+			{
+				m_islandChunks[state.firstChunk + state.numChunks] = { lo, std::min(lo + WORK_CHUNK_SIZE, run.hi) };
+				state.numChunks++;
+			}
+		}
+	}
+
+	m_islandsRemaining = m_numIslandGroups;
+}
+
+// Runs stages 2-4 for all island groups. Each thread takes chunks from the current stage of a group, and moves on
+//  to other groups when there are no chunks left to take from that stage.
+void WaterSimulatorImpl::SimulateIslands(uint32_t threadIndex, float dt, std::span<const WaterBlocker> waterBlockers)
+{
+	const uint32_t numGroups = m_numIslandGroups;
+
+	// The time spent on chunks of each stage is only written by this thread until the stage ends
+	std::array<uint64_t, NUM_WATER_SIM_STAGES>& stageBusyTimes = m_threadStepTimes[threadIndex].times.stageBusyTimes;
+
+	// Threads start at different groups, so that small islands don't wait for threads that are busy with large ones.
+	//  After running a chunk, a thread looks for more work in the same group first.
+	uint32_t currentGroup = static_cast<uint32_t>(static_cast<uint64_t>(numGroups) * threadIndex / m_numThreads);
+
+	while (true)
+	{
+		// Read before looking for work, so that a stage advancing after the search wakes this thread up again
+		const uint32_t stageAdvances = m_islandStageAdvances.load(std::memory_order_acquire);
+		if (m_islandsRemaining.load(std::memory_order_acquire) == 0)
+			break;
+
+		bool ranChunk = false;
+		for (uint32_t i = 0; i < numGroups && !ranChunk; i++)
+		{
+			const uint32_t groupIndex = (currentGroup + i) % numGroups;
+			IslandState& island = m_islandStates[groupIndex];
+			const uint32_t stage = island.stage.load(std::memory_order_acquire);
+			if (stage == NUM_ISLAND_STAGES ||
+			    island.nextChunk[stage].load(std::memory_order_relaxed) >= island.numChunks)
+			{
+				continue;
+			}
+			const uint32_t chunk = island.nextChunk[stage].fetch_add(1, std::memory_order_relaxed);
+			if (chunk >= island.numChunks)
+				continue;
+
+			auto [lo, hi] = m_islandChunks[island.firstChunk + chunk];
+			const SimulateStageArgs args = {
+				.threadIndex = threadIndex, .rangeIndex = chunk, .loIdx = lo, .hiIdx = hi, .dt = dt
+			};
+			const auto chunkStartTime = std::chrono::steady_clock::now();
+			if (stage == 0)
+				Stage2_ComputeNumberDensity(args);
+			else if (stage == 1)
+				Stage3_Acceleration(args);
+			else
+				Stage4_DiffusionAndCollision(args, waterBlockers);
+			stageBusyTimes[static_cast<size_t>(ISLAND_STAGES[stage])] +=
+				std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - chunkStartTime)
+					.count();
+			ranChunk = true;
+			currentGroup = groupIndex;
+
+			// The thread that finishes the last chunk of a stage moves the island on to the next stage
+			if (island.doneChunks[stage].fetch_add(1, std::memory_order_acq_rel) + 1 == island.numChunks)
+			{
+				island.stage.store(stage + 1, std::memory_order_release);
+				if (stage + 1 == NUM_ISLAND_STAGES)
+					m_islandsRemaining.fetch_sub(1, std::memory_order_release);
+				m_islandStageAdvances.fetch_add(1, std::memory_order_release);
+				m_islandStageAdvances.notify_all();
+			}
+		}
+
+		// Threads without work sleep until a stage advances, which either makes new chunks available or finishes
+		//  the last island
+		if (!ranChunk)
+			m_islandStageAdvances.wait(stageAdvances, std::memory_order_acquire);
+	}
+}
+
+// Stages 2-4 overlap when islands are used, so the time of each of these stages is the time that threads spent on
+//  chunks of that stage, averaged over the threads. Only the rest of the time in SimulateIslands, which is spent
+//  looking for chunks and waiting for other islands to advance, is left for the Simulate Islands stage. Called by
+//  thread 0 after the Simulate Islands stage has ended.
+void WaterSimulatorImpl::SplitIslandStageTimes()
+{
+	uint64_t& simulateIslandsTime = m_lastStepStageTimes[static_cast<size_t>(WaterSimStage::SimulateIslands)];
+	for (WaterSimStage stage : ISLAND_STAGES)
+	{
+		uint64_t totalBusyTime = 0;
+		for (ThreadStepTimes& threadTimes : m_threadStepTimes)
+		{
+			const uint64_t busyTime = threadTimes.times.stageBusyTimes[static_cast<size_t>(stage)];
+			uint64_t& threadIslandsTime =
+				threadTimes.times.stageBusyTimes[static_cast<size_t>(WaterSimStage::SimulateIslands)];
+			threadIslandsTime -= std::min(threadIslandsTime, busyTime);
+			totalBusyTime += busyTime;
+		}
+
+		const uint64_t stageTime = totalBusyTime / m_numThreads;
+		m_lastStepStageTimes[static_cast<size_t>(stage)] = stageTime;
+		simulateIslandsTime -= std::min(simulateIslandsTime, stageTime);
+	}
+}
+
+template <typename Fn>
+void WaterSimulatorImpl::ForEachSimulatedRange(SimulateStageArgs args, Fn fn)
+{
+	if (!m_skipParticlesThisStep)
+	{
+		fn(args);
+		return;
+	}
+
+	uint32_t i = args.loIdx;
+	while (i < args.hiIdx)
+	{
+		while (i < args.hiIdx && m_particlesSkipped[i])
+			i++;
+		const uint32_t runStart = i;
+		while (i < args.hiIdx && !m_particlesSkipped[i])
+			i++;
+		if (runStart != i)
+		{
+			SimulateStageArgs runArgs = args;
+			runArgs.loIdx = runStart;
+			runArgs.hiIdx = i;
+			fn(runArgs);
+		}
+	}
+}
+
+// Runs one stage of the simulation on the calling thread, for all work ranges that this thread should process
+template <typename StageFn>
+void WaterSimulatorImpl::RunStageForAllRanges(uint32_t stageIndex, uint32_t threadIndex, float dt, StageFn stageFn)
+{
+	if (!m_useWorkStealing)
+	{
+		auto [lo, hi] = GetThreadWorkingRange(threadIndex, m_numParticles);
+		stageFn(SimulateStageArgs{
+			.threadIndex = threadIndex, .rangeIndex = threadIndex, .loIdx = lo, .hiIdx = hi, .dt = dt });
+		return;
+	}
+
+	// Takes chunks from this thread's own queue first, and then from the queues of the other threads
+	ChunkQueue* stageQueues = &m_chunkQueues[stageIndex * m_numThreads];
+	for (uint32_t i = 0; i < m_numThreads; i++)
+	{
+		ChunkQueue& queue = stageQueues[(threadIndex + i) % m_numThreads];
+		while (true)
+		{
+			const uint32_t chunk = queue.nextChunk.fetch_add(1, std::memory_order_relaxed);
+			if (chunk >= queue.endChunk)
+				break;
+
+			const uint32_t lo = chunk * WORK_CHUNK_SIZE;
+			const uint32_t hi = std::min(lo + WORK_CHUNK_SIZE, m_numParticles);
+			stageFn(SimulateStageArgs{
+				.threadIndex = threadIndex, .rangeIndex = chunk, .loIdx = lo, .hiIdx = hi, .dt = dt });
+		}
+	}
+}
+
+void WaterSimulatorImpl::WaitForAllThreads(uint32_t threadIndex, WaterSimStage stage)
+{
+	ThreadStepTimes& ownTimes = m_threadStepTimes[threadIndex];
+	const uint32_t slot = ownTimes.numBarriers++ % 2;
+	ownTimes.barrierArrivalTimes[slot] = std::chrono::steady_clock::now();
+
+	m_barrier.arrive_and_wait();
+	if (threadIndex != 0)
+		return;
+
+	// All threads continue once the last thread has arrived, so the time from a thread's arrival until then is
+	//  spent waiting
+	std::chrono::steady_clock::time_point releaseTime = ownTimes.barrierArrivalTimes[slot];
+	for (const ThreadStepTimes& threadTimes : m_threadStepTimes)
+		releaseTime = std::max(releaseTime, threadTimes.barrierArrivalTimes[slot]);
+
+	for (ThreadStepTimes& threadTimes : m_threadStepTimes)
+	{
+		const std::chrono::steady_clock::time_point arrivalTime = threadTimes.barrierArrivalTimes[slot];
+		threadTimes.times.stageBusyTimes[static_cast<size_t>(stage)] +=
+			std::chrono::duration_cast<std::chrono::nanoseconds>(arrivalTime - threadTimes.workStartTime).count();
+		threadTimes.times.barrierWaitTime +=
+			std::chrono::duration_cast<std::chrono::nanoseconds>(releaseTime - arrivalTime).count();
+		threadTimes.workStartTime = releaseTime;
+	}
+}
+
+void WaterSimulatorImpl::GetLastStepStats(WaterSimStepStats& statsOut) const
+{
+	statsOut.stageTimes = m_lastStepStageTimes;
+	statsOut.threadTimes.resize(m_numThreads);
+	for (uint32_t t = 0; t < m_numThreads; t++)
+		statsOut.threadTimes[t] = m_threadStepTimes[t].times;
+	statsOut.neighboursPerParticle = m_closeParticlesPerParticle;
+	statsOut.particlesOutsideGrid = m_numParticlesOutsideGrid.load(std::memory_order_relaxed);
+	statsOut.numSubsteps = 1;
+}
+
+// Partitions particles into grid cells so that detecting close particles will be faster. This is done with a
+//  parallel counting sort, where each thread handles one range of particles and one range of cells.
+void WaterSimulatorImpl::BinParticles(uint32_t threadIndex, uint32_t particlesLo, uint32_t particlesHi)
+{
+	const uint32_t numBuckets = eg::UnsignedNarrow<uint32_t>(m_cellCounts.size());
+	const uint32_t outsideGridBucket = numBuckets - 1;
+
+	// Close particle lists must be rebuilt once any particle has moved more than half the skin since they were
+	//  built, since two particles moving towards each other could then have entered each other's influence radius.
+	const float maxMoveDistance = m_verletSkin / 2;
+	bool anyParticleMovedTooFar = false;
+
+	uint32_t numFrozen = 0;
+	uint32_t numOutsideGrid = 0;
+
+	// Counts the number of particles in each cell
+	for (uint32_t i = particlesLo; i < particlesHi; i++)
+	{
+		if (m_useIslands)
+			m_islandParents[i] = i;
+
+		// Computes the cell to place this particle into based on the floor of the particle's position.
+		particleCells[i] = glm::ivec3(glm::floor(m_particlesPos1[i] / partGridCellSize)) - partGridMin;
+
+		if (m_verletSkin > 0 && glm::distance2(m_particlesPos1[i], m_closeParticlesBuildPos[i]) >
+		                            maxMoveDistance * maxMoveDistance)
+		{
+			anyParticleMovedTooFar = true;
+		}
+
+		int cell = CellIdx(particleCells[i]);
+		particleCellIndices[i] = cell == -1 ? outsideGridBucket : static_cast<uint32_t>(cell);
+		numOutsideGrid += cell == -1;
+		std::atomic_ref<uint32_t>(m_cellCounts[particleCellIndices[i]]).fetch_add(1, std::memory_order_relaxed);
+
+		// LOD is decided per partition cell, so that particles in the same cell are always frozen together. A cell is
+		//  only frozen if the centers of all its neighbouring cells are also further than the LOD distance, so the
+		//  cells just outside the LOD distance form a band of simulated cells between near and frozen water. The
+		//  closest neighbouring center is found per axis by rounding the offset to the camera to -1, 0 or 1 cells.
+		if (m_lodFreezeThisStep)
+		{
+			const glm::vec3 cellCenter = (glm::vec3(particleCells[i] + partGridMin) + 0.5f) * partGridCellSize;
+			const glm::vec3 closestOffset =
+				glm::clamp(glm::round((m_lodCameraPos - cellCenter) / partGridCellSize), -1.0f, 1.0f);
+			const glm::vec3 closestCenter = cellCenter + closestOffset * partGridCellSize;
+			m_particlesSkipped[i] = glm::distance2(closestCenter, m_lodCameraPos) > m_lodDistance2;
+			numFrozen += m_particlesSkipped[i];
+		}
+		else
+		{
+			m_particlesSkipped[i] = 0;
+		}
+
+		// Particles that were skipped in the last step were copied to the second buffer, so their distance is zero.
+		//  Particles moved by pumps have moved far since the last step, which wakes their cell.
+		if (m_sleepSteps != 0)
+		{
+			float moveDist = 0;
+			if (m_particlesWake[i])
+				moveDist = MAX_SUMMED_MOVE_DIST;
+			else if (m_lastStepPositionsValid)
+				moveDist = std::min(glm::distance(m_particlesPos1[i], m_particlesPos2[i]), MAX_SUMMED_MOVE_DIST);
+			m_particlesWake[i] = 0;
+			std::atomic_ref<uint64_t>(m_cellMoveDistSums[particleCellIndices[i]])
+				.fetch_add(static_cast<uint64_t>(moveDist * MOVE_DIST_SUM_SCALE), std::memory_order_relaxed);
+		}
+	}
+	if (anyParticleMovedTooFar)
+		m_closeParticlesOutdated = true;
+	if (numFrozen != 0)
+		m_numLodFrozenParticles.fetch_add(numFrozen, std::memory_order_relaxed);
+	if (numOutsideGrid != 0)
+		m_numParticlesOutsideGrid.fetch_add(numOutsideGrid, std::memory_order_relaxed);
+	WaitForAllThreads(threadIndex, WaterSimStage::BinParticles);
+
+	// Computes where each cell starts in the sorted particle list. Each thread first counts the particles in its range
+	//  of cells, and then offsets that range by the number of particles in the ranges before it.
+	auto [cellsLo, cellsHi] = GetThreadWorkingRange(threadIndex, numBuckets);
+	m_cellRangeParticleCounts[threadIndex] =
+		std::accumulate(m_cellCounts.begin() + cellsLo, m_cellCounts.begin() + cellsHi, 0u);
+	WaitForAllThreads(threadIndex, WaterSimStage::BinParticles);
+
+	uint32_t cellStart = std::accumulate(
+		m_cellRangeParticleCounts.begin(), m_cellRangeParticleCounts.begin() + threadIndex, 0u);
+	const uint64_t sleepMaxMoveDistSum = static_cast<uint64_t>(m_sleepMaxMoveDist * MOVE_DIST_SUM_SCALE);
+	for (uint32_t cell = cellsLo; cell < cellsHi; cell++)
+	{
+		cellParticlesStart[cell] = cellStart;
+		cellStart += m_cellCounts[cell];
+
+		// Cells with a higher average speed than the sleep speed are no longer at rest. The distances are zero when
+		//  the positions from the last step aren't valid, in which case the cell's rest steps are kept.
+		if (m_sleepSteps != 0)
+		{
+			if (m_cellMoveDistSums[cell] > sleepMaxMoveDistSum * m_cellCounts[cell])
+				m_cellRestSteps[cell] = 0;
+			else if (m_lastStepPositionsValid && m_cellRestSteps[cell] != UINT8_MAX)
+				m_cellRestSteps[cell]++;
+			m_cellMoveDistSums[cell] = 0;
+		}
+	}
+	WaitForAllThreads(threadIndex, WaterSimStage::BinParticles);
+
+	// Particles sleep when their cell and all neighbouring cells have been at rest for long enough. Particles
+	//  outside of the partition grid never sleep.
+	uint32_t numSleeping = 0;
+	auto ShouldSleep = [&](uint32_t i)
+	{
+		if (particleCellIndices[i] == outsideGridBucket || m_cellRestSteps[particleCellIndices[i]] < m_sleepSteps)
+			return false;
+		for (int dz = -1; dz <= 1; dz++)
+		{
+			for (int dy = -1; dy <= 1; dy++)
+			{
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					const int cell = CellIdx(particleCells[i] + glm::ivec3(dx, dy, dz));
+					if (cell != -1 && m_cellRestSteps[cell] < m_sleepSteps)
+						return false;
+				}
+			}
+		}
+		return true;
+	};
+
+	// Inserts particles into the sorted list. This decrements the counts, leaving them at zero for the next step.
+	for (uint32_t i = particlesLo; i < particlesHi; i++)
+	{
+		if (m_sleepSteps != 0 && !m_particlesSkipped[i] && ShouldSleep(i))
+		{
+			m_particlesSkipped[i] = 1;
+			numSleeping++;
+		}
+
+		const uint32_t bucket = particleCellIndices[i];
+		const uint32_t cellOffset =
+			std::atomic_ref<uint32_t>(m_cellCounts[bucket]).fetch_sub(1, std::memory_order_relaxed) - 1;
+		const uint32_t sortedIdx = cellParticlesStart[bucket] + cellOffset;
+		if (m_wideParticleIndices)
+			static_cast<uint32_t*>(m_cellParticlesMemory.get())[sortedIdx] = i;
+		else
+			static_cast<uint16_t*>(m_cellParticlesMemory.get())[sortedIdx] = static_cast<uint16_t>(i);
+	}
+	if (numSleeping != 0)
+		m_numSleepingParticles.fetch_add(numSleeping, std::memory_order_relaxed);
+
+	// The order of particles within a cell depends on the order that threads inserted them in. In reproducible mode
+	//  the particles in each cell are sorted, since close particle lists (and the order that interactions are summed
+	//  in) follow this order.
+	if (m_reproducible)
+	{
+		WaitForAllThreads(threadIndex, WaterSimStage::BinParticles);
+		for (uint32_t cell = cellsLo; cell < cellsHi; cell++)
+		{
+			if (m_wideParticleIndices)
+			{
+				uint32_t* cellParticles = static_cast<uint32_t*>(m_cellParticlesMemory.get());
+				std::sort(cellParticles + cellParticlesStart[cell], cellParticles + cellParticlesStart[cell + 1]);
+			}
+			else
+			{
+				uint16_t* cellParticles = static_cast<uint16_t*>(m_cellParticlesMemory.get());
+				std::sort(cellParticles + cellParticlesStart[cell], cellParticles + cellParticlesStart[cell + 1]);
+			}
+		}
+	}
+}
+
+void WaterSimulatorImpl::FinishCloseParticlesList(CloseParticlesScratch& scratch, uint32_t particle, uint32_t listStart)
 {
-	auto [plo, phi] = GetThreadWorkingRange(threadIndex);
-	SimulateStageArgs simulateStageArgs = { .threadIndex = threadIndex, .loIdx = plo, .hiIdx = phi, .dt = dt };
+	const uint32_t listEnd = eg::UnsignedNarrow<uint32_t>(scratch.indices.size());
+	m_numCloseParticles[particle] = listEnd - listStart;
+	m_closeParticlesStart[particle] = listStart;
 
-	Stage1_DetectClose(simulateStageArgs);
-	m_barrier.arrive_and_wait();
-	Stage2_ComputeNumberDensity(simulateStageArgs);
-	m_barrier.arrive_and_wait();
-	Stage3_Acceleration(simulateStageArgs);
-	m_barrier.arrive_and_wait();
-	Stage4_DiffusionAndCollision(simulateStageArgs, waterBlockers);
-	m_barrier.arrive_and_wait();
+	// Pads the list with entries that have no effect (their distance is INFLUENCE_RADIUS)
+	if (listEnd != listStart)
+	{
+		const uint32_t paddedEnd = eg::RoundToNextMultiple(listEnd, m_closeParticlesPadding);
+		scratch.indices.resize(paddedEnd, scratch.indices.back());
+		scratch.distances.resize(paddedEnd, INFLUENCE_RADIUS);
+	}
+}
+
+void WaterSimulatorImpl::AllocateCloseParticlesStorage()
+{
+	uint32_t totalCloseParticles = 0;
+	for (CloseParticlesScratch& scratch : m_closeParticlesScratch)
+	{
+		scratch.baseOffset = totalCloseParticles;
+		totalCloseParticles += eg::UnsignedNarrow<uint32_t>(scratch.indices.size());
+	}
+
+	// Half pair lists store each pair once, but both particles of the pair are neighbours of each other
+	const uint32_t numDetectCloseParticles = m_numDetectCloseParticles.load(std::memory_order_relaxed);
+	const float numNeighbours = static_cast<float>(totalCloseParticles) * (m_halfPairLists ? 2.0f : 1.0f);
+	m_closeParticlesPerParticle =
+		numDetectCloseParticles == 0 ? 0 : numNeighbours / static_cast<float>(numDetectCloseParticles);
+
+	if (totalCloseParticles > m_closeParticlesCapacity)
+	{
+		// Reserves some extra space so that the storage doesn't have to be reallocated every time it grows slightly
+		m_closeParticlesCapacity =
+			eg::RoundToNextMultiple(totalCloseParticles + totalCloseParticles / 4, m_closeParticlesPadding);
+
+		const size_t particleIndexSize = m_wideParticleIndices ? sizeof(uint32_t) : sizeof(uint16_t);
+		const size_t indicesBytes =
+			eg::RoundToNextMultiple(m_closeParticlesCapacity * particleIndexSize, m_memoryAlignment);
+		const size_t distancesBytes = m_closeParticlesCapacity * sizeof(float);
+
+		m_closeParticlesMemory.reset(aligned_alloc(m_memoryAlignment, indicesBytes + distancesBytes));
+		m_closeParticlesIdx = m_closeParticlesMemory.get();
+		m_closeParticlesDist =
+			reinterpret_cast<float*>(static_cast<char*>(m_closeParticlesMemory.get()) + indicesBytes);
+	}
+}
+
+// Moves the close particles found by this thread in stage 1 into the shared close particle arrays
+void WaterSimulatorImpl::CompactCloseParticles(SimulateStageArgs args)
+{
+	if (m_wideParticleIndices)
+		CompactCloseParticlesImpl<uint32_t>(args);
+	else
+		CompactCloseParticlesImpl<uint16_t>(args);
+}
+
+template <typename IdxT>
+void WaterSimulatorImpl::CompactCloseParticlesImpl(SimulateStageArgs args)
+{
+	const CloseParticlesScratch& scratch = m_closeParticlesScratch[args.rangeIndex];
+
+	std::transform(
+		scratch.indices.begin(), scratch.indices.end(), static_cast<IdxT*>(m_closeParticlesIdx) + scratch.baseOffset,
+		[](uint32_t idx) { return static_cast<IdxT>(idx); });
+	std::copy(scratch.distances.begin(), scratch.distances.end(), m_closeParticlesDist + scratch.baseOffset);
+
+	for (uint32_t p = args.loIdx; p < args.hiIdx; p++)
+	{
+		m_closeParticlesStart[p] += scratch.baseOffset;
+	}
+}
+
+// Updates the distances in the close particle lists when the lists are reused from an earlier step
+void WaterSimulatorImpl::RefreshCloseParticleDistances(SimulateStageArgs args)
+{
+	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
+	{
+		float* closeParticlesDist = GetCloseParticlesDistPtr(a);
+		for (uint32_t bI = 0; bI < m_numCloseParticles[a]; bI++)
+		{
+			const uint32_t b = GetCloseParticleIdx(a, bI);
+			const float dist = glm::distance(m_particlesPos1[a], m_particlesPos1[b]);
+			closeParticlesDist[bI] = std::min(dist, INFLUENCE_RADIUS);
+		}
+	}
 }
 
-// Detects close particles by scanning the surrounding grid cells for each particle.
 void WaterSimulatorImpl::Stage1_DetectClose(SimulateStageArgs args)
 {
+	if (m_wideParticleIndices)
+		Stage1_DetectCloseImpl<uint32_t>(args);
+	else
+		Stage1_DetectCloseImpl<uint16_t>(args);
+}
+
+void WaterSimulatorImpl::Stage3_Acceleration(SimulateStageArgs args)
+{
+	if (m_wideParticleIndices)
+		Stage3_AccelerationImpl<uint32_t>(args);
+	else
+		Stage3_AccelerationImpl<uint16_t>(args);
+}
+
+void WaterSimulatorImpl::Stage4_DiffusionAndCollision(
+	SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers)
+{
+	if (m_wideParticleIndices)
+		Stage4_DiffusionAndCollisionImpl<uint32_t>(args, waterBlockers);
+	else
+		Stage4_DiffusionAndCollisionImpl<uint16_t>(args, waterBlockers);
+}
+
+// Detects close particles by scanning the surrounding grid cells for each particle.
+template <typename IdxT>
+void WaterSimulatorImpl::Stage1_DetectCloseImpl(SimulateStageArgs args)
+{
+	CloseParticlesScratch& scratch = m_closeParticlesScratch[args.rangeIndex];
+	const float searchRadius2 = m_closeParticlesSearchRadius * m_closeParticlesSearchRadius;
+
 	for (uint32_t p = args.loIdx; p < args.hiIdx; p++)
 	{
 		glm::ivec3 centerCell = particleCells[p];
-		uint32_t numClose = 0;
+		const uint32_t listStart = eg::UnsignedNarrow<uint32_t>(scratch.indices.size());
 
 		// Loop through neighboring cells to the one the current particle belongs to
 		for (int dx = -1; dx <= 1; dx++)
@@ -456,10 +2159,12 @@ void WaterSimulatorImpl::Stage1_DetectClose(SimulateStageArgs args)
 					int cell = CellIdx(centerCell + glm::ivec3(dx, dy, dz));
 					if (cell == -1)
 						continue;
-					for (int i = 0; i < cellNumParticles[cell]; i++)
+					const IdxT* cellParticles = GetCellParticlesPtr<IdxT>(cell);
+					const uint32_t numCellParticles = GetCellNumParticles(cell);
+					for (uint32_t i = 0; i < numCellParticles; i++)
 					{
-						uint16_t b = cellParticles[cell][i];
-						if (b != p)
+						const IdxT b = cellParticles[i];
+						if (b > p || (b != p && !m_halfPairLists))
 						{
 							// Check particle b for proximity
 							float sepX = m_particlesPos1.x[p] - m_particlesPos1.x[b];
@@ -467,23 +2172,18 @@ void WaterSimulatorImpl::Stage1_DetectClose(SimulateStageArgs args)
 							float sepZ = m_particlesPos1.z[p] - m_particlesPos1.z[b];
 
 							float dist2 = sepX * sepX + sepY * sepY + sepZ * sepZ;
-							if (dist2 < INFLUENCE_RADIUS * INFLUENCE_RADIUS)
+							if (dist2 < searchRadius2)
 							{
-								GetCloseParticlesIdxPtr(p)[numClose] = b;
-								GetCloseParticlesDistPtr(p)[numClose] = std::sqrt(dist2);
-								numClose++;
-								if (numClose == MAX_CLOSE)
-									break;
+								scratch.indices.push_back(b);
+								scratch.distances.push_back(std::min(std::sqrt(dist2), INFLUENCE_RADIUS));
 							}
 						}
 					}
-					if (numClose == MAX_CLOSE)
-						break;
 				}
 			}
 		}
 
-		m_numCloseParticles[p] = numClose;
+		FinishCloseParticlesList(scratch, p, listStart);
 	}
 }
 
@@ -494,7 +2194,7 @@ void WaterSimulatorImpl::Stage2_ComputeNumberDensity(SimulateStageArgs args)
 		float densityX = 1.0f;
 		float densityY = 1.0f;
 
-		for (uint16_t bI = 0; bI < m_numCloseParticles[a]; bI++)
+		for (uint32_t bI = 0; bI < m_numCloseParticles[a]; bI++)
 		{
 			const float dist = GetCloseParticlesDistPtr(a)[bI];
 			const float q = std::max(1.0f - dist / INFLUENCE_RADIUS, 0.0f);
@@ -510,10 +2210,17 @@ void WaterSimulatorImpl::Stage2_ComputeNumberDensity(SimulateStageArgs args)
 	}
 }
 
-void WaterSimulatorImpl::Stage3_Acceleration(SimulateStageArgs args)
+template <typename IdxT>
+void WaterSimulatorImpl::Stage3_AccelerationImpl(SimulateStageArgs args)
 {
+	pcg32_fast particleRng;
+	pcg32_fast& rng = m_reproducible ? particleRng : m_threadRngs[args.threadIndex];
+
 	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
 	{
+		if (m_reproducible)
+			particleRng = pcg32_fast(ParticleRngSeed(a));
+
 		// Initializes acceleration to the gravitational acceleration
 		const float densA = m_particleDensityX[a];
 		const float nearDensA = m_particleDensityY[a];
@@ -523,11 +2230,15 @@ void WaterSimulatorImpl::Stage3_Acceleration(SimulateStageArgs args)
 		const float aDensityXSub2TargetDensity = densA - 2 * TARGET_NUMBER_DENSITY;
 
 		// Applies acceleration due to pressure
-		for (uint16_t bI = 0; bI < m_numCloseParticles[a]; bI++)
+		for (uint32_t bI = 0; bI < m_numCloseParticles[a]; bI++)
 		{
-			uint16_t b = GetCloseParticlesIdxPtr(a)[bI];
+			const IdxT b = GetCloseParticlesIdxPtr<IdxT>(a)[bI];
 			float dist = GetCloseParticlesDistPtr(a)[bI];
 
+			// Particles in the Verlet skin are outside of the influence radius and have no effect
+			if (dist >= INFLUENCE_RADIUS)
+				continue;
+
 			float sepX = m_particlesPos1.x[a] - m_particlesPos1.x[b];
 			float sepY = m_particlesPos1.y[a] - m_particlesPos1.y[b];
 			float sepZ = m_particlesPos1.z[a] - m_particlesPos1.z[b];
@@ -537,9 +2248,9 @@ void WaterSimulatorImpl::Stage3_Acceleration(SimulateStageArgs args)
 			    std::abs(sepZ) < CORE_RADIUS)
 			{
 				std::uniform_real_distribution<float> offsetDist(-CORE_RADIUS / 2, CORE_RADIUS);
-				sepX += offsetDist(m_threadRngs[args.threadIndex]);
-				sepY += offsetDist(m_threadRngs[args.threadIndex]);
-				sepZ += offsetDist(m_threadRngs[args.threadIndex]);
+				sepX += offsetDist(rng);
+				sepY += offsetDist(rng);
+				sepZ += offsetDist(rng);
 				dist = std::sqrt(sepX * sepX + sepY * sepY + sepZ * sepZ);
 			}
 
@@ -563,24 +2274,25 @@ void WaterSimulatorImpl::Stage3_Acceleration(SimulateStageArgs args)
 	}
 }
 
-void WaterSimulatorImpl::Stage4_DiffusionAndCollision(
+template <typename IdxT>
+void WaterSimulatorImpl::Stage4_DiffusionAndCollisionImpl(
 	SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers)
 {
 	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
 	{
 		glm::vec3 vel = m_particlesVel1[a];
 
-		uint8_t particleGravityMask = (uint8_t)1 << m_particlesGravity[a];
-
 		// Velocity diffusion
-		for (uint16_t bI = 0; bI < m_numCloseParticles[a]; bI++)
+		for (uint32_t bI = 0; bI < m_numCloseParticles[a]; bI++)
 		{
-			const uint16_t b = GetCloseParticlesIdxPtr(a)[bI];
+			const float dist = GetCloseParticlesDistPtr(a)[bI];
+			if (dist >= INFLUENCE_RADIUS)
+				continue;
+
+			const IdxT b = GetCloseParticlesIdxPtr<IdxT>(a)[bI];
 			const glm::vec3 velA = m_particlesVel1[a];
 			const glm::vec3 velB = m_particlesVel1[b];
 
-			const float dist = GetCloseParticlesDistPtr(a)[bI];
-
 			const float sepX = m_particlesPos1.x[a] - m_particlesPos1.x[b];
 			const float sepY = m_particlesPos1.y[a] - m_particlesPos1.y[b];
 			const float sepZ = m_particlesPos1.z[a] - m_particlesPos1.z[b];
@@ -600,165 +2312,431 @@ void WaterSimulatorImpl::Stage4_DiffusionAndCollision(
 			}
 		}
 
-		// Applies the velocity to the particle's position
-		constexpr float VEL_SCALE = 0.998f;
-		constexpr float MAX_MOVE = 0.2f;
-		vel *= VEL_SCALE;
-		glm::vec3 move = vel * args.dt;
-		float moveDistSquared = glm::length2(move);
-		if (moveDistSquared > MAX_MOVE * MAX_MOVE)
-		{
-			move *= MAX_MOVE / std::sqrt(moveDistSquared);
-		}
-		m_particlesPos2.x[a] = m_particlesPos1.x[a] + move.x;
-		m_particlesPos2.y[a] = m_particlesPos1.y[a] + move.y;
-		m_particlesPos2.z[a] = m_particlesPos1.z[a] + move.z;
-
-		glm::vec3 halfM = glm::vec3(0.5f);
+		MoveAndCollideParticle(a, vel, args.dt, args.threadIndex, waterBlockers);
+	}
+}
 
-		constexpr int COLLISION_DETECTION_ITERATIONS = 4;
+void WaterSimulatorImpl::MoveAndCollideParticle(
+	uint32_t a, glm::vec3 vel, float dt, uint32_t threadIndex, std::span<const WaterBlocker> waterBlockers)
+{
+	uint8_t particleGravityMask = (uint8_t)1 << m_particlesGravity[a];
+
+	// Applies the velocity to the particle's position
+	constexpr float VEL_SCALE = 0.998f;
+	constexpr float MAX_MOVE = 0.2f;
+	vel *= VEL_SCALE;
+	glm::vec3 move = vel * dt;
+	float moveDistSquared = glm::length2(move);
+	if (moveDistSquared > MAX_MOVE * MAX_MOVE)
+	{
+		move *= MAX_MOVE / std::sqrt(moveDistSquared);
+	}
+	m_particlesPos2.x[a] = m_particlesPos1.x[a] + move.x;
+	m_particlesPos2.y[a] = m_particlesPos1.y[a] + move.y;
+	m_particlesPos2.z[a] = m_particlesPos1.z[a] + move.z;
 
-		// Collision detection. This works by looping over all voxels close to the particle (within CHECK_RAD),
-		// then checking all faces that face from a solid voxel to an air voxel.
-		for (int tr = 0; tr < COLLISION_DETECTION_ITERATIONS; tr++)
-		{
-			glm::ivec3 centerVx = glm::ivec3(glm::floor(m_particlesPos2[a]));
+	glm::vec3 halfM = glm::vec3(0.5f);
 
-			float minDist = 0;
-			glm::vec3 displaceNormal = glm::vec3(0.0f);
+	constexpr int COLLISION_DETECTION_ITERATIONS = 4;
 
-			auto CheckFace = [&](glm::vec3 planePoint, glm::vec3 normal, glm::vec3 tangent, glm::vec3 bitangent,
-			                     float tangentLen, float biTangentLen, float minDistC)
-			{
-				float distC = glm::dot((m_particlesPos2[a] - planePoint), normal);
-				float distE = distC - m_particlesRadius[a] * 0.5f;
+	// Collision detection. This works by checking all faces that face from a solid voxel to an air voxel, for
+	// the voxels around the one that the particle is in.
+	for (int tr = 0; tr < COLLISION_DETECTION_ITERATIONS; tr++)
+	{
+		glm::ivec3 centerVx = glm::ivec3(glm::floor(m_particlesPos2[a]));
 
-				if (distC > minDistC && distE < minDist)
-				{
-					glm::vec3 iPos = m_particlesPos2[a] + distC * normal - planePoint;
-					float iDotT = glm::dot(iPos, tangent);
-					float iDotBT = glm::dot(iPos, bitangent);
-					float iDotN = glm::dot(iPos, normal);
+		float minDist = 0;
+		glm::vec3 displaceNormal = glm::vec3(0.0f);
 
-					// Checks that the intersection actually happened on the voxel's face
-					if (std::abs(iDotT) <= tangentLen && std::abs(iDotBT) <= biTangentLen && std::abs(iDotN) < 0.8f)
-					{
-						minDist = distE - 0.001f;
-						displaceNormal = normal;
-					}
-				}
-			};
+		auto CheckFace = [&](glm::vec3 planePoint, glm::vec3 normal, glm::vec3 tangent, glm::vec3 bitangent,
+		                     float tangentLen, float biTangentLen, float minDistC)
+		{
+			float distC = glm::dot((m_particlesPos2[a] - planePoint), normal);
+			float distE = distC - m_particlesRadius[a] * 0.5f;
 
-			for (const WaterBlocker& blocker : waterBlockers)
+			if (distC > minDistC && distE < minDist)
 			{
-				if (blocker.blockedGravities & particleGravityMask)
+				glm::vec3 iPos = m_particlesPos2[a] + distC * normal - planePoint;
+				float iDotT = glm::dot(iPos, tangent);
+				float iDotBT = glm::dot(iPos, bitangent);
+				float iDotN = glm::dot(iPos, normal);
+
+				// Checks that the intersection actually happened on the voxel's face
+				if (std::abs(iDotT) <= tangentLen && std::abs(iDotBT) <= biTangentLen && std::abs(iDotN) < 0.8f)
 				{
-					CheckFace(
-						blocker.center, blocker.normal, blocker.tangent, blocker.biTangent, blocker.tangentLen,
-						blocker.biTangentLen, 0);
+					minDist = distE - 0.001f;
+					displaceNormal = normal;
 				}
 			}
+		};
 
-			constexpr int CHECK_RAD = 1;
-			for (int dz = -CHECK_RAD; dz <= CHECK_RAD; dz++)
+		for (uint32_t blockerIndex : GetNearbyWaterBlockers(m_particlesPos2[a]))
+		{
+			const WaterBlocker& blocker = waterBlockers[blockerIndex];
+			if (blocker.blockedGravities & particleGravityMask)
 			{
-				for (int dy = -CHECK_RAD; dy <= CHECK_RAD; dy++)
-				{
-					for (int dx = -CHECK_RAD; dx <= CHECK_RAD; dx++)
-					{
-						glm::ivec3 voxelCoordSolid = centerVx + glm::ivec3(dx, dy, dz);
+				CheckFace(
+					blocker.center, blocker.normal, blocker.tangent, blocker.biTangent, blocker.tangentLen,
+					blocker.biTangentLen, 0);
+			}
+		}
+
+		// Checks the precomputed faces from solid to air voxels around the voxel that the particle is in
+		for (const CollisionFace& face : GetCollisionFaces(centerVx))
+		{
+			glm::ivec3 voxelCoordSolid =
+				centerVx + glm::ivec3(face.solidOffsetX, face.solidOffsetY, face.solidOffsetZ);
+			glm::vec3 normalF = voxelNormalsF[face.normalIndex];
 
-						// This voxel must be solid
-						if (IsVoxelAir(voxelCoordSolid))
-							continue;
+			// A point on the plane going through this face
+			glm::vec3 planePoint = glm::vec3(voxelCoordSolid) + halfM + normalF * halfM;
 
-						for (size_t n = 0; n < std::size(voxelNormalsI); n++)
-						{
-							glm::ivec3 normal = voxelNormalsI[n];
+			float tangentLen = face.extendedTangent ? 0.6f : 0.5f;
+			float bitangentLen = face.extendedBitangent ? 0.6f : 0.5f;
 
-							// This voxel cannot be solid
-							if (!IsVoxelAir(voxelCoordSolid + normal))
-								continue;
+			CheckFace(
+				planePoint, normalF, voxelTangentsF[face.normalIndex], voxelBitangentsF[face.normalIndex],
+				tangentLen, bitangentLen, -INFINITY);
+		}
 
-							glm::vec3 normalF = voxelNormalsF[n];
+		// Applies an impulse to the velocity
+		if (minDist < 0)
+		{
+			float vDotDisplace = glm::dot(vel, displaceNormal) * IMPACT_COEFFICIENT;
+			glm::vec3 impulse = displaceNormal * vDotDisplace;
+			vel -= impulse;
+		}
 
-							// A point on the plane going through this face
-							glm::vec3 planePoint = glm::vec3(voxelCoordSolid) + halfM + normalF * halfM;
+		// Applies collision correction
+		m_particlesPos2.x[a] -= displaceNormal.x * minDist;
+		m_particlesPos2.y[a] -= displaceNormal.y * minDist;
+		m_particlesPos2.z[a] -= displaceNormal.z * minDist;
+	}
 
-							glm::ivec3 tangent = voxelTangentsI[n];
-							glm::ivec3 bitangent = voxelBitangentsI[n];
-							float tangentLen =
-								!IsVoxelAir(voxelCoordSolid + tangent) && !IsVoxelAir(voxelCoordSolid - tangent) ? 0.6f
-																												 : 0.5f;
-							float bitangentLen =
-								!IsVoxelAir(voxelCoordSolid + bitangent) && !IsVoxelAir(voxelCoordSolid - bitangent)
-									? 0.6f
-									: 0.5f;
+	m_particlesVel2.x[a] = vel.x;
+	m_particlesVel2.y[a] = vel.y;
+	m_particlesVel2.z[a] = vel.z;
 
-							CheckFace(
-								planePoint, normalF, voxelTangentsF[n], voxelBitangentsF[n], tangentLen, bitangentLen,
-								-INFINITY);
-						}
-					}
-				}
-			}
+	ThreadStepMaxima& maxima = m_threadStepMaxima[threadIndex];
+	maxima.moveDist2 = std::max(maxima.moveDist2, glm::distance2(m_particlesPos1[a], m_particlesPos2[a]));
+	maxima.speed2 = std::max(maxima.speed2, glm::length2(vel));
+}
+
+glm::vec3 WaterSimulatorImpl::TakeAccumulatedPairValues(uint32_t particle)
+{
+	glm::vec3 sum(0.0f);
+	for (const Vec3SOA& accumulators : m_threadPairAccumulators)
+	{
+		sum += accumulators[particle];
+		accumulators.x[particle] = 0;
+		accumulators.y[particle] = 0;
+		accumulators.z[particle] = 0;
+	}
+	return sum;
+}
+
+// Half pair version of stage 2. The x and y accumulators hold the two number densities.
+template <typename IdxT>
+void WaterSimulatorImpl::AccumulateNumberDensityHalfPairs(SimulateStageArgs args)
+{
+	const Vec3SOA& accumulators = m_threadPairAccumulators[args.threadIndex];
+	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
+	{
+		float densityX = 0.0f;
+		float densityY = 0.0f;
+
+		for (uint32_t bI = 0; bI < m_numCloseParticles[a]; bI++)
+		{
+			const float dist = GetCloseParticlesDistPtr(a)[bI];
+			const float q = std::max(1.0f - dist / INFLUENCE_RADIUS, 0.0f);
+			const float q2 = q * q;
+			const float q3 = q2 * q;
+			const float q4 = q2 * q2;
+			densityX += q3;
+			densityY += q4;
+
+			const IdxT b = GetCloseParticlesIdxPtr<IdxT>(a)[bI];
+			accumulators.x[b] += q3;
+			accumulators.y[b] += q4;
+		}
+
+		accumulators.x[a] += densityX;
+		accumulators.y[a] += densityY;
+	}
+}
+
+void WaterSimulatorImpl::FinishNumberDensityHalfPairs(SimulateStageArgs args)
+{
+	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
+	{
+		const glm::vec3 density = TakeAccumulatedPairValues(a);
+		m_particleDensityX[a] = 1.0f + density.x;
+		m_particleDensityY[a] = 1.0f + density.y;
+	}
+}
+
+// Half pair version of stage 3. The pressure between two particles is symmetric, so b receives the opposite
+//  acceleration of a.
+template <typename IdxT>
+void WaterSimulatorImpl::AccumulateAccelerationHalfPairs(SimulateStageArgs args)
+{
+	const Vec3SOA& accumulators = m_threadPairAccumulators[args.threadIndex];
+	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
+	{
+		const float densA = m_particleDensityX[a];
+		const float nearDensA = m_particleDensityY[a];
+		const float aDensityXSub2TargetDensity = densA - 2 * TARGET_NUMBER_DENSITY;
+		glm::vec3 accel(0.0f);
 
-			// Applies an impulse to the velocity
-			if (minDist < 0)
+		for (uint32_t bI = 0; bI < m_numCloseParticles[a]; bI++)
+		{
+			const IdxT b = GetCloseParticlesIdxPtr<IdxT>(a)[bI];
+			float dist = GetCloseParticlesDistPtr(a)[bI];
+			if (dist >= INFLUENCE_RADIUS)
+				continue;
+
+			float sepX = m_particlesPos1.x[a] - m_particlesPos1.x[b];
+			float sepY = m_particlesPos1.y[a] - m_particlesPos1.y[b];
+			float sepZ = m_particlesPos1.z[a] - m_particlesPos1.z[b];
+
+			// Randomly separates particles that are very close so that the pressure gradient won't be zero.
+			if (dist < CORE_RADIUS || std::abs(sepX) < CORE_RADIUS || std::abs(sepY) < CORE_RADIUS ||
+			    std::abs(sepZ) < CORE_RADIUS)
 			{
-				float vDotDisplace = glm::dot(vel, displaceNormal) * IMPACT_COEFFICIENT;
-				glm::vec3 impulse = displaceNormal * vDotDisplace;
-				vel -= impulse;
+				std::uniform_real_distribution<float> offsetDist(-CORE_RADIUS / 2, CORE_RADIUS);
+				sepX += offsetDist(m_threadRngs[args.threadIndex]);
+				sepY += offsetDist(m_threadRngs[args.threadIndex]);
+				sepZ += offsetDist(m_threadRngs[args.threadIndex]);
+				dist = std::sqrt(sepX * sepX + sepY * sepY + sepZ * sepZ);
 			}
 
-			// Applies collision correction
-			m_particlesPos2.x[a] -= displaceNormal.x * minDist;
-			m_particlesPos2.y[a] -= displaceNormal.y * minDist;
-			m_particlesPos2.z[a] -= displaceNormal.z * minDist;
+			const float q = std::max(1.0f - dist / INFLUENCE_RADIUS, 0.0f);
+			const float q2 = q * q;
+			const float q3 = q2 * q;
+
+			const float densB = m_particleDensityX[b];
+			const float nearDensB = m_particleDensityY[b];
+			const float pressure = STIFFNESS * (aDensityXSub2TargetDensity + densB);
+			const float pressNear = STIFFNESS * NEAR_TO_FAR * (nearDensA + nearDensB);
+			const float accelScale = (pressure * q2 + pressNear * q3) / (dist + FLT_EPSILON);
+			const glm::vec3 pairAccel = glm::vec3(sepX, sepY, sepZ) * accelScale;
+			accel += pairAccel;
+
+			accumulators.x[b] -= pairAccel.x;
+			accumulators.y[b] -= pairAccel.y;
+			accumulators.z[b] -= pairAccel.z;
 		}
 
-		m_particlesVel2.x[a] = vel.x;
-		m_particlesVel2.y[a] = vel.y;
-		m_particlesVel2.z[a] = vel.z;
+		accumulators.x[a] += accel.x;
+		accumulators.y[a] += accel.y;
+		accumulators.z[a] += accel.z;
 	}
 }
 
-void WaterSimulatorImpl::Simulate(const SimulateArgs& args)
+void WaterSimulatorImpl::FinishAccelerationHalfPairs(SimulateStageArgs args)
 {
-	MoveAcrossPumps(args.waterPumps, args.dt);
+	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
+	{
+		const float densA = m_particleDensityX[a];
+		const float relativeDensity = (densA - AMBIENT_DENSITY) / densA;
+		const glm::vec3 accel = relativeDensity * gravities[m_particlesGravity[a]] + TakeAccumulatedPairValues(a);
 
-	std::memset(cellNumParticles.data(), 0, cellNumParticles.size() * sizeof(uint16_t));
+		const glm::vec3 velAdd = accel * args.dt;
+		m_particlesVel1.x[a] += velAdd.x;
+		m_particlesVel1.y[a] += velAdd.y;
+		m_particlesVel1.z[a] += velAdd.z;
+	}
+}
 
-	// Partitions particles into grid cells so that detecting close particles will be faster.
-	for (uint32_t i = 0; i < m_numParticles; i++)
+// Half pair version of the velocity diffusion in stage 4. The velocity change of b is the opposite of that of a.
+template <typename IdxT>
+void WaterSimulatorImpl::AccumulateDiffusionHalfPairs(SimulateStageArgs args)
+{
+	const Vec3SOA& accumulators = m_threadPairAccumulators[args.threadIndex];
+	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
 	{
-		// Computes the cell to place this particle into based on the floor of the particle's position.
-		particleCells[i] = glm::ivec3(glm::floor(m_particlesPos1[i] / INFLUENCE_RADIUS)) - partGridMin;
+		const glm::vec3 velA = m_particlesVel1[a];
+		glm::vec3 velChange(0.0f);
 
-		// Adds the particle to the cell
-		int cell = CellIdx(particleCells[i]);
-		if (cell != -1 && cellNumParticles[cell] < MAX_PER_PART_CELL)
+		for (uint32_t bI = 0; bI < m_numCloseParticles[a]; bI++)
 		{
-			cellParticles[cell][cellNumParticles[cell]++] = i;
+			const float dist = GetCloseParticlesDistPtr(a)[bI];
+			if (dist >= INFLUENCE_RADIUS)
+				continue;
+
+			const IdxT b = GetCloseParticlesIdxPtr<IdxT>(a)[bI];
+			const glm::vec3 velB = m_particlesVel1[b];
+
+			const float sepX = m_particlesPos1.x[a] - m_particlesPos1.x[b];
+			const float sepY = m_particlesPos1.y[a] - m_particlesPos1.y[b];
+			const float sepZ = m_particlesPos1.z[a] - m_particlesPos1.z[b];
+			const glm::vec3 sepDir = glm::vec3(sepX, sepY, sepZ) / dist;
+			const float velSep = glm::dot(velA - velB, sepDir);
+			if (velSep < 0.0f)
+			{
+				const float infl = std::max(1.0f - dist / INFLUENCE_RADIUS, 0.0f);
+				const float velSepA = glm::dot(velA, sepDir);
+				const float velSepB = glm::dot(velB, sepDir);
+				const float diffSepA = (velSepB - velSepA) * 0.5f;
+				const glm::vec3 changeA = (RADIAL_VISCOSITY_GAIN * diffSepA * infl) * sepDir;
+				velChange += changeA;
+
+				accumulators.x[b] -= changeA.x;
+				accumulators.y[b] -= changeA.y;
+				accumulators.z[b] -= changeA.z;
+			}
 		}
+
+		accumulators.x[a] += velChange.x;
+		accumulators.y[a] += velChange.y;
+		accumulators.z[a] += velChange.z;
 	}
+}
 
-	if (args.shouldChangeParticleGravity)
+void WaterSimulatorImpl::FinishDiffusionAndCollisionHalfPairs(
+	SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers)
+{
+	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
 	{
-		ChangeParticleGravity(
-			args.changeGravityParticlePos, args.changeGravityParticleHighlightOnly, args.newGravity, args.gameTime);
+		MoveAndCollideParticle(
+			a, m_particlesVel1[a] + TakeAccumulatedPairValues(a), args.dt, args.threadIndex, waterBlockers);
+	}
+}
+
+void WaterSimulatorImpl::Simulate(const SimulateArgs& args)
+{
+	auto startTime = std::chrono::steady_clock::now();
+	auto GetElapsedTime = [&]
+	{
+		auto endTime = std::chrono::steady_clock::now();
+		uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(endTime - startTime).count();
+		startTime = endTime;
+		return elapsed;
+	};
+
+	m_lastStepGameTime = args.gameTime;
+
+	// Every lodInterval base steps all particles are simulated, including the first step
+	if (!args.continuesBaseStep && m_stepIndex != 0)
+		m_baseStepIndex++;
+	const bool canSkipParticles = CanSkipParticles();
+	if (!canSkipParticles && !m_loggedCantSkipParticles && (args.lodDistance > 0 || args.sleepSteps != 0))
+	{
+		eg::Log(
+			eg::LogLevel::Warning, "water",
+			"Water LOD and sleeping are disabled, since they are not supported with half pair lists or a Verlet skin");
+		m_loggedCantSkipParticles = true;
 	}
+	m_lodFreezeThisStep =
+		canSkipParticles && args.lodDistance > 0 && args.lodInterval > 1 && m_baseStepIndex % args.lodInterval != 0;
+	m_lodDistance2 = args.lodDistance * args.lodDistance;
+	m_lodCameraPos = args.cameraPos;
+	m_numLodFrozenParticles = 0;
+	m_numParticlesOutsideGrid = 0;
+	m_numDetectCloseParticles = 0;
+	for (ThreadStepTimes& threadTimes : m_threadStepTimes)
+		threadTimes.times = {};
+	std::fill(m_threadStepMaxima.begin(), m_threadStepMaxima.end(), ThreadStepMaxima());
+
+	// Cells are not known to be at rest when sleeping is enabled, since their rest steps were not updated before
+	EG_ASSERT(args.sleepSteps <= UINT8_MAX);
+	const uint32_t sleepSteps = canSkipParticles ? args.sleepSteps : 0;
+	if (m_sleepSteps == 0 && sleepSteps != 0)
+		std::fill(m_cellRestSteps.begin(), m_cellRestSteps.end(), 0);
+	m_sleepSteps = sleepSteps;
+	m_sleepMaxMoveDist = args.sleepSpeed * args.dt;
+	m_lastStepPositionsValid = m_partitionGridBuilt && m_stepsSinceReorder != 0;
+	m_numSleepingParticles = 0;
+
+	m_skipParticlesThisStep = m_lodFreezeThisStep || m_sleepSteps != 0;
+
+	// Connected particles are found through the close particle lists, so skipped particles also need them when
+	//  gravity is changed in this step
+	m_detectCloseForAllParticles = args.shouldChangeParticleGravity;
+	m_stepIndex++;
+
+	// Stages outside of RunAllParallelizedSimulationStages only run on this thread, which is thread 0
+	std::array<uint64_t, NUM_WATER_SIM_STAGES>& busyTimes = m_threadStepTimes[0].times.stageBusyTimes;
+
+	MoveAcrossPumps(args.waterPumps, args.dt, args.baseDt);
+	m_lastStepStageTimes[static_cast<size_t>(WaterSimStage::MoveAcrossPumps)] = GetElapsedTime();
+	busyTimes[static_cast<size_t>(WaterSimStage::MoveAcrossPumps)] =
+		m_lastStepStageTimes[static_cast<size_t>(WaterSimStage::MoveAcrossPumps)];
+
+	BinWaterBlockers(args.waterBlockers);
+	WakeParticlesNearChangedBlockers(args.waterBlockers);
 
 	{
 		std::lock_guard<std::mutex> lock(m_workerThreadWakeLock);
 		m_dtForWorkerThread = args.dt;
 		m_waterBlockersForWorkerThread = args.waterBlockers;
+		m_stage1ThreadsRemaining = m_numThreads;
+		m_findIslandsThreadsRemaining = m_numThreads;
+
+		if (m_useWorkStealing)
+		{
+			for (uint32_t i = 0; i < NUM_WORK_STEALING_STAGES * m_numThreads; i++)
+				m_chunkQueues[i].nextChunk = m_chunkQueues[i].firstChunk;
+		}
 		EG_ASSERT(m_workerThreadRunIteration != UINT64_MAX);
 		m_workerThreadRunIteration++;
 	}
 	m_workerThreadWakeSignal.notify_all();
 
 	RunAllParallelizedSimulationStages(0, args.dt, args.waterBlockers);
+	GetElapsedTime();
+	m_partitionGridBuilt = true;
+
+	float maxMoveDist2 = 0;
+	float maxSpeed2 = 0;
+	for (const ThreadStepMaxima& maxima : m_threadStepMaxima)
+	{
+		maxMoveDist2 = std::max(maxMoveDist2, maxima.moveDist2);
+		maxSpeed2 = std::max(maxSpeed2, maxima.speed2);
+	}
+	m_lastStepMaxMoveDist = std::sqrt(maxMoveDist2);
+	m_lastStepMaxSpeed = std::sqrt(maxSpeed2);
+
+	// Gravity is changed after the simulation stages since the close particle lists refer to particles by storage
+	//  index, which only stays valid until the next time particles are reordered, and since particles skipped by
+	//  sleeping or LOD only have lists in steps that detect close particles for all particles. The new gravity is
+	//  therefore first simulated in the next step, one step later than if it was changed before the stages. The glow
+	//  is visible straight away, since it is written to the output frame of this step.
+	if (args.shouldChangeParticleGravity)
+	{
+		ChangeParticleGravity(
+			args.changeGravityParticlePos, args.changeGravityParticleHighlightOnly, args.newGravity, args.gameTime);
+	}
+	m_lastStepStageTimes[static_cast<size_t>(WaterSimStage::ChangeParticleGravity)] = GetElapsedTime();
+	busyTimes[static_cast<size_t>(WaterSimStage::ChangeParticleGravity)] =
+		m_lastStepStageTimes[static_cast<size_t>(WaterSimStage::ChangeParticleGravity)];
+
+	m_stepsSinceReorder++;
+	if (m_connectedParticlesAge != UINT32_MAX)
+		m_connectedParticlesAge++;
+}
+
+WaterSimulatorImpl::TimeStep WaterSimulatorImpl::ChooseTimeStep(
+	float baseDt, float maxSpeed, float cflNumber, uint32_t maxBaseSteps, uint32_t maxSubsteps)
+{
+	TimeStep timeStep = { .numBaseSteps = 1, .numSubsteps = 1, .dt = baseDt };
+	if (maxSpeed <= 0 || cflNumber <= 0)
+		return timeStep;
+
+	const float maxDt = cflNumber * INFLUENCE_RADIUS / maxSpeed;
+	if (maxDt < baseDt)
+	{
+		const float substeps = std::ceil(baseDt / maxDt);
+		timeStep.numSubsteps = std::min(static_cast<uint32_t>(std::min(substeps, 1E6f)), std::max(maxSubsteps, 1u));
+	}
+	else
+	{
+		const float baseSteps = std::floor(maxDt / baseDt);
+		timeStep.numBaseSteps = std::min(static_cast<uint32_t>(std::min(baseSteps, 1E6f)), std::max(maxBaseSteps, 1u));
+	}
+
+	timeStep.dt = baseDt * static_cast<float>(timeStep.numBaseSteps) / static_cast<float>(timeStep.numSubsteps);
+	return timeStep;
 }
 
 #endif
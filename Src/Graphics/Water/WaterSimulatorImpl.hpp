@@ -3,10 +3,14 @@
 #ifdef IOMOMI_ENABLE_WATER
 
 #include "../../World/Dir.hpp"
+#include "WaterCompactParticle.hpp"
 #include "WaterPumpDescription.hpp"
 #include "WaterQueryResults.hpp"
+#include "WaterRayGrid.hpp"
+#include "WaterSimStats.hpp"
 #include "WaterSimulationConstants.hpp"
 
+#include <atomic>
 #include <barrier>
 #include <span>
 #include <thread>
@@ -24,16 +28,50 @@ struct WaterBlocker
 	uint8_t blockedGravities;
 };
 
+// Instruction sets that the simulator has implementations for
+enum class WaterSimIsa
+{
+	Scalar,
+	Avx2,
+	Avx512,
+};
+
+constexpr size_t NUM_WATER_SIM_ISAS = 3;
+
+extern const std::array<const char*, NUM_WATER_SIM_ISAS> WATER_SIM_ISA_NAMES;
+
 class WaterSimulatorImpl
 {
+	// Compares the scalar and simd implementations of the stages for the water benchmark (see WaterBenchmark.cpp)
+	friend struct WaterSimdAgreementCheck;
+
 public:
 	struct ConstructorArgs
 	{
 		glm::ivec3 minBounds;
 		glm::ivec3 maxBounds;
-		uint8_t* isAirBuffer;
+		const uint8_t* isAirBuffer;
 		uint32_t extraParticles;
 		std::span<const glm::vec3> particlePositions;
+
+		// Initial velocities and gravities of the particles, used when restoring a saved state. Particles start at
+		//  rest with gravity towards -Y if these are empty.
+		std::span<const glm::vec3> particleVelocities;
+		std::span<const uint8_t> particleGravities;
+
+		// Also writes particles in the compact format to output frames
+		bool compactOutput;
+
+		// Whether to simulate disconnected bodies of water independently, or empty to use wsim_islands
+		std::optional<bool> useIslands;
+
+		// Uses a fixed seed and makes the results independent of how particles are split between threads, so that
+		//  the particle state after any number of steps is the same across runs and thread counts. Also enabled by
+		//  wsim_reproducible.
+		bool reproducible = false;
+
+		// The number of simulation threads, or 0 to use wsim_threads or the number of cores
+		uint32_t numThreads = 0;
 	};
 
 	struct SimulateArgs
@@ -41,8 +79,31 @@ public:
 		float dt;
 		float gameTime;
 
+		// Length of a step when it isn't split into substeps or merged. Rates that are given per second, like the
+		//  pump rates, are rounded to whole particles per base step, and substeps and merged steps get their share
+		//  of that by dt / baseDt.
+		float baseDt;
+
 		glm::vec3 cameraPos;
 
+		// Particles in partition cells further than lodDistance from the camera are only stepped once every
+		//  lodInterval steps, and are frozen in the steps in between, so they move lodInterval times slower. Cells
+		//  next to a cell within lodDistance are never frozen. Disabled if lodDistance is 0. Not supported with half
+		//  pair lists or a Verlet skin (see CanSkipParticles), in which case a warning is logged once.
+		float lodDistance;
+		uint32_t lodInterval;
+
+		// Set for every substep after the first when a base step is split into substeps, so that LOD intervals are
+		//  counted in base steps
+		bool continuesBaseStep;
+
+		// Partition cells where the average speed of the particles has been below sleepSpeed for sleepSteps steps
+		//  are at rest. Particles are put to sleep, which skips them in the simulation stages, when their own cell and
+		//  all neighbouring cells are at rest. Disabled if sleepSteps is 0, which must be at most 255. Has the same
+		//  restrictions as LOD.
+		float sleepSpeed;
+		uint32_t sleepSteps;
+
 		bool shouldChangeParticleGravity;
 		bool changeGravityParticleHighlightOnly;
 		glm::vec3 changeGravityParticlePos;
@@ -52,6 +113,20 @@ public:
 		std::span<const WaterPumpDescription> waterPumps;
 	};
 
+	// How to advance the simulation by numBaseSteps steps of a base length, as numSubsteps steps of length dt
+	struct TimeStep
+	{
+		uint32_t numBaseSteps;
+		uint32_t numSubsteps;
+		float dt;
+	};
+
+	// Chooses a time step such that the fastest particle moves at most cflNumber * INFLUENCE_RADIUS per substep.
+	//  Fast water is split into up to maxSubsteps substeps, and up to maxBaseSteps steps are merged into one when
+	//  the water is calm.
+	static TimeStep ChooseTimeStep(
+		float baseDt, float maxSpeed, float cflNumber, uint32_t maxBaseSteps, uint32_t maxSubsteps);
+
 	WaterSimulatorImpl(const WaterSimulatorImpl&) = delete;
 	WaterSimulatorImpl(WaterSimulatorImpl&&) = delete;
 	WaterSimulatorImpl& operator=(const WaterSimulatorImpl&) = delete;
@@ -59,25 +134,113 @@ public:
 
 	static std::unique_ptr<WaterSimulatorImpl> CreateInstance(const ConstructorArgs& args);
 
+	// Creates an instance using a specific instruction set, which must be supported by the CPU
+	static std::unique_ptr<WaterSimulatorImpl> CreateInstance(const ConstructorArgs& args, WaterSimIsa isa);
+
+	static bool IsIsaSupported(WaterSimIsa isa);
+
+	// Tweakable settings that change how new instances move particles, so states simulated with different settings
+	//  differ even when the same steps are simulated
+	struct StateSettings
+	{
+		float verletSkin;
+		uint32_t reorderInterval;
+		bool halfPairs;
+		bool islands;
+		bool reproducible;
+
+		bool operator==(const StateSettings&) const = default;
+	};
+
+	static StateSettings GetStateSettings();
+
 	WaterSimulatorImpl(const ConstructorArgs& args, size_t memoryAlignment);
 
 	virtual ~WaterSimulatorImpl();
 
-	uint32_t CopyToOutputBuffer();
-	void* GetOutputBuffer() const;
+	// Particle data for rendering, in the order of the initial particles. Frames are written by the simulation
+	//  thread and handed to the main thread through a triple buffer, so neither thread waits for the other.
+	struct OutputFrame
+	{
+		uint32_t numParticles;
+
+		// Positions are stored in xyz, and the time that the particle last started glowing is stored in w
+		glm::vec4* positions;
+
+		// Particles in the compact format, which are only written if layout.compact is set
+		WaterCompactParticle* compactParticles;
+		WaterParticleDataLayout layout;
 
-	void* GetGravitiesOutputBuffer(uint32_t& versionOut) const;
+		// Gravities are only copied to a frame when they have changed, which is tracked by the version
+		uint8_t* gravities;
+		uint32_t gravityVersion;
+
+		WaterRayGrid rayGrid;
+	};
+
+	// Writes the particle data from the last step to a free output frame and publishes it. Must be called after
+	//  Simulate and before SwapBuffers.
+	void PublishOutputFrame();
+
+	// Returns the most recently published output frame. The frame is not written to until the next call, so it can
+	//  be read without locking. Must only be called from one thread at a time.
+	const OutputFrame& AcquireOutputFrame();
+
+	// Copies the positions, velocities and gravities of all particles in the order of the initial particles, so that
+	//  the state can be restored by passing them to the constructor. Must be called after SwapBuffers and before
+	//  Simulate.
+	void GetParticleState(
+		std::vector<glm::vec3>& positionsOut, std::vector<glm::vec3>& velocitiesOut,
+		std::vector<uint8_t>& gravitiesOut) const;
 
 	virtual WaterQueryResults Query(const eg::AABB& aabb) const;
 
+	// Computes the same results as Query for many AABBs at once, using the partition grid so that only particles
+	//  close to each AABB are visited. Must be called after Simulate and before SwapBuffers, since the grid refers to
+	//  particles by their storage index in that step.
+	void QueryBatch(std::span<const eg::AABB> aabbs, std::span<WaterQueryResults> resultsOut) const;
+
 	void SwapBuffers();
 
 	void Simulate(const SimulateArgs& simulateArgs);
 
 	uint32_t NumThreads() const { return m_numThreads; }
 
+	bool HasWideParticleIndices() const { return m_wideParticleIndices; }
+
+	// Returns the number of bytes currently used to store close particle lists
+	size_t CloseParticlesMemoryUsage() const;
+
+	// Returns the time in nanoseconds spent in each stage of the last step, indexed by WaterSimStage.
+	//  Must only be called from the thread that calls Simulate.
+	const std::array<uint64_t, NUM_WATER_SIM_STAGES>& LastStepStageTimes() const { return m_lastStepStageTimes; }
+
+	// Returns the number of steps so far where close particle lists were rebuilt, rather than reused from the
+	//  previous step (which can happen when a Verlet skin is used).
+	uint64_t NumCloseParticleRebuilds() const { return m_numCloseParticleRebuilds; }
+
+	// Returns whether particles can be skipped by LOD and sleeping. Skipping isn't supported with half pair lists or a
+	//  Verlet skin, since those need every particle to be stepped, so LOD and sleeping are then ignored.
+	bool CanSkipParticles() const { return !m_halfPairLists && m_verletSkin <= 0; }
+
+	// Returns the number of particles that were frozen by LOD in the last step
+	uint32_t NumLodFrozenParticles() const { return m_numLodFrozenParticles.load(std::memory_order_relaxed); }
+
+	// Returns the number of particles that were asleep in the last step
+	uint32_t NumSleepingParticles() const { return m_numSleepingParticles.load(std::memory_order_relaxed); }
+
+	// Returns the speed of the fastest particle at the end of the last step
+	float LastStepMaxSpeed() const { return m_lastStepMaxSpeed; }
+
+	// Returns the number of islands that were simulated in the last step, or 0 if islands are not used
+	uint32_t NumIslands() const { return m_numIslands; }
+
+	// Writes the timings and counters of the last step. Query times are not measured by the simulator, so they are
+	//  left unchanged. Must only be called from the thread that calls Simulate.
+	void GetLastStepStats(WaterSimStepStats& statsOut) const;
+
 protected:
-	void MoveAcrossPumps(std::span<const WaterPumpDescription> pumps, float dt);
+	void MoveAcrossPumps(std::span<const WaterPumpDescription> pumps, float dt, float baseDt);
 	void ChangeParticleGravity(glm::vec3 changePos, bool highlightOnly, Dir newGravity, float gameTime);
 
 	int CellIdx(glm::ivec3 coord) const;
@@ -86,6 +249,7 @@ protected:
 	struct SimulateStageArgs
 	{
 		uint32_t threadIndex;
+		uint32_t rangeIndex;
 		uint32_t loIdx;
 		uint32_t hiIdx;
 		float dt;
@@ -96,9 +260,28 @@ protected:
 	virtual void Stage3_Acceleration(SimulateStageArgs args);
 	virtual void Stage4_DiffusionAndCollision(SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers);
 
+	template <typename IdxT>
+	void Stage1_DetectCloseImpl(SimulateStageArgs args);
+	template <typename IdxT>
+	void Stage3_AccelerationImpl(SimulateStageArgs args);
+	template <typename IdxT>
+	void Stage4_DiffusionAndCollisionImpl(SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers);
+
+	// Moves a particle by its new velocity and resolves collisions, then writes the result to the second buffers
+	void MoveAndCollideParticle(
+		uint32_t a, glm::vec3 vel, float dt, uint32_t threadIndex, std::span<const WaterBlocker> waterBlockers);
+
 	uint32_t m_numParticles;
 	uint32_t m_allocatedParticles;
 
+	// Particle indices (in the partition grid and in the close particle lists) are stored as 16-bit integers
+	//  unless there are too many particles for that, in which case 32-bit integers are used instead.
+	bool m_wideParticleIndices;
+
+	// In half pair mode, the close particle list of particle a only contains particles b > a, so every pair is
+	//  stored once. Interactions are then accumulated to both particles of the pair at the same time.
+	bool m_halfPairLists;
+
 	struct Vec3SOA
 	{
 		float* x;
@@ -114,7 +297,6 @@ protected:
 	Vec3SOA m_particlesVel2;
 
 	uint8_t* m_particlesGravity;
-	uint8_t* m_particlesGravity2;
 	float* m_particlesGlowTime;
 
 	float* m_particleDensityX;
@@ -122,20 +304,111 @@ protected:
 
 	float* m_particlesRadius;
 
+	// Set by BinParticles for particles that are skipped by the simulation stages this step, because they are
+	//  frozen by LOD or asleep. Only used if m_skipParticlesThisStep is set.
+	uint8_t* m_particlesSkipped;
+	bool m_skipParticlesThisStep = false;
+	bool m_detectCloseForAllParticles = false;
+	uint32_t m_stepIndex = 0;
+	uint32_t m_baseStepIndex = 0;
+
+	bool m_lodFreezeThisStep = false;
+	float m_lodDistance2 = 0;
+	glm::vec3 m_lodCameraPos{ 0.0f };
+	std::atomic_uint32_t m_numLodFrozenParticles{ 0 };
+
+	// Set once a warning has been logged about LOD or sleeping being requested when particles can't be skipped
+	bool m_loggedCantSkipParticles = false;
+
+	uint32_t m_sleepSteps = 0;
+	float m_sleepMaxMoveDist = 0;
+	std::atomic_uint32_t m_numSleepingParticles{ 0 };
+
+	// Set for particles that have been disturbed since the last step, which wakes their partition cell
+	uint8_t* m_particlesWake;
+
+	// For each partition cell, the number of steps in a row that the cell has been at rest (saturating at UINT8_MAX),
+	//  and the total distance moved by its particles in the last step. The second position buffer holds the
+	//  positions from the last step while particles are binned, except on the first step and after reordering.
+	std::vector<uint8_t> m_cellRestSteps;
+	std::vector<uint64_t> m_cellMoveDistSums;
+
+	// Move distances are summed in fixed point, since integer sums don't depend on the order that threads add in.
+	//  Distances are clamped so that the sums can't overflow, which is far more than a resting particle moves.
+	static constexpr float MOVE_DIST_SUM_SCALE = 1 << 24;
+	static constexpr float MAX_SUMMED_MOVE_DIST = 1 << 16;
+	bool m_lastStepPositionsValid = false;
+
+	// Water blockers from the last step, which are compared against the current ones to wake particles near
+	//  blockers that have been added or removed
+	std::vector<WaterBlocker> m_lastStepWaterBlockers;
+	void WakeParticlesNearChangedBlockers(std::span<const WaterBlocker> waterBlockers);
+
+	// Calls fn for each run of consecutive particles in the range that are not skipped this step
+	template <typename Fn>
+	void ForEachSimulatedRange(SimulateStageArgs args, Fn fn);
+
+	// Copies the positions and velocities of skipped particles in the range to the second buffers
+	void KeepSkippedParticles(uint32_t loIdx, uint32_t hiIdx, uint32_t threadIndex);
+
 	std::vector<pcg32_fast> m_threadRngs;
 
-	glm::vec4* m_outputBuffer;
+	bool m_reproducible;
+	uint64_t m_rngSeed;
+
+	// Returns a seed that only depends on the simulator's seed, the current step and the given particle. Used in
+	//  reproducible mode instead of the thread random number generators, which depend on how work is split.
+	uint64_t ParticleRngSeed(uint32_t particle) const
+	{
+		// Mixes the inputs with the splitmix64 finalizer
+		uint64_t x = m_rngSeed + ((static_cast<uint64_t>(m_stepIndex) << 32) | particle) * 0x9E3779B97F4A7C15ULL;
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+		return x ^ (x >> 31);
+	}
+
+	// Game time of the last step, which is the base time for glow ages in compact output
+	float m_lastStepGameTime = 0;
+
+	void WriteOutputFrame(OutputFrame& frame, const Vec3SOA& positions);
+
+	std::array<OutputFrame, 3> m_outputFrames;
+
+	// Index of the most recently published output frame. OUTPUT_FRAME_NEW_BIT is set until it has been acquired.
+	static constexpr uint32_t OUTPUT_FRAME_NEW_BIT = 4;
+	std::atomic_uint32_t m_outputFramePublished;
+
+	// Indices of the frames that the simulation thread is writing to and that the main thread is reading from
+	uint32_t m_outputFrameWriting = 1;
+	uint32_t m_outputFrameAcquired = 2;
 
 	uint32_t m_itemsPerThreadPreferredDivisibility;
 
 	// Stores which cell each particle belongs to
 	std::vector<glm::ivec3> particleCells;
 
-	// For each partition cell, stores how many particles belong to that cell.
-	std::vector<uint16_t> cellNumParticles;
+	// Stores the partition cell index of each particle. Particles outside of the partition grid are assigned
+	//  to an extra bucket after the last cell.
+	std::vector<uint32_t> particleCellIndices;
+
+	// Particle indices sorted by partition cell, using the selected particle index type. The particles belonging
+	//  to cell c are stored at [cellParticlesStart[c], cellParticlesStart[c + 1]).
+	std::vector<uint32_t> cellParticlesStart;
+	std::unique_ptr<void, eg::FreeDel> m_cellParticlesMemory;
+
+	// Maps the storage index of each particle to its index in the output buffers. Particle data is periodically
+	//  reordered to follow the partition grid, but the output buffers keep the initial order so that particle
+	//  identities stay stable for rendering.
+	uint32_t* m_particleOutputIndices;
 
-	// For each partition cell, stores a list of particle indices that belong to that cell.
-	std::vector<std::array<uint16_t, MAX_PER_PART_CELL>> cellParticles;
+	// Side length of partition grid cells, which is INFLUENCE_RADIUS plus the Verlet skin
+	float partGridCellSize;
+
+	// Particles closer than this are stored in close particle lists, which is also INFLUENCE_RADIUS plus the skin
+	float m_closeParticlesSearchRadius;
+
+	// Simd implementations may read this many particle indices past the end of the last partition cell
+	static constexpr uint32_t CELL_PARTICLES_OVERREAD = 16;
 
 	glm::ivec3 partGridMin;
 	glm::ivec3 partGridNumCellGroups;
@@ -143,34 +416,336 @@ protected:
 
 	uint32_t GetCloseParticlesCount(uint32_t particle) const { return m_numCloseParticles[particle]; }
 
-	float* GetCloseParticlesDistPtr(uint32_t particle) const { return m_closeParticlesDist + particle * MAX_CLOSE; }
+	float* GetCloseParticlesDistPtr(uint32_t particle) const
+	{
+		return m_closeParticlesDist + m_closeParticlesStart[particle];
+	}
 
-	uint16_t* GetCloseParticlesIdxPtr(uint32_t particle) const { return m_closeParticlesIdx + particle * MAX_CLOSE; }
+	template <typename IdxT>
+	IdxT* GetCloseParticlesIdxPtr(uint32_t particle) const
+	{
+		return static_cast<IdxT*>(m_closeParticlesIdx) + m_closeParticlesStart[particle];
+	}
+
+	uint32_t GetCloseParticleIdx(uint32_t particle, uint32_t i) const
+	{
+		if (m_wideParticleIndices)
+			return GetCloseParticlesIdxPtr<uint32_t>(particle)[i];
+		return GetCloseParticlesIdxPtr<uint16_t>(particle)[i];
+	}
+
+	uint32_t GetCellNumParticles(int cell) const { return cellParticlesStart[cell + 1] - cellParticlesStart[cell]; }
+
+	template <typename IdxT>
+	IdxT* GetCellParticlesPtr(int cell) const
+	{
+		return static_cast<IdxT*>(m_cellParticlesMemory.get()) + cellParticlesStart[cell];
+	}
 
 	static const glm::vec3 gravities[6];
 
+	// Close particles found in one work range in stage 1, before they are moved to the shared close particle arrays
+	struct CloseParticlesScratch
+	{
+		std::vector<uint32_t> indices;
+		std::vector<float> distances;
+		uint32_t baseOffset;
+	};
+
+	std::vector<CloseParticlesScratch> m_closeParticlesScratch;
+
+	// Called by stage 1 once all close particles of a particle have been added to the scratch lists
+	void FinishCloseParticlesList(CloseParticlesScratch& scratch, uint32_t particle, uint32_t listStart);
+
 private:
-	std::pair<uint32_t, uint32_t> GetThreadWorkingRange(uint32_t threadIndex) const;
+	std::pair<uint32_t, uint32_t> GetThreadWorkingRange(uint32_t threadIndex, uint32_t numItems) const;
+
+	void BinParticles(uint32_t threadIndex, uint32_t particlesLo, uint32_t particlesHi);
+
+	template <typename IdxT>
+	void QueryBatchImpl(std::span<const eg::AABB> aabbs, std::span<WaterQueryResults> resultsOut) const;
+
+	void AddToQueryResults(WaterQueryResults& results, const eg::AABB& aabb, uint32_t particle) const;
+
+	// Calls fn with the storage index of each particle in partition cells that overlap the given box, and of each
+	//  particle outside of the partition grid
+	template <typename IdxT, typename Fn>
+	void ForEachParticleInGridBox(glm::vec3 boxMin, glm::vec3 boxMax, Fn fn) const;
+
+	// The partition grid is built from the positions at the start of each step. It stays usable after the step
+	//  (reordering updates it), as long as search areas are expanded by how far particles moved in the step.
+	bool m_partitionGridBuilt = false;
+	float m_lastStepMaxMoveDist = 0;
+	float m_lastStepMaxSpeed = 0;
+
+	// Particles moved by pumps earlier in the current call to MoveAcrossPumps, which are not where the partition
+	//  grid says they are
+	std::vector<uint32_t> m_pumpedParticles;
+
+	// For each pump, by index in the pumps argument, the fraction of a particle that is yet to be moved
+	std::vector<float> m_pumpBudgets;
+
+	// For each partition cell (and the bucket of particles outside of the grid), the number of particles in that
+	//  cell. This is only non-zero while particles are being binned.
+	std::vector<uint32_t> m_cellCounts;
+
+	// The number of particles in each thread's range of partition cells
+	std::vector<uint32_t> m_cellRangeParticleCounts;
+
+	std::array<uint64_t, NUM_WATER_SIM_STAGES> m_lastStepStageTimes = {};
+
+	// Times of each simulation thread in the current step. Thread 0 accounts for the times of all threads after each
+	//  barrier, using the times at which the threads arrived, so the times are complete once Simulate returns.
+	struct alignas(64) ThreadStepTimes
+	{
+		WaterSimThreadStepTimes times;
+
+		// Arrival times alternate between two slots, since a thread can arrive at the next barrier before thread 0
+		//  has read the arrival times for the previous barrier
+		std::array<std::chrono::steady_clock::time_point, 2> barrierArrivalTimes;
+		uint32_t numBarriers = 0;
+
+		// When the thread started working after the previous barrier
+		std::chrono::steady_clock::time_point workStartTime;
+	};
+
+	std::vector<ThreadStepTimes> m_threadStepTimes;
+
+	// Largest squared move distance and speed of the particles written by each thread in the current step
+	struct alignas(64) ThreadStepMaxima
+	{
+		float moveDist2 = 0;
+		float speed2 = 0;
+	};
+	std::vector<ThreadStepMaxima> m_threadStepMaxima;
+
+	// Waits at m_barrier for all threads, and accounts for the time since the previous barrier to the given stage
+	void WaitForAllThreads(uint32_t threadIndex, WaterSimStage stage);
 
 	void RunAllParallelizedSimulationStages(
 		uint32_t threadIndex, float dt, std::span<const WaterBlocker> waterBlockers);
 
 	void WorkerThreadTarget(uint32_t threadIndex);
 
+	template <typename StageFn>
+	void RunStageForAllRanges(uint32_t stageIndex, uint32_t threadIndex, float dt, StageFn stageFn);
+
+	// With work stealing, particles are split into chunks of WORK_CHUNK_SIZE particles. Each thread owns a
+	//  contiguous range of chunks per stage, and takes chunks from other threads once its own are done.
+	//  Otherwise each thread processes one static range of particles (from GetThreadWorkingRange) per stage.
+	static constexpr uint32_t WORK_CHUNK_SIZE = 256;
+	static constexpr uint32_t NUM_WORK_STEALING_STAGES = 7;
+
+	struct alignas(64) ChunkQueue
+	{
+		std::atomic_uint32_t nextChunk;
+		uint32_t firstChunk;
+		uint32_t endChunk;
+	};
+
+	bool m_useWorkStealing;
+	uint32_t m_numWorkRanges;
+	std::unique_ptr<ChunkQueue[]> m_chunkQueues;
+
+	// With islands, particles are split each step into groups that are connected through close particle lists.
+	//  Since islands don't interact, stages 2-4 are run for each island as soon as the previous stage of the same
+	//  island is done, instead of waiting for all particles after each stage. Islands are found with a concurrent
+	//  union-find where each particle's parent has a lower index. Each thread then finds the runs of consecutive
+	//  particles in the same island in its range, and the last thread to finish groups small islands together and
+	//  splits the simulated particles of each group into chunks of at most WORK_CHUNK_SIZE particles. Not supported
+	//  with half pair lists, since those apply pair interactions to particles in other chunks.
+	bool m_useIslands;
+	static constexpr uint32_t NUM_ISLAND_STAGES = 3;
+	static constexpr WaterSimStage ISLAND_STAGES[NUM_ISLAND_STAGES] = {
+		WaterSimStage::ComputeNumberDensity,
+		WaterSimStage::Acceleration,
+		WaterSimStage::DiffusionAndCollision,
+	};
+
+	struct Island
+	{
+		uint32_t root;
+		uint32_t numParticles;
+	};
+
+	struct IslandRun
+	{
+		uint32_t lo;
+		uint32_t hi;
+		uint32_t island;
+	};
+
+	struct alignas(64) ThreadIslandRuns
+	{
+		std::vector<IslandRun> runs;
+	};
+
+	struct alignas(64) IslandState
+	{
+		uint32_t firstChunk;
+		uint32_t numChunks;
+		std::atomic_uint32_t stage;
+		std::atomic_uint32_t nextChunk[NUM_ISLAND_STAGES];
+		std::atomic_uint32_t doneChunks[NUM_ISLAND_STAGES];
+	};
+
+	uint32_t* m_islandParents;
+	uint32_t* m_islandIndexOfRoot;
+	std::vector<Island> m_islands;
+	std::vector<ThreadIslandRuns> m_threadIslandRuns;
+	std::vector<std::pair<uint32_t, uint32_t>> m_islandChunks;
+	std::unique_ptr<IslandState[]> m_islandStates;
+	uint32_t m_islandStatesCapacity = 0;
+	uint32_t m_numIslands = 0;
+	uint32_t m_numIslandGroups = 0;
+	std::atomic_uint32_t m_islandsRemaining;
+	std::atomic_uint32_t m_findIslandsThreadsRemaining;
+
+	// Incremented whenever an island group moves on to its next stage. Threads that run out of island work wait for
+	//  this to change.
+	std::atomic_uint32_t m_islandStageAdvances{ 0 };
+
+	uint32_t FindIslandRoot(uint32_t particle);
+	void UnionCloseParticleIslands(SimulateStageArgs args);
+	void FindIslands(uint32_t threadIndex);
+	void BuildIslands();
+	void SimulateIslands(uint32_t threadIndex, float dt, std::span<const WaterBlocker> waterBlockers);
+	void SplitIslandStageTimes();
+
+	template <typename IdxT>
+	void ReorderParticles();
+
+	uint32_t* m_reorderScratch;
+	uint32_t m_stepsSinceReorder = 0;
+
 	std::unique_ptr<void, eg::FreeDel> m_dataMemory;
 
-	uint16_t* m_numCloseParticles;
-	uint16_t* m_closeParticlesIdx;
-	float* m_closeParticlesDist;
+	void AllocateCloseParticlesStorage();
+
+	void CompactCloseParticles(SimulateStageArgs args);
+	template <typename IdxT>
+	void CompactCloseParticlesImpl(SimulateStageArgs args);
+
+	// Close particles are stored in compressed sparse row form. For each particle, m_closeParticlesStart stores where
+	//  its list begins in m_closeParticlesIdx and m_closeParticlesDist. Lists are padded to a multiple of
+	//  m_closeParticlesPadding entries so that simd implementations can always process whole vectors.
+	uint32_t* m_numCloseParticles;
+	uint32_t* m_closeParticlesStart;
+	void* m_closeParticlesIdx = nullptr;
+	float* m_closeParticlesDist = nullptr;
+	std::unique_ptr<void, eg::FreeDel> m_closeParticlesMemory;
+	uint32_t m_closeParticlesCapacity = 0;
+	uint32_t m_closeParticlesPadding;
+	size_t m_memoryAlignment;
+
+	std::atomic_uint32_t m_stage1ThreadsRemaining;
+
+	// The number of particles that close particle lists were built for in the current step, and the average length
+	//  of the lists when they were last built
+	std::atomic_uint32_t m_numDetectCloseParticles{ 0 };
+	float m_closeParticlesPerParticle = 0;
+
+	std::atomic_uint32_t m_numParticlesOutsideGrid{ 0 };
+
+	template <typename IdxT>
+	void AccumulateNumberDensityHalfPairs(SimulateStageArgs args);
+	template <typename IdxT>
+	void AccumulateAccelerationHalfPairs(SimulateStageArgs args);
+	template <typename IdxT>
+	void AccumulateDiffusionHalfPairs(SimulateStageArgs args);
+
+	void FinishNumberDensityHalfPairs(SimulateStageArgs args);
+	void FinishAccelerationHalfPairs(SimulateStageArgs args);
+	void FinishDiffusionAndCollisionHalfPairs(SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers);
+
+	glm::vec3 TakeAccumulatedPairValues(uint32_t particle);
+
+	// Per thread buffers that pair interactions are added to in half pair mode, so that threads never write to the
+	//  same particle. These are summed up and cleared after each stage.
+	std::vector<Vec3SOA> m_threadPairAccumulators;
+	std::unique_ptr<void, eg::FreeDel> m_threadPairAccumulatorsMemory;
+
+	void RefreshCloseParticleDistances(SimulateStageArgs args);
+
+	// With a Verlet skin, close particle lists include all particles within INFLUENCE_RADIUS + m_verletSkin and are
+	//  reused until some particle has moved more than half the skin since they were built. Distances are refreshed
+	//  every step and clamped to INFLUENCE_RADIUS, where the kernels have no effect.
+	float m_verletSkin;
+	Vec3SOA m_closeParticlesBuildPos;
+	std::atomic_bool m_closeParticlesOutdated = true;
+	uint64_t m_numCloseParticleRebuilds = 0;
 
 	uint32_t gravityVersion = 0;
-	uint32_t gravityVersion2 = 0;
+
+	// Finds the particle closest to pos by searching the partition grid in rings of cells around pos. Returns
+	//  UINT32_MAX if there are no particles.
+	template <typename IdxT>
+	uint32_t FindClosestParticle(glm::vec3 pos) const;
+
+	// Finds all particles connected to the given particle through close particle lists, and stores them in
+	//  m_connectedParticles
+	template <typename IdxT>
+	void FindConnectedParticles(uint32_t particle);
+
+	// The particles found by the last call to FindConnectedParticles are stamped with m_connectedGeneration, so
+	//  the stamps don't need to be cleared between calls. Highlight requests reuse these particles for a few steps
+	//  if they contain the particle closest to the highlight position.
+	std::vector<uint32_t> m_connectedParticles;
+	std::vector<uint32_t> m_connectedParticlesGeneration;
+	uint32_t m_connectedGeneration = 0;
+	uint32_t m_connectedParticlesAge = UINT32_MAX;
+
+	// Union-find state and partition cells used by FindConnectedParticles in half pair mode
+	std::vector<uint32_t> m_unionFindParent;
+	std::vector<int> m_connectedCells;
+	std::vector<glm::ivec3> m_connectedCellCoords;
+	std::vector<uint32_t> m_connectedCellsGeneration;
+	std::vector<eg::AABB> m_connectedCellBoxes;
+	std::vector<uint32_t> m_connectedCellBoxesGeneration;
 
 	glm::ivec3 worldMin;
 	glm::ivec3 worldSize;
 
 	int voxelAirStrideZ;
-	uint8_t* isVoxelAir;
+	const uint8_t* isVoxelAir;
+
+	// A face between a solid voxel and an air voxel, which particles collide with. The solid voxel is given relative
+	//  to the voxel that the particle is in.
+	struct CollisionFace
+	{
+		int8_t solidOffsetX;
+		int8_t solidOffsetY;
+		int8_t solidOffsetZ;
+		uint8_t normalIndex : 3;
+		uint8_t extendedTangent : 1;
+		uint8_t extendedBitangent : 1;
+	};
+
+	void BuildCollisionFaces();
+
+	std::span<const CollisionFace> GetCollisionFaces(glm::ivec3 voxel) const;
+
+	// Collision faces are precomputed for every voxel within COLLISION_FACES_MARGIN voxels of the world. Particles
+	//  further away than that can't be close to any air voxel, so there are no faces to collide with.
+	static constexpr int COLLISION_FACES_MARGIN = 2;
+	glm::ivec3 m_collisionFacesMin;
+	glm::ivec3 m_collisionFacesSize;
+	std::vector<uint32_t> m_voxelCollisionFacesStart;
+	std::vector<CollisionFace> m_voxelCollisionFaces;
+
+	void BinWaterBlockers(std::span<const WaterBlocker> waterBlockers);
+
+	glm::ivec3 GetBlockerGridCell(glm::vec3 pos) const;
+
+	// Returns the indices of the water blockers that a particle at the given position could collide with
+	std::span<const uint32_t> GetNearbyWaterBlockers(glm::vec3 pos) const;
+
+	// Water blockers are binned into a coarse grid over the world at the start of each step. A blocker is added to
+	//  every cell that its bounding box overlaps, and positions outside of the grid use the closest cell.
+	static constexpr int BLOCKER_GRID_CELL_SIZE = 4;
+	glm::ivec3 m_blockerGridNumCells;
+	std::vector<uint32_t> m_blockerGridCellsStart;
+	std::vector<uint32_t> m_blockerGridIndices;
 
 	uint64_t m_workerThreadRunIteration = 0;
 	float m_dtForWorkerThread;
@@ -180,6 +755,7 @@ private:
 
 	uint32_t m_numThreads;
 
+	// Must be declared after m_numThreads since it is initialized using it
 	std::barrier<> m_barrier;
 
 	std::vector<std::thread> m_workerThreads;
@@ -2,10 +2,9 @@
 
 #include "WaterSimulatorImpl.hpp"
 
+#include <bit>
 #include <immintrin.h>
 
-static_assert(MAX_CLOSE % alignof(__m256) == 0);
-
 class WaterSimulatorImplAvx2 : public WaterSimulatorImpl
 {
 public:
@@ -21,10 +20,22 @@ public:
 		}
 	}
 
+	void Stage1_DetectClose(SimulateStageArgs args) final override;
 	void Stage2_ComputeNumberDensity(SimulateStageArgs args) final override;
 	void Stage3_Acceleration(SimulateStageArgs args) final override;
+	void Stage4_DiffusionAndCollision(
+		SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers) final override;
 
 private:
+	template <typename IdxT>
+	void Stage1_DetectCloseImpl(SimulateStageArgs args);
+	template <typename IdxT>
+	void Stage2_ComputeNumberDensityImpl(SimulateStageArgs args);
+	template <typename IdxT>
+	void Stage3_AccelerationImpl(SimulateStageArgs args);
+	template <typename IdxT>
+	void Stage4_DiffusionAndCollisionImpl(SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers);
+
 	__m256 m_randomOffsets[16];
 };
 
@@ -48,7 +59,143 @@ inline __m256 FloatX8Abs(__m256 v)
 	return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), v);
 }
 
+// Loads 8 particle indices and widens them to 32-bit integers if needed
+template <typename IdxT>
+inline __m256i LoadIndicesX8(const IdxT* indices)
+{
+	if constexpr (sizeof(IdxT) == sizeof(uint32_t))
+		return _mm256_load_si256(reinterpret_cast<const __m256i*>(indices));
+	else
+		return _mm256_cvtepu16_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(indices)));
+}
+
+template <typename IdxT>
+inline __m256i LoadUnalignedIndicesX8(const IdxT* indices)
+{
+	if constexpr (sizeof(IdxT) == sizeof(uint32_t))
+		return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices));
+	else
+		return _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(indices)));
+}
+
+void WaterSimulatorImplAvx2::Stage1_DetectClose(SimulateStageArgs args)
+{
+	if (m_wideParticleIndices)
+		Stage1_DetectCloseImpl<uint32_t>(args);
+	else
+		Stage1_DetectCloseImpl<uint16_t>(args);
+}
+
 void WaterSimulatorImplAvx2::Stage2_ComputeNumberDensity(SimulateStageArgs args)
+{
+	if (m_wideParticleIndices)
+		Stage2_ComputeNumberDensityImpl<uint32_t>(args);
+	else
+		Stage2_ComputeNumberDensityImpl<uint16_t>(args);
+}
+
+void WaterSimulatorImplAvx2::Stage3_Acceleration(SimulateStageArgs args)
+{
+	if (m_wideParticleIndices)
+		Stage3_AccelerationImpl<uint32_t>(args);
+	else
+		Stage3_AccelerationImpl<uint16_t>(args);
+}
+
+void WaterSimulatorImplAvx2::Stage4_DiffusionAndCollision(
+	SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers)
+{
+	if (m_wideParticleIndices)
+		Stage4_DiffusionAndCollisionImpl<uint32_t>(args, waterBlockers);
+	else
+		Stage4_DiffusionAndCollisionImpl<uint16_t>(args, waterBlockers);
+}
+
+// Tests 8 particles from a partition cell at a time. Avx2 has no compress-store, so close particles are instead
+//  appended by iterating over the bits of the comparison mask (only a small fraction of the lanes are close).
+template <typename IdxT>
+void WaterSimulatorImplAvx2::Stage1_DetectCloseImpl(SimulateStageArgs args)
+{
+	CloseParticlesScratch& scratch = m_closeParticlesScratch[args.rangeIndex];
+	const __m256 searchRadius2 = _mm256_set1_ps(m_closeParticlesSearchRadius * m_closeParticlesSearchRadius);
+	const __m256i laneIndices = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	alignas(32) uint32_t candidateIndices[PROC_PER_SIMD_ITERATION];
+	alignas(32) float candidateDistances[PROC_PER_SIMD_ITERATION];
+
+	for (uint32_t p = args.loIdx; p < args.hiIdx; p++)
+	{
+		const glm::ivec3 centerCell = particleCells[p];
+		const uint32_t listStart = eg::UnsignedNarrow<uint32_t>(scratch.indices.size());
+
+		const __m256 posX = _mm256_set1_ps(m_particlesPos1.x[p]);
+		const __m256 posY = _mm256_set1_ps(m_particlesPos1.y[p]);
+		const __m256 posZ = _mm256_set1_ps(m_particlesPos1.z[p]);
+		const __m256i particleIdx = _mm256_set1_epi32(static_cast<int>(p));
+
+		// Iterates over neighboring cells in the same order as the scalar implementation
+		for (int dx = -1; dx <= 1; dx++)
+		{
+			for (int dy = -1; dy <= 1; dy++)
+			{
+				for (int dz = -1; dz <= 1; dz++)
+				{
+					const int cell = CellIdx(centerCell + glm::ivec3(dx, dy, dz));
+					if (cell == -1)
+						continue;
+					const IdxT* cellParticles = GetCellParticlesPtr<IdxT>(cell);
+					const uint32_t numCellParticles = GetCellNumParticles(cell);
+
+					// Lanes past the end of the cell are masked out, the indices there may not be valid
+					for (uint32_t i = 0; i < numCellParticles; i += PROC_PER_SIMD_ITERATION)
+					{
+						const __m256 laneMask = _mm256_castsi256_ps(
+							_mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(numCellParticles - i)), laneIndices));
+						const __m256i indices = LoadUnalignedIndicesX8(cellParticles + i);
+
+						const __m256 sepX = _mm256_sub_ps(
+							posX, _mm256_mask_i32gather_ps(posX, m_particlesPos1.x, indices, laneMask, sizeof(float)));
+						const __m256 sepY = _mm256_sub_ps(
+							posY, _mm256_mask_i32gather_ps(posY, m_particlesPos1.y, indices, laneMask, sizeof(float)));
+						const __m256 sepZ = _mm256_sub_ps(
+							posZ, _mm256_mask_i32gather_ps(posZ, m_particlesPos1.z, indices, laneMask, sizeof(float)));
+						const __m256 dist2 = _mm256_add_ps(
+							_mm256_add_ps(_mm256_mul_ps(sepX, sepX), _mm256_mul_ps(sepY, sepY)),
+							_mm256_mul_ps(sepZ, sepZ));
+
+						// Particle indices are below 2^31, so signed comparison works for them
+						__m256 closeMask = _mm256_and_ps(laneMask, _mm256_cmp_ps(dist2, searchRadius2, _CMP_LT_OQ));
+						const __m256 sameIdxMask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(indices, particleIdx));
+						const __m256 greaterIdxMask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(indices, particleIdx));
+						if (m_halfPairLists)
+							closeMask = _mm256_and_ps(closeMask, greaterIdxMask);
+						else
+							closeMask = _mm256_andnot_ps(sameIdxMask, closeMask);
+
+						uint32_t closeBits = static_cast<uint32_t>(_mm256_movemask_ps(closeMask));
+						if (closeBits == 0)
+							continue;
+
+						const __m256 dist = _mm256_min_ps(_mm256_sqrt_ps(dist2), _mm256_set1_ps(INFLUENCE_RADIUS));
+						_mm256_store_si256(reinterpret_cast<__m256i*>(candidateIndices), indices);
+						_mm256_store_ps(candidateDistances, dist);
+						for (; closeBits != 0; closeBits &= closeBits - 1)
+						{
+							const int lane = std::countr_zero(closeBits);
+							scratch.indices.push_back(candidateIndices[lane]);
+							scratch.distances.push_back(candidateDistances[lane]);
+						}
+					}
+				}
+			}
+		}
+
+		FinishCloseParticlesList(scratch, p, listStart);
+	}
+}
+
+template <typename IdxT>
+void WaterSimulatorImplAvx2::Stage2_ComputeNumberDensityImpl(SimulateStageArgs args)
 {
 	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
 	{
@@ -56,20 +203,11 @@ void WaterSimulatorImplAvx2::Stage2_ComputeNumberDensity(SimulateStageArgs args)
 		__m256 densityY = _mm256_set1_ps(0);
 
 		uint32_t numClose = GetCloseParticlesCount(a);
-		if (numClose == 0)
-			continue;
-
 		__m256* closeParticlesDist = reinterpret_cast<__m256*>(GetCloseParticlesDistPtr(a));
 
 		uint32_t numSimdIterations = (numClose + PROC_PER_SIMD_ITERATION - 1) / PROC_PER_SIMD_ITERATION;
 
-		// Fills additional distances in the last simd iteration with INFLUENCE_RADIUS (no effect)
-		for (uint32_t i = numClose; i < numSimdIterations * PROC_PER_SIMD_ITERATION; i++)
-		{
-			GetCloseParticlesDistPtr(a)[i] = INFLUENCE_RADIUS;
-			GetCloseParticlesIdxPtr(a)[i] = GetCloseParticlesIdxPtr(a)[numClose - 1];
-		}
-
+		// Stage 1 pads the close particle lists to whole simd iterations with entries that have no effect
 		for (uint32_t bi = 0; bi < numSimdIterations; bi++)
 		{
 			__m256 dv = _mm256_mul_ps(closeParticlesDist[bi], _mm256_set1_ps(1.0f / INFLUENCE_RADIUS));
@@ -87,12 +225,17 @@ void WaterSimulatorImplAvx2::Stage2_ComputeNumberDensity(SimulateStageArgs args)
 	}
 }
 
-void WaterSimulatorImplAvx2::Stage3_Acceleration(SimulateStageArgs args)
+template <typename IdxT>
+void WaterSimulatorImplAvx2::Stage3_AccelerationImpl(SimulateStageArgs args)
 {
-	uint32_t randomOffsetIdx = m_threadRngs[args.threadIndex]();
+	// In reproducible mode the offsets used for a particle must not depend on the other particles in its range
+	uint32_t randomOffsetIdx = m_reproducible ? 0 : m_threadRngs[args.threadIndex]();
 
 	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
 	{
+		if (m_reproducible)
+			randomOffsetIdx = static_cast<uint32_t>(ParticleRngSeed(a));
+
 		const float aDensityX = m_particleDensityX[a];
 		const float nearDensA = m_particleDensityY[a];
 		const float relativeDensity = (aDensityX - AMBIENT_DENSITY) / aDensityX;
@@ -106,14 +249,14 @@ void WaterSimulatorImplAvx2::Stage3_Acceleration(SimulateStageArgs args)
 		glm::vec3 apos = m_particlesPos1[a];
 
 		uint32_t numClose = GetCloseParticlesCount(a);
-		__m128i* closeParticlesIdx = reinterpret_cast<__m128i*>(GetCloseParticlesIdxPtr(a));
+		const IdxT* closeParticlesIdx = GetCloseParticlesIdxPtr<IdxT>(a);
 		__m256* closeParticlesDist = reinterpret_cast<__m256*>(GetCloseParticlesDistPtr(a));
 
 		uint32_t numSimdIterations = (numClose + PROC_PER_SIMD_ITERATION - 1) / PROC_PER_SIMD_ITERATION;
 
 		for (uint32_t bi = 0; bi < numSimdIterations; bi++)
 		{
-			__m256i indices = _mm256_cvtepu16_epi32(closeParticlesIdx[bi]);
+			__m256i indices = LoadIndicesX8(closeParticlesIdx + bi * PROC_PER_SIMD_ITERATION);
 
 			__m256 bposX = _mm256_i32gather_ps(m_particlesPos1.x, indices, sizeof(float));
 			__m256 bposY = _mm256_i32gather_ps(m_particlesPos1.y, indices, sizeof(float));
@@ -127,13 +270,16 @@ void WaterSimulatorImplAvx2::Stage3_Acceleration(SimulateStageArgs args)
 
 			// Randomly separates particles that are very close so that the pressure gradient won't be zero.
 			// dist < CORE_RADIUS || abs(sepX) < CORE_RADIUS || abs(sepY) < CORE_RADIUS || abs(sepZ) < CORE_RADIUS)
-			auto tooCloseMask = _mm256_or_ps(
+			// Padding entries (dist == INFLUENCE_RADIUS) are excluded so that they never contribute any acceleration.
+			auto tooCloseMask = _mm256_and_ps(
+				_mm256_cmp_ps(dist, _mm256_set1_ps(INFLUENCE_RADIUS), _CMP_LT_OQ),
 				_mm256_or_ps(
-					_mm256_cmp_ps(dist, _mm256_set1_ps(CORE_RADIUS), _CMP_LT_OQ),
-					_mm256_cmp_ps(FloatX8Abs(sepX), _mm256_set1_ps(CORE_RADIUS), _CMP_LT_OQ)),
-				_mm256_or_ps(
-					_mm256_cmp_ps(FloatX8Abs(sepY), _mm256_set1_ps(CORE_RADIUS), _CMP_LT_OQ),
-					_mm256_cmp_ps(FloatX8Abs(sepZ), _mm256_set1_ps(CORE_RADIUS), _CMP_LT_OQ)));
+					_mm256_or_ps(
+						_mm256_cmp_ps(dist, _mm256_set1_ps(CORE_RADIUS), _CMP_LT_OQ),
+						_mm256_cmp_ps(FloatX8Abs(sepX), _mm256_set1_ps(CORE_RADIUS), _CMP_LT_OQ)),
+					_mm256_or_ps(
+						_mm256_cmp_ps(FloatX8Abs(sepY), _mm256_set1_ps(CORE_RADIUS), _CMP_LT_OQ),
+						_mm256_cmp_ps(FloatX8Abs(sepZ), _mm256_set1_ps(CORE_RADIUS), _CMP_LT_OQ))));
 			if (_mm256_movemask_ps(tooCloseMask))
 			{
 				__m256 offsetX = m_randomOffsets[(randomOffsetIdx++) % std::size(m_randomOffsets)];
@@ -183,4 +329,81 @@ void WaterSimulatorImplAvx2::Stage3_Acceleration(SimulateStageArgs args)
 	}
 }
 
+// Velocity diffusion is vectorized over the close particle list, collision is handled by the scalar implementation
+template <typename IdxT>
+void WaterSimulatorImplAvx2::Stage4_DiffusionAndCollisionImpl(
+	SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers)
+{
+	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
+	{
+		const __m256 posAX = _mm256_set1_ps(m_particlesPos1.x[a]);
+		const __m256 posAY = _mm256_set1_ps(m_particlesPos1.y[a]);
+		const __m256 posAZ = _mm256_set1_ps(m_particlesPos1.z[a]);
+		const __m256 velAX = _mm256_set1_ps(m_particlesVel1.x[a]);
+		const __m256 velAY = _mm256_set1_ps(m_particlesVel1.y[a]);
+		const __m256 velAZ = _mm256_set1_ps(m_particlesVel1.z[a]);
+
+		__m256 velChangeX = _mm256_setzero_ps();
+		__m256 velChangeY = _mm256_setzero_ps();
+		__m256 velChangeZ = _mm256_setzero_ps();
+
+		uint32_t numClose = GetCloseParticlesCount(a);
+		const IdxT* closeParticlesIdx = GetCloseParticlesIdxPtr<IdxT>(a);
+		__m256* closeParticlesDist = reinterpret_cast<__m256*>(GetCloseParticlesDistPtr(a));
+
+		uint32_t numSimdIterations = (numClose + PROC_PER_SIMD_ITERATION - 1) / PROC_PER_SIMD_ITERATION;
+
+		for (uint32_t bi = 0; bi < numSimdIterations; bi++)
+		{
+			__m256i indices = LoadIndicesX8(closeParticlesIdx + bi * PROC_PER_SIMD_ITERATION);
+			__m256 dist = closeParticlesDist[bi];
+
+			__m256 velBX = _mm256_i32gather_ps(m_particlesVel1.x, indices, sizeof(float));
+			__m256 velBY = _mm256_i32gather_ps(m_particlesVel1.y, indices, sizeof(float));
+			__m256 velBZ = _mm256_i32gather_ps(m_particlesVel1.z, indices, sizeof(float));
+
+			__m256 sepDirX = _mm256_div_ps(
+				_mm256_sub_ps(posAX, _mm256_i32gather_ps(m_particlesPos1.x, indices, sizeof(float))), dist);
+			__m256 sepDirY = _mm256_div_ps(
+				_mm256_sub_ps(posAY, _mm256_i32gather_ps(m_particlesPos1.y, indices, sizeof(float))), dist);
+			__m256 sepDirZ = _mm256_div_ps(
+				_mm256_sub_ps(posAZ, _mm256_i32gather_ps(m_particlesPos1.z, indices, sizeof(float))), dist);
+
+			__m256 velSepA = _mm256_add_ps(
+				_mm256_add_ps(_mm256_mul_ps(velAX, sepDirX), _mm256_mul_ps(velAY, sepDirY)),
+				_mm256_mul_ps(velAZ, sepDirZ));
+			__m256 velSepB = _mm256_add_ps(
+				_mm256_add_ps(_mm256_mul_ps(velBX, sepDirX), _mm256_mul_ps(velBY, sepDirY)),
+				_mm256_mul_ps(velBZ, sepDirZ));
+
+			// Only particles that are moving towards each other are affected. Entries outside of the influence
+			//  radius (padding and the Verlet skin) are also masked out, like in the scalar implementation.
+			__m256 approachingMask = _mm256_and_ps(
+				_mm256_cmp_ps(velSepA, velSepB, _CMP_LT_OQ),
+				_mm256_cmp_ps(dist, _mm256_set1_ps(INFLUENCE_RADIUS), _CMP_LT_OQ));
+			if (_mm256_movemask_ps(approachingMask) == 0)
+				continue;
+
+			__m256 infl = _mm256_max_ps(
+				_mm256_sub_ps(_mm256_set1_ps(1), _mm256_mul_ps(dist, _mm256_set1_ps(1.0f / INFLUENCE_RADIUS))),
+				_mm256_setzero_ps());
+			__m256 velSepTarget = _mm256_mul_ps(_mm256_add_ps(velSepA, velSepB), _mm256_set1_ps(0.5f));
+			__m256 changeSepA = _mm256_mul_ps(
+				_mm256_mul_ps(_mm256_set1_ps(RADIAL_VISCOSITY_GAIN), _mm256_sub_ps(velSepTarget, velSepA)), infl);
+
+			// The mask is applied after multiplying since sepDir is not finite for particles at the same position
+			velChangeX = _mm256_add_ps(velChangeX, _mm256_and_ps(approachingMask, _mm256_mul_ps(changeSepA, sepDirX)));
+			velChangeY = _mm256_add_ps(velChangeY, _mm256_and_ps(approachingMask, _mm256_mul_ps(changeSepA, sepDirY)));
+			velChangeZ = _mm256_add_ps(velChangeZ, _mm256_and_ps(approachingMask, _mm256_mul_ps(changeSepA, sepDirZ)));
+		}
+
+		glm::vec3 vel = m_particlesVel1[a];
+		vel.x += SumFloatx8(velChangeX);
+		vel.y += SumFloatx8(velChangeY);
+		vel.z += SumFloatx8(velChangeZ);
+
+		MoveAndCollideParticle(a, vel, args.dt, args.threadIndex, waterBlockers);
+	}
+}
+
 #endif
@@ -1,10 +1,9 @@
 #if defined(IOMOMI_ENABLE_WATER) && defined(__x86_64__)
 #include "WaterSimulatorImpl.hpp"
 
+#include <bit>
 #include <immintrin.h>
 
-static_assert(MAX_CLOSE % alignof(__m512) == 0);
-
 class WaterSimulatorImplAvx512 : public WaterSimulatorImpl
 {
 public:
@@ -13,17 +12,29 @@ public:
 		std::uniform_real_distribution<float> offsetDist(-CORE_RADIUS / 2, CORE_RADIUS);
 		for (size_t i = 0; i < std::size(m_randomOffsets); i++)
 		{
-			for (size_t j = 0; j < 8; j++)
+			for (size_t j = 0; j < 16; j++)
 			{
 				m_randomOffsets[i][j] = offsetDist(m_threadRngs[0]);
 			}
 		}
 	}
 
+	void Stage1_DetectClose(SimulateStageArgs args) final override;
 	void Stage2_ComputeNumberDensity(SimulateStageArgs args) final override;
 	void Stage3_Acceleration(SimulateStageArgs args) final override;
+	void Stage4_DiffusionAndCollision(
+		SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers) final override;
 
 private:
+	template <typename IdxT>
+	void Stage1_DetectCloseImpl(SimulateStageArgs args);
+	template <typename IdxT>
+	void Stage2_ComputeNumberDensityImpl(SimulateStageArgs args);
+	template <typename IdxT>
+	void Stage3_AccelerationImpl(SimulateStageArgs args);
+	template <typename IdxT>
+	void Stage4_DiffusionAndCollisionImpl(SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers);
+
 	__m512 m_randomOffsets[16];
 };
 
@@ -42,7 +53,134 @@ inline float SumFloatx16(__m512 v)
 	return ans;
 }
 
+// Loads 16 particle indices and widens them to 32-bit integers if needed
+template <typename IdxT>
+inline __m512i LoadIndicesX16(const IdxT* indices)
+{
+	if constexpr (sizeof(IdxT) == sizeof(uint32_t))
+		return _mm512_load_si512(indices);
+	else
+		return _mm512_cvtepu16_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(indices)));
+}
+
+template <typename IdxT>
+inline __m512i LoadUnalignedIndicesX16(const IdxT* indices)
+{
+	if constexpr (sizeof(IdxT) == sizeof(uint32_t))
+		return _mm512_loadu_si512(indices);
+	else
+		return _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices)));
+}
+
+void WaterSimulatorImplAvx512::Stage1_DetectClose(SimulateStageArgs args)
+{
+	if (m_wideParticleIndices)
+		Stage1_DetectCloseImpl<uint32_t>(args);
+	else
+		Stage1_DetectCloseImpl<uint16_t>(args);
+}
+
 void WaterSimulatorImplAvx512::Stage2_ComputeNumberDensity(SimulateStageArgs args)
+{
+	if (m_wideParticleIndices)
+		Stage2_ComputeNumberDensityImpl<uint32_t>(args);
+	else
+		Stage2_ComputeNumberDensityImpl<uint16_t>(args);
+}
+
+void WaterSimulatorImplAvx512::Stage3_Acceleration(SimulateStageArgs args)
+{
+	if (m_wideParticleIndices)
+		Stage3_AccelerationImpl<uint32_t>(args);
+	else
+		Stage3_AccelerationImpl<uint16_t>(args);
+}
+
+void WaterSimulatorImplAvx512::Stage4_DiffusionAndCollision(
+	SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers)
+{
+	if (m_wideParticleIndices)
+		Stage4_DiffusionAndCollisionImpl<uint32_t>(args, waterBlockers);
+	else
+		Stage4_DiffusionAndCollisionImpl<uint16_t>(args, waterBlockers);
+}
+
+// Tests 16 particles from a partition cell at a time, and compress-stores the ones that are close
+template <typename IdxT>
+void WaterSimulatorImplAvx512::Stage1_DetectCloseImpl(SimulateStageArgs args)
+{
+	CloseParticlesScratch& scratch = m_closeParticlesScratch[args.rangeIndex];
+	const __m512 searchRadius2 = _mm512_set1_ps(m_closeParticlesSearchRadius * m_closeParticlesSearchRadius);
+
+	alignas(64) uint32_t closeIndices[PROC_PER_SIMD_ITERATION];
+	alignas(64) float closeDistances[PROC_PER_SIMD_ITERATION];
+
+	for (uint32_t p = args.loIdx; p < args.hiIdx; p++)
+	{
+		const glm::ivec3 centerCell = particleCells[p];
+		const uint32_t listStart = eg::UnsignedNarrow<uint32_t>(scratch.indices.size());
+
+		const __m512 posX = _mm512_set1_ps(m_particlesPos1.x[p]);
+		const __m512 posY = _mm512_set1_ps(m_particlesPos1.y[p]);
+		const __m512 posZ = _mm512_set1_ps(m_particlesPos1.z[p]);
+		const __m512i particleIdx = _mm512_set1_epi32(static_cast<int>(p));
+
+		// Iterates over neighboring cells in the same order as the scalar implementation
+		for (int dx = -1; dx <= 1; dx++)
+		{
+			for (int dy = -1; dy <= 1; dy++)
+			{
+				for (int dz = -1; dz <= 1; dz++)
+				{
+					const int cell = CellIdx(centerCell + glm::ivec3(dx, dy, dz));
+					if (cell == -1)
+						continue;
+					const IdxT* cellParticles = GetCellParticlesPtr<IdxT>(cell);
+					const uint32_t numCellParticles = GetCellNumParticles(cell);
+
+					// Lanes past the end of the cell are masked out, the indices there may not be valid
+					for (uint32_t i = 0; i < numCellParticles; i += PROC_PER_SIMD_ITERATION)
+					{
+						const uint32_t numLanes = std::min(numCellParticles - i, PROC_PER_SIMD_ITERATION);
+						const __mmask16 laneMask = static_cast<__mmask16>((1u << numLanes) - 1);
+						const __m512i indices = LoadUnalignedIndicesX16(cellParticles + i);
+
+						const __m512 sepX = _mm512_sub_ps(
+							posX, _mm512_mask_i32gather_ps(posX, laneMask, indices, m_particlesPos1.x, sizeof(float)));
+						const __m512 sepY = _mm512_sub_ps(
+							posY, _mm512_mask_i32gather_ps(posY, laneMask, indices, m_particlesPos1.y, sizeof(float)));
+						const __m512 sepZ = _mm512_sub_ps(
+							posZ, _mm512_mask_i32gather_ps(posZ, laneMask, indices, m_particlesPos1.z, sizeof(float)));
+						const __m512 dist2 = _mm512_add_ps(
+							_mm512_add_ps(_mm512_mul_ps(sepX, sepX), _mm512_mul_ps(sepY, sepY)),
+							_mm512_mul_ps(sepZ, sepZ));
+
+						const __mmask16 otherParticleMask = m_halfPairLists
+						                                        ? _mm512_cmpgt_epu32_mask(indices, particleIdx)
+						                                        : _mm512_cmpneq_epu32_mask(indices, particleIdx);
+						const __mmask16 closeMask = laneMask & otherParticleMask &
+						                            _mm512_cmp_ps_mask(dist2, searchRadius2, _CMP_LT_OQ);
+						if (closeMask == 0)
+							continue;
+
+						const __m512 dist = _mm512_min_ps(_mm512_sqrt_ps(dist2), _mm512_set1_ps(INFLUENCE_RADIUS));
+						_mm512_mask_compressstoreu_epi32(closeIndices, closeMask, indices);
+						_mm512_mask_compressstoreu_ps(closeDistances, closeMask, dist);
+
+						const int numClose = std::popcount(static_cast<uint32_t>(closeMask));
+						scratch.indices.insert(scratch.indices.end(), closeIndices, closeIndices + numClose);
+						scratch.distances.insert(scratch.distances.end(), closeDistances, closeDistances + numClose);
+					}
+				}
+			}
+		}
+
+		FinishCloseParticlesList(scratch, p, listStart);
+	}
+}
+
+template <typename IdxT>
+void WaterSimulatorImplAvx512::Stage2_ComputeNumberDensityImpl(SimulateStageArgs args)
 {
 	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
 	{
@@ -50,20 +188,11 @@ void WaterSimulatorImplAvx512::Stage2_ComputeNumberDensity(SimulateStageArgs arg
 		__m512 densityY = _mm512_set1_ps(0);
 
 		uint32_t numClose = GetCloseParticlesCount(a);
-		if (numClose == 0)
-			continue;
-
 		__m512* closeParticlesDist = reinterpret_cast<__m512*>(GetCloseParticlesDistPtr(a));
 
 		uint32_t numSimdIterations = (numClose + PROC_PER_SIMD_ITERATION - 1) / PROC_PER_SIMD_ITERATION;
 
-		// Fills additional distances in the last simd iteration with INFLUENCE_RADIUS (no effect)
-		for (uint32_t i = numClose; i < numSimdIterations * PROC_PER_SIMD_ITERATION; i++)
-		{
-			GetCloseParticlesDistPtr(a)[i] = INFLUENCE_RADIUS;
-			GetCloseParticlesIdxPtr(a)[i] = GetCloseParticlesIdxPtr(a)[numClose - 1];
-		}
-
+		// Stage 1 pads the close particle lists to whole simd iterations with entries that have no effect
 		for (uint32_t bi = 0; bi < numSimdIterations; bi++)
 		{
 			__m512 dv = _mm512_mul_ps(closeParticlesDist[bi], _mm512_set1_ps(1.0f / INFLUENCE_RADIUS));
@@ -81,12 +210,17 @@ void WaterSimulatorImplAvx512::Stage2_ComputeNumberDensity(SimulateStageArgs arg
 	}
 }
 
-void WaterSimulatorImplAvx512::Stage3_Acceleration(SimulateStageArgs args)
+template <typename IdxT>
+void WaterSimulatorImplAvx512::Stage3_AccelerationImpl(SimulateStageArgs args)
 {
-	uint32_t randomOffsetIdx = m_threadRngs[args.threadIndex]();
+	// In reproducible mode the offsets used for a particle must not depend on the other particles in its range
+	uint32_t randomOffsetIdx = m_reproducible ? 0 : m_threadRngs[args.threadIndex]();
 
 	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
 	{
+		if (m_reproducible)
+			randomOffsetIdx = static_cast<uint32_t>(ParticleRngSeed(a));
+
 		const float aDensityX = m_particleDensityX[a];
 		const float nearDensA = m_particleDensityY[a];
 		const float relativeDensity = (aDensityX - AMBIENT_DENSITY) / aDensityX;
@@ -100,14 +234,14 @@ void WaterSimulatorImplAvx512::Stage3_Acceleration(SimulateStageArgs args)
 		glm::vec3 apos = m_particlesPos1[a];
 
 		uint32_t numClose = GetCloseParticlesCount(a);
-		__m256i* closeParticlesIdx = reinterpret_cast<__m256i*>(GetCloseParticlesIdxPtr(a));
+		const IdxT* closeParticlesIdx = GetCloseParticlesIdxPtr<IdxT>(a);
 		__m512* closeParticlesDist = reinterpret_cast<__m512*>(GetCloseParticlesDistPtr(a));
 
 		uint32_t numSimdIterations = (numClose + PROC_PER_SIMD_ITERATION - 1) / PROC_PER_SIMD_ITERATION;
 
 		for (uint32_t bi = 0; bi < numSimdIterations; bi++)
 		{
-			__m512i indices = _mm512_cvtepu16_epi32(closeParticlesIdx[bi]);
+			__m512i indices = LoadIndicesX16(closeParticlesIdx + bi * PROC_PER_SIMD_ITERATION);
 
 			__m512 bposX = _mm512_i32gather_ps(indices, m_particlesPos1.x, sizeof(float));
 			__m512 bposY = _mm512_i32gather_ps(indices, m_particlesPos1.y, sizeof(float));
@@ -121,10 +255,12 @@ void WaterSimulatorImplAvx512::Stage3_Acceleration(SimulateStageArgs args)
 
 			// Randomly separates particles that are very close so that the pressure gradient won't be zero.
 			// dist < CORE_RADIUS || abs(sepX) < CORE_RADIUS || abs(sepY) < CORE_RADIUS || abs(sepZ) < CORE_RADIUS)
-			auto tooCloseMask = _mm512_cmp_ps_mask(dist, _mm512_set1_ps(CORE_RADIUS), _CMP_LT_OQ) |
-			                    _mm512_cmp_ps_mask(_mm512_abs_ps(sepX), _mm512_set1_ps(CORE_RADIUS), _CMP_LT_OQ) |
-			                    _mm512_cmp_ps_mask(_mm512_abs_ps(sepY), _mm512_set1_ps(CORE_RADIUS), _CMP_LT_OQ) |
-			                    _mm512_cmp_ps_mask(_mm512_abs_ps(sepZ), _mm512_set1_ps(CORE_RADIUS), _CMP_LT_OQ);
+			// Padding entries (dist == INFLUENCE_RADIUS) are excluded so that they never contribute any acceleration.
+			auto tooCloseMask = _mm512_cmp_ps_mask(dist, _mm512_set1_ps(INFLUENCE_RADIUS), _CMP_LT_OQ) &
+			                    (_mm512_cmp_ps_mask(dist, _mm512_set1_ps(CORE_RADIUS), _CMP_LT_OQ) |
+			                     _mm512_cmp_ps_mask(_mm512_abs_ps(sepX), _mm512_set1_ps(CORE_RADIUS), _CMP_LT_OQ) |
+			                     _mm512_cmp_ps_mask(_mm512_abs_ps(sepY), _mm512_set1_ps(CORE_RADIUS), _CMP_LT_OQ) |
+			                     _mm512_cmp_ps_mask(_mm512_abs_ps(sepZ), _mm512_set1_ps(CORE_RADIUS), _CMP_LT_OQ));
 			if (tooCloseMask)
 			{
 				__m512 offsetX = m_randomOffsets[(randomOffsetIdx++) % std::size(m_randomOffsets)];
@@ -174,4 +310,82 @@ void WaterSimulatorImplAvx512::Stage3_Acceleration(SimulateStageArgs args)
 	}
 }
 
+// Velocity diffusion is vectorized over the close particle list, collision is handled by the scalar implementation
+template <typename IdxT>
+void WaterSimulatorImplAvx512::Stage4_DiffusionAndCollisionImpl(
+	SimulateStageArgs args, std::span<const WaterBlocker> waterBlockers)
+{
+	for (uint32_t a = args.loIdx; a < args.hiIdx; a++)
+	{
+		const __m512 posAX = _mm512_set1_ps(m_particlesPos1.x[a]);
+		const __m512 posAY = _mm512_set1_ps(m_particlesPos1.y[a]);
+		const __m512 posAZ = _mm512_set1_ps(m_particlesPos1.z[a]);
+		const __m512 velAX = _mm512_set1_ps(m_particlesVel1.x[a]);
+		const __m512 velAY = _mm512_set1_ps(m_particlesVel1.y[a]);
+		const __m512 velAZ = _mm512_set1_ps(m_particlesVel1.z[a]);
+
+		__m512 velChangeX = _mm512_setzero_ps();
+		__m512 velChangeY = _mm512_setzero_ps();
+		__m512 velChangeZ = _mm512_setzero_ps();
+
+		uint32_t numClose = GetCloseParticlesCount(a);
+		const IdxT* closeParticlesIdx = GetCloseParticlesIdxPtr<IdxT>(a);
+		__m512* closeParticlesDist = reinterpret_cast<__m512*>(GetCloseParticlesDistPtr(a));
+
+		uint32_t numSimdIterations = (numClose + PROC_PER_SIMD_ITERATION - 1) / PROC_PER_SIMD_ITERATION;
+
+		for (uint32_t bi = 0; bi < numSimdIterations; bi++)
+		{
+			__m512i indices = LoadIndicesX16(closeParticlesIdx + bi * PROC_PER_SIMD_ITERATION);
+			__m512 dist = closeParticlesDist[bi];
+
+			__m512 velBX = _mm512_i32gather_ps(indices, m_particlesVel1.x, sizeof(float));
+			__m512 velBY = _mm512_i32gather_ps(indices, m_particlesVel1.y, sizeof(float));
+			__m512 velBZ = _mm512_i32gather_ps(indices, m_particlesVel1.z, sizeof(float));
+
+			__m512 sepDirX = _mm512_div_ps(
+				_mm512_sub_ps(posAX, _mm512_i32gather_ps(indices, m_particlesPos1.x, sizeof(float))), dist);
+			__m512 sepDirY = _mm512_div_ps(
+				_mm512_sub_ps(posAY, _mm512_i32gather_ps(indices, m_particlesPos1.y, sizeof(float))), dist);
+			__m512 sepDirZ = _mm512_div_ps(
+				_mm512_sub_ps(posAZ, _mm512_i32gather_ps(indices, m_particlesPos1.z, sizeof(float))), dist);
+
+			__m512 velSepA = _mm512_add_ps(
+				_mm512_add_ps(_mm512_mul_ps(velAX, sepDirX), _mm512_mul_ps(velAY, sepDirY)),
+				_mm512_mul_ps(velAZ, sepDirZ));
+			__m512 velSepB = _mm512_add_ps(
+				_mm512_add_ps(_mm512_mul_ps(velBX, sepDirX), _mm512_mul_ps(velBY, sepDirY)),
+				_mm512_mul_ps(velBZ, sepDirZ));
+
+			// Only particles that are moving towards each other are affected. Entries outside of the influence
+			//  radius (padding and the Verlet skin) are also masked out, like in the scalar implementation.
+			__mmask16 approachingMask = _mm512_cmp_ps_mask(velSepA, velSepB, _CMP_LT_OQ) &
+			                            _mm512_cmp_ps_mask(dist, _mm512_set1_ps(INFLUENCE_RADIUS), _CMP_LT_OQ);
+			if (approachingMask == 0)
+				continue;
+
+			__m512 infl = _mm512_max_ps(
+				_mm512_sub_ps(_mm512_set1_ps(1), _mm512_mul_ps(dist, _mm512_set1_ps(1.0f / INFLUENCE_RADIUS))),
+				_mm512_setzero_ps());
+			__m512 velSepTarget = _mm512_mul_ps(_mm512_add_ps(velSepA, velSepB), _mm512_set1_ps(0.5f));
+			__m512 changeSepA = _mm512_mul_ps(
+				_mm512_mul_ps(_mm512_set1_ps(RADIAL_VISCOSITY_GAIN), _mm512_sub_ps(velSepTarget, velSepA)), infl);
+
+			velChangeX =
+				_mm512_mask_add_ps(velChangeX, approachingMask, velChangeX, _mm512_mul_ps(changeSepA, sepDirX));
+			velChangeY =
+				_mm512_mask_add_ps(velChangeY, approachingMask, velChangeY, _mm512_mul_ps(changeSepA, sepDirY));
+			velChangeZ =
+				_mm512_mask_add_ps(velChangeZ, approachingMask, velChangeZ, _mm512_mul_ps(changeSepA, sepDirZ));
+		}
+
+		glm::vec3 vel = m_particlesVel1[a];
+		vel.x += SumFloatx16(velChangeX);
+		vel.y += SumFloatx16(velChangeY);
+		vel.z += SumFloatx16(velChangeZ);
+
+		MoveAndCollideParticle(a, vel, args.dt, args.threadIndex, waterBlockers);
+	}
+}
+
 #endif
@@ -0,0 +1,16 @@
+#pragma once
+
+// Initial hash value for HashFNV1a64
+constexpr uint64_t FNV1A_64_OFFSET_BASIS = 0xCBF29CE484222325ULL;
+
+// Appends bytes to a 64-bit FNV-1a hash. Unlike std::hash, the result is the same across runs and builds, so it can
+//  be stored in files.
+inline uint64_t HashFNV1a64(uint64_t hash, std::span<const std::byte> bytes)
+{
+	for (std::byte b : bytes)
+	{
+		hash ^= static_cast<uint8_t>(b);
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
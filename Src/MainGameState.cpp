@@ -492,8 +492,36 @@ void MainGameState::DrawOverlay(float dt)
 
 	if (const IWaterSimulator* waterSim = GameRenderer::instance->m_waterSimulator.get())
 	{
-		textStream << "Water Spheres: " << waterSim->NumParticles() << "\n";
+		const uint32_t numSleeping = waterSim->NumSleepingParticles();
+		textStream << "Water Spheres: " << waterSim->NumParticles() << " (awake: "
+				   << waterSim->NumParticles() - numSleeping << ", asleep: " << numSleeping << ")\n";
 		textStream << "Water Update Time: " << (static_cast<double>(waterSim->LastUpdateTime()) / 1E6) << "ms\n";
+
+#ifdef IOMOMI_ENABLE_WATER
+		// Shows the average and maximum over the recent steps, since the time of a single step varies a lot
+		const WaterSimStatsSummary stats = waterSim->GetStats();
+		for (size_t s = 0; s < NUM_WATER_SIM_STAGES; s++)
+		{
+			if (stats.stageTimes[s].max > 0)
+			{
+				textStream << "  " << WATER_SIM_STAGE_NAMES[s] << ": " << stats.stageTimes[s].avg << "ms avg, "
+						   << stats.stageTimes[s].max << "ms max\n";
+			}
+		}
+		textStream << "  Query: " << stats.queryTime.avg << "ms avg, " << stats.queryTime.max << "ms max\n";
+
+		double maxBarrierWait = 0;
+		for (const WaterSimStatRange& barrierWait : stats.threadBarrierWaitTimes)
+			maxBarrierWait = std::max(maxBarrierWait, barrierWait.avg);
+		textStream << "  Barrier Wait: " << maxBarrierWait << "ms avg (max over threads)\n";
+		textStream << "Water Neighbours: " << stats.neighboursPerParticle.avg
+				   << " per sphere, outside grid: " << static_cast<uint32_t>(stats.particlesOutsideGrid.max) << "\n";
+		if (stats.numSubsteps.max > 1)
+		{
+			textStream << "Water Substeps: " << stats.numSubsteps.avg << " avg, "
+					   << static_cast<uint32_t>(stats.numSubsteps.max) << " max\n";
+		}
+#endif
 	}
 
 	if (m_currentLevelIndex != -1)
@@ -59,6 +59,8 @@ void LiquidPlaneComp::MaybeUpdate(const World& world)
 	std::sort(blockedByEntity.begin(), blockedByEntity.end(), Vec3Compare());
 	blockedByEntity.erase(std::unique(blockedByEntity.begin(), blockedByEntity.end()), blockedByEntity.end());
 
+	const std::shared_ptr<const VoxelAirBitset> voxelAir = world.voxels.GetAirBitset();
+
 	while (!bfsQueue.empty())
 	{
 		glm::ivec3 pos = bfsQueue.front();
@@ -69,7 +71,7 @@ void LiquidPlaneComp::MaybeUpdate(const World& world)
 			const glm::ivec3 next = pos + delta;
 			if (next.y > startI.y)
 				continue;
-			if (!world.voxels.IsAir(next))
+			if (!voxelAir->IsAir(next))
 				continue;
 			if (eg::SortedContains(blockedByEntity, next, Vec3Compare()))
 				continue;
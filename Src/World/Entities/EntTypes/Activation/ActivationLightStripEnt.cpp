@@ -123,7 +123,7 @@ void ActivationLightStripEnt::Update(const WorldUpdateArgs& args)
 #ifdef __EMSCRIPTEN__
 	if (regenerate)
 	{
-		GenerateResult result = Generate(args.world->voxels, GetWayPointsWithStartAndEnd());
+		GenerateResult result = Generate(*args.world->voxels.GetAirBitset(), GetWayPointsWithStartAndEnd());
 		SetGenerateResult(result);
 		regenerate = false;
 	}
@@ -137,9 +137,9 @@ void ActivationLightStripEnt::Update(const WorldUpdateArgs& args)
 	if (!m_generationFuture.valid() && regenerate)
 	{
 		m_generationFuture = std::async(
-			std::launch::async, [points = GetWayPointsWithStartAndEnd(), voxels = args.world->voxels,
+			std::launch::async, [points = GetWayPointsWithStartAndEnd(), voxelAir = args.world->voxels.GetAirBitset(),
 		                         self = std::dynamic_pointer_cast<ActivationLightStripEnt>(shared_from_this())]()
-			{ return self->Generate(voxels, points); });
+			{ return self->Generate(*voxelAir, points); });
 		regenerate = false;
 	}
 #endif
@@ -216,7 +216,7 @@ static const Dir ORTHO_DIRS[3][4] = {
 };
 
 ActivationLightStripEnt::GenerateResult ActivationLightStripEnt::Generate(
-	const VoxelBuffer& voxels, std::span<const WayPoint> points)
+	const VoxelAirBitset& voxelAir, std::span<const WayPoint> points)
 {
 	struct NodeData
 	{
@@ -249,7 +249,7 @@ ActivationLightStripEnt::GenerateResult ActivationLightStripEnt::Generate(
 				{
 					const glm::ivec3 actPos =
 						glm::floor(glm::vec3(pos.doublePos - dirU * du - dirV * dv + dirN * (dn * 2 - 1)) / 2.0f);
-					isAir[du][dv][dn] = voxels.IsAir(actPos);
+					isAir[du][dv][dn] = voxelAir.IsAir(actPos);
 				}
 			}
 		}
@@ -69,7 +69,7 @@ private:
 		float maxTransitionProgress;
 	};
 
-	static GenerateResult Generate(const VoxelBuffer& voxels, std::span<const WayPoint> points);
+	static GenerateResult Generate(const VoxelAirBitset& voxelAir, std::span<const WayPoint> points);
 
 	void SetGenerateResult(GenerateResult& result);
 
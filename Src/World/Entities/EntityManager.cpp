@@ -67,12 +67,14 @@ void EntityManager::ComponentTracker::MaybeAdd(const std::shared_ptr<Ent>& entit
 	}
 }
 
-EntityManager EntityManager::Deserialize(std::istream& stream)
+EntityManager EntityManager::Deserialize(std::istream& stream, std::span<const EntTypeID> onlyEntityTypes)
 {
 	std::unordered_map<uint32_t, const EntType*> serializerMap;
 	magic_enum::enum_for_each<EntTypeID>(
 		[&](EntTypeID entityTypeID)
 		{
+			if (!onlyEntityTypes.empty() && !eg::Contains(onlyEntityTypes, entityTypeID))
+				return;
 			if (const EntType* type = Ent::GetTypeByID(entityTypeID))
 			{
 				serializerMap.emplace(eg::HashFNV1a32(type->name), type);
@@ -93,6 +95,8 @@ EntityManager EntityManager::Deserialize(std::istream& stream)
 		auto it = serializerMap.find(serializerHash);
 		if (it == serializerMap.end())
 		{
+			if (!onlyEntityTypes.empty())
+				continue;
 			eg::Log(eg::LogLevel::Error, "ecs", "Failed to find entity serializer with hash {0}", serializerHash);
 			continue;
 		}
@@ -33,7 +33,8 @@ public:
 
 	void Update(const struct WorldUpdateArgs& args);
 
-	static EntityManager Deserialize(std::istream& stream);
+	// If onlyEntityTypes is not empty, entities of other types are skipped
+	static EntityManager Deserialize(std::istream& stream, std::span<const EntTypeID> onlyEntityTypes = {});
 
 	void Serialize(std::ostream& stream) const;
 
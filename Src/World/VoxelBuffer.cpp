@@ -1,5 +1,8 @@
 #include "VoxelBuffer.hpp"
 
+#include <atomic>
+#include <thread>
+
 std::pair<glm::ivec3, glm::ivec3> VoxelBuffer::CalculateBounds() const
 {
 	glm::ivec3 boundsMin(INT_MAX);
@@ -14,6 +17,63 @@ std::pair<glm::ivec3, glm::ivec3> VoxelBuffer::CalculateBounds() const
 	return std::make_pair(boundsMin, boundsMax);
 }
 
+// The air bitset is built by multiple threads when there are at least this many air voxels per thread
+static constexpr size_t MIN_AIR_BITSET_VOXELS_PER_THREAD = 64 * 1024;
+
+std::shared_ptr<const VoxelAirBitset> VoxelBuffer::GetAirBitset() const
+{
+	if (m_airBitset != nullptr)
+		return m_airBitset;
+
+	std::shared_ptr<VoxelAirBitset> bitset = std::make_shared<VoxelAirBitset>();
+	if (m_voxels.empty())
+	{
+		m_airBitset = std::move(bitset);
+		return m_airBitset;
+	}
+
+	glm::ivec3 maxBounds;
+	std::tie(bitset->m_minBounds, maxBounds) = CalculateBounds();
+	bitset->m_size = maxBounds - bitset->m_minBounds;
+	bitset->m_bits.resize((bitset->BitIndex(bitset->m_size - 1) + 8) / 8, 0);
+
+	size_t numThreads = 1;
+#ifndef __EMSCRIPTEN__
+	numThreads = std::clamp<size_t>(
+		m_voxels.size() / MIN_AIR_BITSET_VOXELS_PER_THREAD, 1, std::max(std::thread::hardware_concurrency(), 1u));
+#endif
+
+	// Visits the air voxels bucket by bucket, rather than looking up every voxel in the bounds. Threads can share
+	//  bytes, so bits are set atomically when there are multiple threads.
+	auto FillBuckets = [&](size_t thread)
+	{
+		const size_t firstBucket = m_voxels.bucket_count() * thread / numThreads;
+		const size_t endBucket = m_voxels.bucket_count() * (thread + 1) / numThreads;
+		for (size_t bucket = firstBucket; bucket < endBucket; bucket++)
+		{
+			for (auto it = m_voxels.begin(bucket); it != m_voxels.end(bucket); ++it)
+			{
+				const size_t index = bitset->BitIndex(it->first - bitset->m_minBounds);
+				const uint8_t bit = static_cast<uint8_t>(1 << (index % 8));
+				if (numThreads == 1)
+					bitset->m_bits[index / 8] |= bit;
+				else
+					std::atomic_ref<uint8_t>(bitset->m_bits[index / 8]).fetch_or(bit, std::memory_order_relaxed);
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t thread = 1; thread < numThreads; thread++)
+		threads.emplace_back(FillBuckets, thread);
+	FillBuckets(0);
+	for (std::thread& thread : threads)
+		thread.join();
+
+	m_airBitset = std::move(bitset);
+	return m_airBitset;
+}
+
 void VoxelBuffer::SetIsAir(const glm::ivec3& pos, bool air)
 {
 	auto voxelIt = m_voxels.find(pos);
@@ -22,6 +82,31 @@ void VoxelBuffer::SetIsAir(const glm::ivec3& pos, bool air)
 	if (alreadyAir == air)
 		return;
 
+	// Updates the cached air bitset in place, so that editing voxels doesn't rebuild it every time. This requires
+	//  the bounds to stay valid, so pos must not be on the outermost layer of the bitset. Snapshots that are shared
+	//  with other code must not change, so the bitset is copied first if it is.
+	if (m_airBitset != nullptr)
+	{
+		const glm::ivec3 rel = pos - m_airBitset->m_minBounds;
+		if (glm::all(glm::greaterThanEqual(rel, glm::ivec3(1))) &&
+		    glm::all(glm::lessThan(rel, m_airBitset->m_size - 1)))
+		{
+			if (m_airBitset.use_count() > 1)
+				m_airBitset = std::make_shared<VoxelAirBitset>(*m_airBitset);
+
+			const size_t index = m_airBitset->BitIndex(rel);
+			const uint8_t bit = static_cast<uint8_t>(1 << (index % 8));
+			if (air)
+				m_airBitset->m_bits[index / 8] |= bit;
+			else
+				m_airBitset->m_bits[index / 8] &= static_cast<uint8_t>(~bit);
+		}
+		else
+		{
+			m_airBitset.reset();
+		}
+	}
+
 	if (alreadyAir)
 	{
 		m_voxels.erase(voxelIt);
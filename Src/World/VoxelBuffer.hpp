@@ -1,5 +1,6 @@
 #pragma once
 
+#include <span>
 #include <unordered_map>
 
 #include "../Vec3Compare.hpp"
@@ -14,6 +15,43 @@ struct VoxelRayIntersectResult
 	float intersectDist;
 };
 
+// Dense snapshot of which voxels in a box are air, with one bit per voxel. Much faster to query than VoxelBuffer,
+//  but it doesn't see later changes to the voxels. Voxels outside of the box are solid. Bits are stored in x, then y,
+//  then z order, which is the layout that the water simulator uses.
+class VoxelAirBitset
+{
+public:
+	friend class VoxelBuffer;
+
+	VoxelAirBitset() = default;
+
+	bool IsAir(const glm::ivec3& pos) const
+	{
+		const glm::ivec3 rel = pos - m_minBounds;
+		if (rel.x < 0 || rel.y < 0 || rel.z < 0 || rel.x >= m_size.x || rel.y >= m_size.y || rel.z >= m_size.z)
+			return false;
+		const size_t index = BitIndex(rel);
+		return (m_bits[index / 8] >> (index % 8)) & 1;
+	}
+
+	// The box covered by the bitset, where maxBounds is exclusive
+	const glm::ivec3& MinBounds() const { return m_minBounds; }
+	glm::ivec3 MaxBounds() const { return m_minBounds + m_size; }
+
+	std::span<const uint8_t> Bytes() const { return m_bits; }
+
+private:
+	size_t BitIndex(const glm::ivec3& rel) const
+	{
+		return static_cast<size_t>(rel.x) + static_cast<size_t>(m_size.x) * rel.y +
+		       static_cast<size_t>(m_size.x) * static_cast<size_t>(m_size.y) * rel.z;
+	}
+
+	glm::ivec3 m_minBounds{ 0 };
+	glm::ivec3 m_size{ 0 };
+	std::vector<uint8_t> m_bits;
+};
+
 class VoxelBuffer
 {
 public:
@@ -39,6 +77,11 @@ public:
 
 	std::pair<glm::ivec3, glm::ivec3> CalculateBounds() const;
 
+	// Returns a snapshot of the air voxels within a box that contains CalculateBounds. The snapshot is built on first
+	//  use and never changes once returned, so it can be kept by other threads. SetIsAir keeps the cached snapshot up
+	//  to date for later calls. Must not be called concurrently with itself or with SetIsAir.
+	std::shared_ptr<const VoxelAirBitset> GetAirBitset() const;
+
 private:
 	glm::ivec4 GetGravityCornerVoxelPos(glm::ivec3 cornerPos, Dir cornerDir) const;
 
@@ -52,4 +95,7 @@ private:
 
 	std::unordered_map<glm::ivec3, AirVoxel, IVec3Hash> m_voxels;
 	bool m_modified = false;
+
+	// Updated by SetIsAir, or cleared if the changed voxel is on its outermost layer or outside of it
+	mutable std::shared_ptr<VoxelAirBitset> m_airBitset;
 };
@@ -3,6 +3,7 @@
 #include "../../Protobuf/Build/World.pb.h"
 #include "../Graphics/Materials/GravityCornerLightMaterial.hpp"
 #include "../Graphics/WallShader.hpp"
+#include "../HashFNV1a64.hpp"
 #include "Entities/Components/ActivatorComp.hpp"
 #include "Entities/EntTypes/Activation/CubeEnt.hpp"
 #include "Entities/EntTypes/Activation/CubeSpawnerEnt.hpp"
@@ -37,7 +38,7 @@ struct __attribute__((__packed__, __may_alias__)) VoxelData
 	uint16_t hasGravityCorner;
 };
 
-std::unique_ptr<World> World::Load(std::istream& stream, bool isEditor)
+std::unique_ptr<World> World::Load(std::istream& stream, bool isEditor, std::span<const EntTypeID> onlyEntityTypes)
 {
 	char magicBuf[sizeof(MAGIC)];
 	stream.read(magicBuf, sizeof(magicBuf));
@@ -60,6 +61,7 @@ std::unique_ptr<World> World::Load(std::istream& stream, bool isEditor)
 	uint32_t numVoxels = eg::BinRead<uint32_t>(stream);
 	std::vector<VoxelData> voxelData(numVoxels);
 	eg::ReadCompressedSection(stream, voxelData.data(), numVoxels * sizeof(VoxelData));
+	world->contentHash = HashFNV1a64(FNV1A_64_OFFSET_BASIS, std::as_bytes(std::span(voxelData)));
 
 	// Parses voxel data
 	for (const VoxelData& data : voxelData)
@@ -79,6 +81,7 @@ std::unique_ptr<World> World::Load(std::istream& stream, bool isEditor)
 	uint64_t dataSize = eg::BinRead<uint64_t>(stream);
 	std::vector<char> data(dataSize);
 	stream.read(data.data(), dataSize);
+	world->contentHash = HashFNV1a64(world->contentHash, std::as_bytes(std::span(data)));
 	iomomi_pb::World worldPB;
 	worldPB.ParseFromArray(data.data(), eg::ToInt(dataSize));
 
@@ -105,7 +108,12 @@ std::unique_ptr<World> World::Load(std::istream& stream, bool isEditor)
 			world->ssrIntensity = worldPB.ssr_intensity();
 	}
 
-	world->entManager = EntityManager::Deserialize(stream);
+	// Entity data extends to the end of the file, and is read into memory first so that it can be hashed
+	std::vector<char> entityData{ std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+	world->contentHash = HashFNV1a64(world->contentHash, std::as_bytes(std::span(entityData)));
+	eg::MemoryStreambuf entityStreambuf(entityData);
+	std::istream entityStream(&entityStreambuf);
+	world->entManager = EntityManager::Deserialize(entityStream, onlyEntityTypes);
 
 	world->voxels.m_modified = true;
 	world->m_isLatestVersion = version == CURRENT_VERSION;
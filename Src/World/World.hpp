@@ -46,7 +46,10 @@ class World
 public:
 	World();
 
-	static std::unique_ptr<World> Load(std::istream& stream, bool isEditor);
+	// onlyEntityTypes is passed on to EntityManager::Deserialize. Loading only some entity types is used to load
+	//  levels without graphics, since many entity types need assets.
+	static std::unique_ptr<World> Load(
+		std::istream& stream, bool isEditor, std::span<const EntTypeID> onlyEntityTypes = {});
 
 	void Save(std::ostream& outStream) const;
 
@@ -76,6 +79,10 @@ public:
 	uint32_t extraWaterParticles = 0;
 	uint32_t waterPresimIterations = 100;
 
+	// Hash of the voxel, settings and entity data that the world was loaded from, or 0 if it was not loaded from a
+	//  file. Used as the key for data that is cached between loads of the same level.
+	uint64_t contentHash = 0;
+
 	glm::vec3 thumbnailCameraPos;
 	glm::vec3 thumbnailCameraDir;
 
@@ -0,0 +1,253 @@
+// Headless benchmark for the water simulator, built as the iomomi-waterbench target. Loads the water levels without
+//  graphics, generates their water and simulates it for a fixed number of steps with each instruction set that the
+//  CPU supports. Results are written as JSON, to stdout or to the file given by --out.
+//
+// Each level is also presimulated for its number of presimulation steps, with fixed steps and with adaptive time
+//  stepping, to show how many steps adaptive time stepping saves. After that, the stages that have simd
+//  implementations are compared against the scalar implementation for each supported simd instruction set, and any
+//  mismatches are reported under "simdCheck".
+//
+// The simulation runs in reproducible mode, so every run simulates the same thing. With --golden, the hash of the
+//  final particle state of each run is compared against the one stored in the given file. The exit code is 2 if any
+//  hash differs or is missing from the file, and 1 if the file doesn't exist. With --update-golden, the hashes are
+//  instead written to the given file, replacing the ones stored for the same level, instruction set and step count.
+//
+// Usage: iomomi-waterbench [--steps N] [--levels DIRECTORY] [--out FILE] [--golden FILE | --update-golden FILE]
+
+#include <google/protobuf/stubs/common.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+
+#include "../Src/Graphics/Water/WaterBenchmark.hpp"
+#include "../Src/World/Entities/Entity.hpp"
+#include "../Src/World/World.hpp"
+
+// Entity types that affect the water simulation. These can be loaded without assets, unlike many other entity types.
+static const EntTypeID WATER_ENTITY_TYPES[] = {
+	EntTypeID::WaterPlane, EntTypeID::WaterWall, EntTypeID::GravityBarrier, EntTypeID::SlidingWall, EntTypeID::Pump,
+};
+
+static void WriteJSONNumber(std::ostream& stream, double value)
+{
+	if (std::isfinite(value))
+		stream << value;
+	else
+		stream << "null";
+}
+
+static void WriteBenchmarkResultJSON(std::ostream& stream, WaterSimIsa isa, const WaterBenchmarkResult& result)
+{
+	stream << "{\"isa\": \"" << WATER_SIM_ISA_NAMES[static_cast<size_t>(isa)] << "\", \"impl\": \""
+		   << result.implName << "\", \"stepsPerSecond\": ";
+	WriteJSONNumber(stream, result.stepsPerSecond);
+	stream << ", \"stateHash\": \"" << std::hex << result.stateHash << std::dec
+		   << "\", \"closeParticleRebuilds\": " << result.closeParticleRebuilds << ", \"finalMaxSpeed\": ";
+	WriteJSONNumber(stream, result.finalMaxSpeed);
+	stream << ", \"stageMilliseconds\": {";
+	for (size_t s = 0; s < NUM_WATER_SIM_STAGES; s++)
+	{
+		stream << (s == 0 ? "" : ", ") << "\"" << WATER_SIM_STAGE_NAMES[s] << "\": ";
+		WriteJSONNumber(stream, result.stageMilliseconds[s]);
+	}
+	stream << "}}";
+}
+
+static void WritePresimResultJSON(
+	std::ostream& stream, const WaterPresimBenchmarkResult& fixed, const WaterPresimBenchmarkResult& adaptive)
+{
+	stream << "{\"steps\": " << fixed.numPresimSteps << ", \"fixedSimulatedSteps\": " << fixed.numSimulatedSteps
+		   << ", \"adaptiveSimulatedSteps\": " << adaptive.numSimulatedSteps << ", \"stepsSaved\": "
+		   << static_cast<int>(fixed.numSimulatedSteps) - static_cast<int>(adaptive.numSimulatedSteps)
+		   << ", \"adaptiveMaxSubsteps\": " << adaptive.maxSubsteps << ", \"fixedMilliseconds\": ";
+	WriteJSONNumber(stream, fixed.milliseconds);
+	stream << ", \"adaptiveMilliseconds\": ";
+	WriteJSONNumber(stream, adaptive.milliseconds);
+	stream << ", \"fixedFinalMaxSpeed\": ";
+	WriteJSONNumber(stream, fixed.finalMaxSpeed);
+	stream << ", \"adaptiveFinalMaxSpeed\": ";
+	WriteJSONNumber(stream, adaptive.finalMaxSpeed);
+	stream << "}";
+}
+
+static void WriteSimdCheckResultJSON(std::ostream& stream, const WaterSimdCheckResult& result)
+{
+	const WaterSimdAgreementResult& agreement = result.agreement;
+	stream << "{\"isa\": \"" << WATER_SIM_ISA_NAMES[static_cast<size_t>(result.isa)] << "\", \"impl\": \""
+		   << result.implName << "\", \"agrees\": " << (agreement.Agrees() ? "true" : "false")
+		   << ", \"closeParticleListMismatches\": " << agreement.closeParticleListMismatches
+		   << ", \"maxCloseParticleDistError\": ";
+	WriteJSONNumber(stream, agreement.maxCloseParticleDistError);
+	stream << ", \"maxPositionError\": ";
+	WriteJSONNumber(stream, agreement.maxPositionError);
+	stream << ", \"maxVelocityError\": ";
+	WriteJSONNumber(stream, agreement.maxVelocityError);
+	stream << "}";
+}
+
+int main(int argc, char** argv)
+{
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+	uint32_t numSteps = 100;
+	std::string levelsDirPath = eg::ExeRelPath("Levels");
+	std::string outputPath;
+	std::string goldenPath;
+	bool updateGolden = false;
+	for (int i = 1; i < argc; i += 2)
+	{
+		std::string_view arg = argv[i];
+		if (i + 1 == argc)
+		{
+			std::cerr << "Missing value for " << arg << "\n";
+			return 1;
+		}
+		if (arg == "--steps")
+			numSteps = static_cast<uint32_t>(std::max(std::atoi(argv[i + 1]), 1));
+		else if (arg == "--levels")
+			levelsDirPath = argv[i + 1];
+		else if (arg == "--out")
+			outputPath = argv[i + 1];
+		else if (arg == "--golden" || arg == "--update-golden")
+		{
+			goldenPath = argv[i + 1];
+			updateGolden = arg == "--update-golden";
+		}
+		else
+		{
+			std::cerr << "Unknown argument " << arg << "\n";
+			return 1;
+		}
+	}
+
+	std::vector<std::filesystem::path> levelPaths;
+	for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(levelsDirPath))
+	{
+		const std::string fileName = entry.path().filename().string();
+		if (fileName.starts_with("water_") && entry.path().extension() == ".gwd")
+			levelPaths.push_back(entry.path());
+	}
+	std::sort(levelPaths.begin(), levelPaths.end());
+
+	if (levelPaths.empty())
+	{
+		std::cerr << "No water levels found in " << levelsDirPath << "\n";
+		return 1;
+	}
+
+	// Golden hashes are stored one per line as: level isa steps hash
+	std::map<std::string, uint64_t> goldenHashes;
+	if (std::ifstream goldenFile(goldenPath); goldenFile)
+	{
+		std::string level, isa;
+		uint32_t steps;
+		uint64_t hash;
+		while (goldenFile >> level >> isa >> steps >> std::hex >> hash >> std::dec)
+			goldenHashes.emplace(level + " " + isa + " " + std::to_string(steps), hash);
+	}
+	else if (!goldenPath.empty() && !updateGolden)
+	{
+		std::cerr << "Golden hash file " << goldenPath << " not found, use --update-golden to create it\n";
+		return 1;
+	}
+	bool goldenHashMismatch = false;
+
+	std::ofstream outputFile;
+	if (!outputPath.empty())
+		outputFile.open(outputPath);
+	std::ostream& output = outputPath.empty() ? std::cout : outputFile;
+	output << std::fixed << std::setprecision(4);
+
+	output << "{\"steps\": " << numSteps << ", \"levels\": [";
+	for (size_t l = 0; l < levelPaths.size(); l++)
+	{
+		std::ifstream levelStream(levelPaths[l], std::ios::binary);
+		std::unique_ptr<World> world = World::Load(levelStream, false, WATER_ENTITY_TYPES);
+		if (world == nullptr)
+		{
+			std::cerr << "Failed to load " << levelPaths[l].string() << "\n";
+			return 1;
+		}
+
+		WaterBenchmarkScene scene = WaterBenchmarkScene::CreateFromWorld(*world);
+		scene.reproducible = true;
+
+		output << (l == 0 ? "" : ",") << "\n  {\"name\": \"" << levelPaths[l].stem().string()
+			   << "\", \"particles\": " << scene.particlePositions.size()
+			   << ", \"waterBlockers\": " << scene.waterBlockers.size()
+			   << ", \"waterPumps\": " << scene.waterPumps.size() << ", \"results\": [";
+
+		if (!scene.particlePositions.empty())
+		{
+			bool first = true;
+			for (size_t isa = 0; isa < NUM_WATER_SIM_ISAS; isa++)
+			{
+				scene.isa = static_cast<WaterSimIsa>(isa);
+				if (!WaterSimulatorImpl::IsIsaSupported(*scene.isa))
+					continue;
+
+				WaterBenchmarkResult result = RunWaterBenchmark(scene, numSteps);
+				output << (first ? "" : ",") << "\n    ";
+				WriteBenchmarkResultJSON(output, *scene.isa, result);
+				first = false;
+
+				if (goldenPath.empty())
+					continue;
+				const std::string goldenKey = levelPaths[l].stem().string() + " " + WATER_SIM_ISA_NAMES[isa] + " " +
+				                              std::to_string(numSteps);
+				auto goldenIt = goldenHashes.find(goldenKey);
+				if (updateGolden)
+				{
+					goldenHashes[goldenKey] = result.stateHash;
+				}
+				else if (goldenIt == goldenHashes.end())
+				{
+					std::cerr << "No golden state hash for " << goldenKey << ", use --update-golden to add it\n";
+					goldenHashMismatch = true;
+				}
+				else if (goldenIt->second != result.stateHash)
+				{
+					std::cerr << "State hash mismatch for " << goldenKey << ": expected " << std::hex
+							  << goldenIt->second << ", got " << result.stateHash << std::dec << "\n";
+					goldenHashMismatch = true;
+				}
+			}
+		}
+
+		output << "]";
+		if (!scene.particlePositions.empty())
+		{
+			scene.isa = std::nullopt;
+			const uint32_t presimSteps = world->waterPresimIterations;
+			const WaterPresimBenchmarkResult fixed = RunWaterPresimBenchmark(scene, presimSteps, std::nullopt);
+			const WaterPresimBenchmarkResult adaptive =
+				RunWaterPresimBenchmark(scene, presimSteps, WaterAdaptiveTimeStepSettings());
+			output << ", \"presim\": ";
+			WritePresimResultJSON(output, fixed, adaptive);
+
+			const std::vector<WaterSimdCheckResult> simdCheckResults = RunWaterSimdCheck(scene, numSteps, 1);
+			output << ", \"simdCheck\": [";
+			for (size_t i = 0; i < simdCheckResults.size(); i++)
+			{
+				output << (i == 0 ? "" : ",") << "\n    ";
+				WriteSimdCheckResultJSON(output, simdCheckResults[i]);
+			}
+			output << "]";
+		}
+		output << "}";
+		output.flush();
+	}
+	output << "\n]}\n";
+
+	if (updateGolden)
+	{
+		std::ofstream goldenFile(goldenPath);
+		for (const auto& [key, hash] : goldenHashes)
+			goldenFile << key << " " << std::hex << hash << std::dec << "\n";
+	}
+
+	return goldenHashMismatch ? 2 : 0;
+}